@@ -6,6 +6,8 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
 #include "libfat/fat.h"
 
 #define FALSE 0
@@ -13,6 +15,8 @@
 
 #define COMMAND_NAME "fat_man"
 #define MAX_COMMAND_ARGUMENTS 4
+// Elements listed at a time by ls
+#define LS_BATCH_SIZE 64
 
 /**
  * Utility functions
@@ -185,7 +189,7 @@ FatResult cmd_ec(FatFs *fs, const char *external_path, const char *internal_path
     // Open the file in write mode in the internal fs
     file_erase(fs, internal_path);
     FileHandle *file;
-    FatResult res = file_open(fs, internal_path, &file, "w+");
+    FatResult res = file_open(fs, internal_path, &file, "wd+");
     if (res != OK) {
         fclose(external_file);
         return res;
@@ -234,7 +238,7 @@ FatResult cmd_repeat(FatFs *fs, const char *path, char *character, int bytes) {
 
     // Open the file in write mode in the internal fs
     FileHandle *file;
-    FatResult res = file_open(fs, path, &file, "a+");
+    FatResult res = file_open(fs, path, &file, "ad+");
     if (res != OK)
         return res;
 
@@ -324,7 +328,6 @@ FatResult cmd_ls(FatFs *fs, char **command_arguments) {
         return INVALID_PATH;
 
     DirHandle *dir = NULL;
-    DirEntry entry;
     FatResult res;
     ls_args args = {0};
     char **arg = command_arguments;
@@ -342,7 +345,7 @@ FatResult cmd_ls(FatFs *fs, char **command_arguments) {
     }
 
     // Open the correct directory
-    char *dir_path, old_path[MAX_PATH_LENGTH];
+    char *dir_path;
     if (!args.argument_path) 
         dir_path = fs->current_directory;
     else 
@@ -351,76 +354,69 @@ FatResult cmd_ls(FatFs *fs, char **command_arguments) {
     res = dir_open(fs, dir_path, &dir);
     if (res != OK)
         return res;
-    strcpy(old_path, fs->current_directory);
-    
-    res = dir_change(fs, dir_path);
-    if (res != OK)
-        return res;
-    
+
     // Loop for directory stats and alphabetic sorting
     int max_size = 10, spaces_size = 1, max_blocks = 10, spaces_blocks = 1;
     LsList *head = NULL;
-    while ((res = dir_list(dir, &entry)) == OK) {
-        LsList *elem = malloc(sizeof(LsList));
-
-        if (entry.type == DIR_ENTRY_DIRECTORY) {
-            res = file_size(fs, entry.name, &elem->size, &elem->blocks);
-            if (res != OK) {
-                dir_change(fs, old_path);
-                dir_close(dir);
-                return res;
+    DirEntryPlus batch[LS_BATCH_SIZE];
+    int count;
+    while ((count = dir_list_batch(dir, batch, LS_BATCH_SIZE)) > 0) {
+        for (int j = 0; j < count; j++) {
+            DirEntryPlus *plus = &batch[j];
+            LsList *elem = malloc(sizeof(LsList));
+            elem->size = plus->size;
+            elem->blocks = plus->blocks;
+
+            if (plus->entry.type == DIR_ENTRY_DIRECTORY) {
+                strcpy(elem->date_created, "--");
+                strcpy(elem->date_modified, "--");
+            }
+            else {
+                format_date(&plus->date_created, elem->date_created);
+                format_date(&plus->date_modified, elem->date_modified);
             }
 
-            strcpy(elem->date_created, "--");
-            strcpy(elem->date_modified, "--");
-        } 
-        else {
-            FileHeader *fh = (FileHeader *) 
-                (fs->blocks_ptr + entry.first_block * fs->header->block_size);
-
-            res = file_size(fs, entry.name, &elem->size, &elem->blocks);
-            if (res != OK) {
-                dir_change(fs, old_path);
-                dir_close(dir);
-                return res;
+            // Get the max size of the elements
+            while (elem->size >= max_size) {
+                max_size *= 10;
+                spaces_size++;
             }
 
-            format_date(&fh->date_created, elem->date_created);
-            format_date(&fh->date_modified, elem->date_modified);
-            elem->size = fh->size;
-        }
+            // Get the max blocks of the elements
+            while (elem->blocks >= max_blocks) {
+                max_blocks *= 10;
+                spaces_blocks++;
+            }
 
-        // Get the max size of the elements
-        while (elem->size >= max_size) {
-            max_size *= 10;
-            spaces_size++;
-        }
+            strcpy(elem->name, plus->entry.name);
+            elem->type = plus->entry.type;
+            elem->next = NULL;
 
-        // Get the max blocks of the elements
-        while (elem->blocks >= max_blocks) {
-            max_blocks *= 10;
-            spaces_blocks++;
-        }
-
-        strcpy(elem->name, entry.name);
-        elem->type = entry.type;
-        elem->next = NULL;
+            // Order items by name
+            // If "elem" is smaller than the first element
+            if (head == NULL || strcmp(elem->name, head->name) < 0) {
+                elem->next = head;
+                head = elem;
+            }
+            // All other elements
+            else {
+                LsList *tmp = head;
+                while (tmp->next != NULL && strcmp(tmp->next->name, elem->name) < 0)
+                    tmp = tmp->next;
 
-        // Order items by name
-        // If "elem" is smaller than the first element
-        if (head == NULL || strcmp(elem->name, head->name) < 0) {
-            elem->next = head;
-            head = elem;
+                elem->next = tmp->next;
+                tmp->next = elem;
+            }
         }
-        // All other elements
-        else {
+    }
+    if (count < 0) {
+        while (head != NULL) {
             LsList *tmp = head;
-            while (tmp->next != NULL && strcmp(tmp->next->name, elem->name) < 0)
-                tmp = tmp->next;
-
-            elem->next = tmp->next;
-            tmp->next = elem;
+            head = head->next;
+            free(tmp);
         }
+        dir_close(dir);
+        return count;
     }
 
     if (args.argument_long)
@@ -497,11 +493,6 @@ FatResult cmd_ls(FatFs *fs, char **command_arguments) {
     }
     if (!args.argument_long) printf("\n");
 
-    // Change back to the previous directory
-    res = dir_change(fs, old_path);
-    if (res != OK)
-        return res;
-
     // Close the directory
     res = dir_close(dir);
     if (res != OK)
@@ -576,14 +567,96 @@ void help() {
 
 void help_init() {
     printf(
-        "Usage: "COMMAND_NAME" -i <file> blocks <blocks count> size <block size>\n"
+        "Usage: "COMMAND_NAME" -i <file> blocks <blocks count> size <block size> [extents] [fat16] [dirindex] [dirsorted] [dirusage]\n"
         " Initializes a file system with <blocks count> blocks of size <block size> Bytes\n"
         " Note: both values should be positive and divisible by 32\n"
+        " With \"extents\" the files keep a map of their extents (blocks of at least 128 Bytes)\n"
+        " With \"fat16\" the FAT table has 16-bit entries (at most 65535 blocks)\n"
+        " With \"dirindex\" the directories keep a hash index of their entries\n"
+        " With \"dirsorted\" the index also keeps the entries sorted by name, and they are listed in order\n"
+        " With \"dirusage\" the directories also keep the total size of their contents (blocks of at least 96 Bytes)\n"
         "Usage: "COMMAND_NAME" -i -s <file>\n"
         " Shows a prompt to initialize the file system\n"
     );
 }
 
+/**
+ * Defragment a file or every file and directory inside a directory
+ */
+typedef struct DefragStats {
+    int entries;
+    int moved_entries;
+    int moved_blocks;
+    int budget;
+    struct timespec start;
+    FatResult res;
+} DefragStats;
+
+// Returns the seconds passed since the start of the defragmentation
+double defrag_elapsed(DefragStats *stats) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - stats->start.tv_sec) + (now.tv_nsec - stats->start.tv_nsec) / 1e9;
+}
+
+// Moves the blocks of an element
+FatResult defrag_element(FatFs *fs, const char *path, DefragStats *stats) {
+    int moved_blocks;
+    FatResult res = file_defrag(fs, path, &moved_blocks);
+    if (res != OK)
+        return res;
+
+    stats->entries++;
+    if (moved_blocks > 0) {
+        stats->moved_entries++;
+        stats->moved_blocks += moved_blocks;
+        printf("Moved %s (%d blocks)\n", path, moved_blocks);
+
+        // Don't move more blocks per second than the budget
+        if (stats->budget > 0) {
+            double wait = (double)stats->moved_blocks / stats->budget - defrag_elapsed(stats);
+            if (wait > 0)
+                usleep(wait * 1e6);
+        }
+    }
+
+    return OK;
+}
+
+// Moves the blocks of an element found by fat_walk, before the ones in it
+FatWalkAction defrag_walk(FatFs *fs, const char *path, const DirEntry *entry, int depth, void *arg) {
+    DefragStats *stats = arg;
+    stats->res = defrag_element(fs, path, stats);
+    return stats->res == OK ? FAT_WALK_CONTINUE : FAT_WALK_STOP;
+}
+
+FatResult cmd_defrag(FatFs *fs, const char *path, const char *budget) {
+    DefragStats stats = {0};
+    stats.budget = budget ? atoi(budget) : 0;
+    clock_gettime(CLOCK_MONOTONIC, &stats.start);
+
+    // Move the element itself (the root can't be moved)
+    FatResult res = OK;
+    if (strcmp(path, "/") != 0)
+        res = defrag_element(fs, path, &stats);
+
+    // Continue with its children if it is a directory
+    if (res == OK) {
+        int walk = fat_walk(fs, path, defrag_walk, 0, &stats);
+        if (walk == FAT_WALK_STOP)
+            res = stats.res;
+        else if (walk != NOT_A_DIRECTORY)
+            res = walk;
+    }
+
+    double elapsed = defrag_elapsed(&stats);
+    printf("Moved %d of %d elements (%d blocks, %d Bytes) in %.2f s\n",
+        stats.moved_entries, stats.entries, stats.moved_blocks,
+        stats.moved_blocks * fs->header->block_size, elapsed);
+
+    return res;
+}
+
 /**
  * Help commands
  * @author Claziero
@@ -594,7 +667,7 @@ FatResult cmd_help(char *command) {
             "Usage: " TEXT_GREEN "help <command>" TEXT_RESET "\n"
             " Available commands:\n"
             "   cd   repeat   mkdir   mv   touch   rm   free   cat\n"
-            "   ls   append   rmdir   ec   write   cp   size\n"
+            "   ls   append   rmdir   ec   write   cp   size   defrag\n"
         );
 
     else if (strcmp(command, "cd") == 0) 
@@ -698,6 +771,15 @@ FatResult cmd_help(char *command) {
             "Usage: " TEXT_GREEN "free" TEXT_RESET "\n"
             " Prints the number of free blocks and available Bytes in the file system\n"
         );
+    else if (strcmp(command, "defrag") == 0)
+        printf(
+            "Usage: " TEXT_GREEN "defrag <path> <budget>" TEXT_RESET "\n"
+            " Moves the blocks of the file <path>, or of everything inside the directory <path>,\n"
+            " to runs of contiguous blocks\n"
+            " Note: <path> can be a relative or absolute path\n"
+            " Note: if <path> is not specified, the root directory is used\n"
+            " Note: if <budget> is specified, at most <budget> blocks are moved per second\n"
+        );
     else 
         printf(TEXT_ERROR "Unknown command: %s" TEXT_RESET "\n", command);     
 
@@ -761,6 +843,8 @@ void parse_command(FatFs *fs, char *command[MAX_COMMAND_ARGUMENTS]) {
         res = cmd_size(fs, command[1] ? command[1] : ".");
     else if (strcmp(cmd_name, "free") == 0)
         res = cmd_free(fs);
+    else if (strcmp(cmd_name, "defrag") == 0)
+        res = cmd_defrag(fs, command[1] ? command[1] : "/", command[2]);
     else if (strcmp(cmd_name, "ec") == 0)
         res = cmd_ec(fs, command[1], command[2]);
     else if (strcmp(cmd_name, "repeat") == 0)
@@ -903,6 +987,7 @@ int main(int argc, char **argv) {
     if (initialize_file_system) {
         int block_size = 0;
         int blocks_count = 0;
+        unsigned int features = 0;
 
         // If show_interactive_shell is TRUE, init the file system in shell mode
         if (show_interactive_shell)
@@ -923,7 +1008,22 @@ int main(int argc, char **argv) {
                 INIT_ARGS_ERROR();
             if (++i == argc) INIT_ARGS_ERROR();
             block_size = atoi(argv[i]);
-            if (++i != argc) INIT_ARGS_ERROR();
+
+            // And the optional features
+            while (++i != argc) {
+                if (strcmp(argv[i], "extents") == 0)
+                    features |= FAT_FEATURE_EXTENTS;
+                else if (strcmp(argv[i], "fat16") == 0)
+                    features |= FAT_FEATURE_FAT16;
+                else if (strcmp(argv[i], "dirindex") == 0)
+                    features |= FAT_FEATURE_DIR_INDEX;
+                else if (strcmp(argv[i], "dirsorted") == 0)
+                    features |= FAT_FEATURE_DIR_INDEX | FAT_FEATURE_DIR_SORTED;
+                else if (strcmp(argv[i], "dirusage") == 0)
+                    features |= FAT_FEATURE_DIR_INDEX | FAT_FEATURE_DIR_USAGE;
+                else
+                    INIT_ARGS_ERROR();
+            }
 
             if (block_size < 0 || blocks_count < 0 ||
                 block_size % 32 != 0 || blocks_count % 32 != 0)
@@ -931,7 +1031,7 @@ int main(int argc, char **argv) {
         }
 
         // Initialize the file system
-        FatResult res = fat_init(buffer_name, block_size, blocks_count);
+        FatResult res = fat_init_with_features(buffer_name, block_size, blocks_count, features);
         if (res != OK) {
             printf("Error initializing the file system: %s\n", fat_result_string(res));
             return 1;
@@ -939,7 +1039,8 @@ int main(int argc, char **argv) {
             printf("Successfully initialized FAT FS \"%s\" with %d blocks of %d bytes\n", 
                 buffer_name, blocks_count, block_size);
             printf("Total disk size: %ld bytes\n",
-                blocks_count * (block_size + sizeof(int)) + blocks_count/8 + sizeof(FatHeader));
+                blocks_count * (block_size + ((features & FAT_FEATURE_FAT16) ? sizeof(uint16_t) : sizeof(int)))
+                + blocks_count/8 + sizeof(FatHeader));
             return 0;
         }
 
@@ -0,0 +1,263 @@
+/**
+ * Cache of the directory entries looked up by name,
+ * and Bloom filters of the names in the directories
+ */
+#include <stdlib.h>
+#include <string.h>
+#include "internals.h"
+
+// State of an entry of the cache
+typedef enum DentryState {
+    DENTRY_EMPTY = 0,
+    DENTRY_FOUND,
+    DENTRY_MISSING
+} DentryState;
+
+// Entry of the cache, with the slot of the entry if it was found
+typedef struct DentryCacheEntry {
+    int parent_block;
+    char name[MAX_FILENAME_LENGTH];
+    char state;
+    char type;
+    int first_block;
+    DirEntry *slot;
+} DentryCacheEntry;
+
+// Bloom filter of the names in a directory
+typedef struct DirBloom {
+    int dir_block;
+    int bits;
+    int count;
+    uint64_t *words;
+} DirBloom;
+
+/**
+ * Allocates the empty cache of a file system
+ * Without memory, the file system works without a cache
+ */
+void dir_cache_init(FatFs *fs) {
+    fs->dentry_cache = calloc(DENTRY_CACHE_SIZE, sizeof(DentryCacheEntry));
+    fs->dir_blooms = calloc(DIR_BLOOM_CACHE_SIZE, sizeof(DirBloom));
+}
+
+/**
+ * Frees the cache of a file system
+ */
+void dir_cache_destroy(FatFs *fs) {
+    if (fs->dir_blooms)
+        for (int i = 0; i < DIR_BLOOM_CACHE_SIZE; i++)
+            free(fs->dir_blooms[i].words);
+
+    free(fs->dir_blooms);
+    free(fs->dentry_cache);
+    fs->dir_blooms = NULL;
+    fs->dentry_cache = NULL;
+}
+
+/**
+ * Returns the only place in the cache for a name in a directory
+ */
+static DentryCacheEntry *dir_cache_place(FatFs *fs, int parent_block, const char *name) {
+    uint32_t hash = name_hash(name) ^ ((uint32_t)parent_block * 2654435761u);
+    return &fs->dentry_cache[hash & (DENTRY_CACHE_SIZE - 1)];
+}
+
+/**
+ * Returns the Bloom filter of a directory, or NULL if it has none
+ */
+static DirBloom *dir_bloom_get(FatFs *fs, int dir_block) {
+    if (fs->dir_blooms == NULL)
+        return NULL;
+
+    DirBloom *bloom = &fs->dir_blooms[dir_block & (DIR_BLOOM_CACHE_SIZE - 1)];
+    if (bloom->words == NULL || bloom->dir_block != dir_block)
+        return NULL;
+    return bloom;
+}
+
+/**
+ * Sets or tests the bits of a name in a Bloom filter
+ * Returns 0 if the name is surely not in the filter
+ */
+static int dir_bloom_bits(DirBloom *bloom, const char *name, int set) {
+    // Double hashing, with an odd step
+    uint32_t hash = name_hash(name);
+    uint32_t step = ((hash >> 17) | (hash << 15)) | 1;
+
+    for (int i = 0; i < DIR_BLOOM_HASHES; i++, hash += step) {
+        uint32_t bit = hash & (bloom->bits - 1);
+        uint64_t mask = (uint64_t)1 << (bit % 64);
+        if (set)
+            bloom->words[bit / 64] |= mask;
+        else if (!(bloom->words[bit / 64] & mask))
+            return 0;
+    }
+
+    return 1;
+}
+
+/**
+ * Forgets the Bloom filter of a directory
+ */
+static void dir_bloom_drop(FatFs *fs, int dir_block) {
+    DirBloom *bloom = dir_bloom_get(fs, dir_block);
+    if (bloom == NULL)
+        return;
+
+    free(bloom->words);
+    bloom->words = NULL;
+}
+
+/**
+ * Builds the Bloom filter of a directory from its entries,
+ * with room for as many names again
+ */
+static void dir_bloom_build(FatFs *fs, int dir_block) {
+    if (fs->dir_blooms == NULL)
+        return;
+
+    // Count the names, unless the header knows how many they are
+    DirEntry *entry;
+    DirHandle dir;
+    DirHeader *header = dir_get_tail(fs, dir_block);
+    int count = header != NULL ? header->entries : 0;
+    dir.block_number = dir_block;
+    dir.count = 0;
+    while (header == NULL && dir_handle_next(fs, &dir, &entry) == OK)
+        count++;
+
+    int bits = 64;
+    while (bits < 2 * count * DIR_BLOOM_BITS_PER_NAME)
+        bits *= 2;
+    uint64_t *words = calloc(bits / 64, sizeof(uint64_t));
+    if (words == NULL)
+        return;
+
+    // Take the place of the filter of another directory
+    DirBloom *bloom = &fs->dir_blooms[dir_block & (DIR_BLOOM_CACHE_SIZE - 1)];
+    free(bloom->words);
+    bloom->dir_block = dir_block;
+    bloom->bits = bits;
+    bloom->count = count;
+    bloom->words = words;
+
+    dir.block_number = dir_block;
+    dir.count = 0;
+    while (dir_handle_next(fs, &dir, &entry) == OK)
+        dir_bloom_bits(bloom, entry->name, 1);
+}
+
+/**
+ * Adds a new name to the Bloom filter of a directory,
+ * forgetting the filter once it is too full to be useful
+ */
+static void dir_bloom_add(FatFs *fs, int dir_block, const char *name) {
+    DirBloom *bloom = dir_bloom_get(fs, dir_block);
+    if (bloom == NULL)
+        return;
+
+    if (++bloom->count * DIR_BLOOM_BITS_PER_NAME > bloom->bits) {
+        dir_bloom_drop(fs, dir_block);
+        return;
+    }
+    dir_bloom_bits(bloom, name, 1);
+}
+
+/**
+ * Tells if a name is in a directory from the cache alone:
+ * DIR_CACHE_FOUND with its entry, DIR_CACHE_MISSING if it is surely not there,
+ * DIR_CACHE_UNKNOWN if the directory must be searched
+ */
+DirCacheResult dir_cache_lookup(FatFs *fs, int parent_block, const char *name, DirEntry **entry) {
+    if (fs->dentry_cache == NULL)
+        return DIR_CACHE_UNKNOWN;
+
+    DentryCacheEntry *cached = dir_cache_place(fs, parent_block, name);
+    if (cached->state != DENTRY_EMPTY && cached->parent_block == parent_block
+        && NAME_COMPARE(cached->name, name) == 0) {
+        if (cached->state == DENTRY_MISSING)
+            return DIR_CACHE_MISSING;
+
+        // The entry must not have changed since
+        if (cached->slot->type == cached->type && cached->slot->first_block == cached->first_block) {
+            *entry = cached->slot;
+            return DIR_CACHE_FOUND;
+        }
+    }
+
+    // Names not in the filter are not in the directory
+    DirBloom *bloom = dir_bloom_get(fs, parent_block);
+    if (bloom != NULL && !dir_bloom_bits(bloom, name, 0))
+        return DIR_CACHE_MISSING;
+
+    return DIR_CACHE_UNKNOWN;
+}
+
+/**
+ * Remembers where an entry of a directory is, replacing
+ * the entry that was in its place in the cache
+ */
+void dir_cache_insert(FatFs *fs, int parent_block, DirEntry *entry) {
+    if (fs->dentry_cache == NULL)
+        return;
+
+    DentryCacheEntry *cached = dir_cache_place(fs, parent_block, entry->name);
+    cached->parent_block = parent_block;
+    strncpy(cached->name, entry->name, MAX_FILENAME_LENGTH);
+    cached->state = DENTRY_FOUND;
+    cached->type = entry->type;
+    cached->first_block = entry->first_block;
+    cached->slot = entry;
+}
+
+/**
+ * Adds a new entry of a directory to the cache and to its Bloom filter
+ */
+void dir_cache_add(FatFs *fs, int parent_block, DirEntry *entry) {
+    dir_cache_insert(fs, parent_block, entry);
+    dir_bloom_add(fs, parent_block, entry->name);
+}
+
+/**
+ * Remembers that a name is not in a directory,
+ * and builds the Bloom filter of the directory if it has none
+ */
+void dir_cache_insert_missing(FatFs *fs, int parent_block, const char *name) {
+    if (fs->dentry_cache == NULL)
+        return;
+
+    DentryCacheEntry *cached = dir_cache_place(fs, parent_block, name);
+    cached->parent_block = parent_block;
+    strncpy(cached->name, name, MAX_FILENAME_LENGTH);
+    cached->state = DENTRY_MISSING;
+    cached->slot = NULL;
+
+    if (dir_bloom_get(fs, parent_block) == NULL)
+        dir_bloom_build(fs, parent_block);
+}
+
+/**
+ * Forgets an entry of a directory, if it is in the cache
+ */
+void dir_cache_invalidate(FatFs *fs, int parent_block, const char *name) {
+    if (fs->dentry_cache == NULL)
+        return;
+
+    DentryCacheEntry *cached = dir_cache_place(fs, parent_block, name);
+    if (cached->parent_block == parent_block && NAME_COMPARE(cached->name, name) == 0)
+        cached->state = DENTRY_EMPTY;
+}
+
+/**
+ * Forgets everything about a directory whose blocks are freed or moved,
+ * since they may be used by another directory
+ */
+void dir_cache_forget_dir(FatFs *fs, int dir_block) {
+    dir_bloom_drop(fs, dir_block);
+    if (fs->dentry_cache == NULL)
+        return;
+
+    for (int i = 0; i < DENTRY_CACHE_SIZE; i++)
+        if (fs->dentry_cache[i].parent_block == dir_block)
+            fs->dentry_cache[i].state = DENTRY_EMPTY;
+}
@@ -16,25 +16,47 @@ FatResult dir_insert(FatFs *fs, int block_number, DirEntry **entry, int child_bl
     FatResult res;
     int allocate_child = child_block == FAT_EOF;
     
-    // Reserve space for the child block
-    if (allocate_child) {
-        child_block = bitmap_get_free_block(fs);
-        if (child_block == FAT_EOF)
-            return NO_FREE_BLOCKS;
-        bitmap_set(fs, child_block, 1);
-    }
+    // Reserve space for the child block, near the directory
+    if (allocate_child && bitmap_alloc_run(fs, block_number, 1, &child_block) == 0)
+        return NO_FREE_BLOCKS;
 
-    // Get the directory size
+    // Use the cache or the index of the directory to check the name, if it has one
     DirEntry *curr;
     DirHandle dir;
+    DirHeader *header = dir_get_tail(fs, block_number);
+    DirCacheResult cached = dir_cache_lookup(fs, block_number, name, &curr);
+    int indexed = header != NULL && header->index_block != FAT_EOF;
+    if (cached == DIR_CACHE_FOUND
+        || (cached == DIR_CACHE_UNKNOWN && indexed && dir_index_lookup(fs, header, name, &curr) == OK)) {
+        if (allocate_child)
+            bitmap_set(fs, child_block, 0);
+
+        return FILE_ALREADY_EXISTS;
+    }
+
+    // Remember the space used by the directory alone, to add how much it grows
+    int own_size = 0, own_blocks = 0;
+    DirUsage *usage = dir_get_usage(fs, block_number);
+    if (usage != NULL)
+        dir_usage_own(fs, block_number, &own_size, &own_blocks);
+
+    // Get the directory size
     dir.block_number = block_number;
     dir.count = 0;
 
-    while (1) {
+    // The header knows where the DIR_END is, so only look for the name if needed
+    int known_name = indexed || cached == DIR_CACHE_MISSING;
+    if (header != NULL && known_name) {
+        int end_offset = DIR_END_OFFSET(fs, header);
+        dir.block_number = header->end_block;
+        dir.count = end_offset + 1;
+        *entry = (DirEntry *)fs->blocks_ptr + dir.block_number * ENTRIES_PER_BLOCK(fs) + end_offset;
+    }
+    else while (1) {
         res = dir_handle_next(fs, &dir, &curr);
 
-        // Make sure the name is not already used
-        if (res == OK && strncmp(curr->name, name, MAX_FILENAME_LENGTH) == 0) {
+        // Make sure the name is not already used, unless it is known to be new
+        if (res == OK && !known_name && strncmp(curr->name, name, MAX_FILENAME_LENGTH) == 0) {
             // Free the child block
             if (allocate_child)
                 bitmap_set(fs, child_block, 0);
@@ -52,17 +74,17 @@ FatResult dir_insert(FatFs *fs, int block_number, DirEntry **entry, int child_bl
 
     // Extend the directory if necessary
     if (dir.count % ENTRIES_PER_BLOCK(fs) == 0) {
-        // Get a new block
-        int next_block = bitmap_get_free_block(fs);
-        // If there are no free blocks, return an error
-        if (next_block == FAT_EOF) {
+        // Reuse the block left over by a previous deletion, if any
+        int next_block = fat_get_next_block(fs, dir.block_number);
+
+        // Else get a new block, right after the last one if possible
+        if (next_block == FAT_EOF && bitmap_alloc_run(fs, dir.block_number + 1, 1, &next_block) == 0) {
             // Free the child block
             if (allocate_child)
                 bitmap_set(fs, child_block, 0);
 
             return NO_FREE_BLOCKS;
         }
-        bitmap_set(fs, next_block, 1);
         // Set the next block
         fat_set_next_block(fs, dir.block_number, next_block);
         // Set the block number
@@ -79,27 +101,50 @@ FatResult dir_insert(FatFs *fs, int block_number, DirEntry **entry, int child_bl
     strncpy((*entry)->name, name, MAX_FILENAME_LENGTH);
     (*entry)->first_block = child_block;
 
+    // Count the entry and move the DIR_END in the header
+    int count = dir.count;
+    if (header != NULL) {
+        count = ++header->entries;
+
+        // The DIR_END may have gone to the next block
+        int entry_block = (*entry - (DirEntry *)fs->blocks_ptr) / ENTRIES_PER_BLOCK(fs);
+        if (dir.block_number != entry_block)
+            header->end_prev_block = entry_block;
+        header->end_block = dir.block_number;
+    }
+
+    // Add the entry to the index and to the cache
+    fs->dir_changes++;
+    dir_index_add(fs, block_number, *entry, count);
+    dir_cache_add(fs, block_number, *entry);
+
+    if (usage != NULL) {
+        int size, blocks;
+        dir_usage_own(fs, block_number, &size, &blocks);
+        dir_usage_add(fs, block_number, size - own_size, blocks - own_blocks);
+
+        // A directory moved here is now contained in this one
+        DirUsage *child_usage = allocate_child || type != DIR_ENTRY_DIRECTORY ? NULL : dir_get_usage(fs, child_block);
+        if (child_usage != NULL)
+            child_usage->parent_block = block_number;
+    }
+
     return OK;
 }
 
 
 /**
- * Creates a directory
- * @author Cicim
+ * Creates a directory, with relative paths starting from "base_block"
+ * (the current directory if FAT_EOF)
  */
-FatResult dir_create(FatFs *fs, const char *path) {
+static FatResult dir_create_from(FatFs *fs, int base_block, const char *path) {
     FatResult res;
 
-    // Divide the absolute of path into a directory and an element name
+    // Get the block number of the parent directory and the name
     char path_buffer[MAX_PATH_LENGTH];
-    char *dir_path, *name;
-    res = path_get_components(fs, path, path_buffer, &dir_path, &name);
-    if (res != OK)
-        return res;
-
-    // Get the block number of the parent directory
+    char *name;
     int parent_block;
-    res = dir_get_first_block(fs, dir_path, &parent_block);
+    res = path_get_parent(fs, base_block, path, path_buffer, &parent_block, &name);
     if (res != OK)
         return res;
 
@@ -109,9 +154,27 @@ FatResult dir_create(FatFs *fs, const char *path) {
     if (res != OK)
         return res;
 
-    char *block_ptr = fs->blocks_ptr + entry->first_block * fs->header->block_size;
-    // Fill the block with zeros
-    memset(block_ptr, 0, fs->header->block_size);
+    // Fill the block with the header and the DIR_END
+    dir_init_block(fs, entry->first_block, parent_block);
+    dir_usage_add_child(fs, parent_block, entry->first_block, DIR_ENTRY_DIRECTORY, 1);
 
     return OK;
 }
+
+
+/**
+ * Creates a directory
+ * @author Cicim
+ */
+FatResult dir_create(FatFs *fs, const char *path) {
+    return dir_create_from(fs, FAT_EOF, path);
+}
+
+/**
+ * Creates a directory with a path relative to an open directory
+ */
+FatResult dir_create_at(DirHandle *dir, const char *path) {
+    if (dir == NULL)
+        return INVALID_PATH;
+    return dir_create_from(dir->fs, dir->first_block, path);
+}
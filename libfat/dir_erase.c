@@ -6,40 +6,64 @@
 #include "internals.h"
 
 
+/**
+ * Frees the blocks of an entry of a directory, already emptied
+ */
+static FatResult dir_empty_entry(FatFs *fs, int dir_block, DirEntry *entry) {
+    // The open handles of a file can't use the blocks it had
+    if (entry->type == DIR_ENTRY_FILE)
+        file_handles_detach(fs, entry->first_block);
+
+    // Unlink the fat from the entry start
+    FatResult res = fat_unlink(fs, entry->first_block);
+    if (res != OK)
+        return res;
+
+    // The blocks of the directory may be used by another one
+    dir_cache_invalidate(fs, dir_block, entry->name);
+    return OK;
+}
+
 /**
  * Recursively empty a directory and all its subdirectories
+ * The directories are emptied before their blocks are freed
  * @author Cicim
  */
 FatResult dir_empty(FatFs *fs, int dir_block) {
-    FatResult res;
-
-    // Loop over its entries
-    DirEntry *entry;
-    DirHandle dir;
-    dir.block_number = dir_block;
-    dir.count = 0;
-
-    while (1) {
-        res = dir_handle_next(fs, &dir, &entry);
-        if (res == END_OF_DIR)
+    // Loop over its entries, and the ones of its subdirectories
+    DirWalk walk = {0};
+    FatResult res = dir_walk_push(&walk, dir_block);
+    while (res == OK) {
+        DirWalkFrame *frame = DIR_WALK_TOP(&walk);
+        DirEntry *entry;
+        res = dir_handle_next(fs, &frame->dir, &entry);
+
+        if (res == OK) {
+            // If it's a directory, empty it first
+            if (entry->type == DIR_ENTRY_DIRECTORY) {
+                frame->entry = entry;
+                res = dir_walk_push(&walk, entry->first_block);
+            }
+            else
+                res = dir_empty_entry(fs, frame->dir_block, entry);
+            continue;
+        }
+        else if (res != END_OF_DIR)
             break;
-        else if (res != OK)
-            return res;
 
-        // If it's a directory, empty it
-        if (entry->type == DIR_ENTRY_DIRECTORY) {
-            res = dir_empty(fs, entry->first_block);
-            if (res != OK)
-                return res;
-        }
+        // Free the index of the directory
+        dir_index_free(fs, frame->dir_block);
+        res = OK;
 
-        // Unlink the fat from the entry start
-        res = fat_unlink(fs, entry->first_block);
-        if (res != OK)
-            return res;
+        // Then its blocks, from the directory containing it
+        if (--walk.depth == 0)
+            break;
+        frame = DIR_WALK_TOP(&walk);
+        res = dir_empty_entry(fs, frame->dir_block, frame->entry);
     }
 
-    return OK;
+    dir_walk_free(&walk);
+    return res;
 }
 
 
@@ -69,8 +93,8 @@ FatResult dir_erase(FatFs *fs, const char *path) {
         
         // Re-add it to the bitmap
         bitmap_set(fs, ROOT_DIR_BLOCK, 1);
-        // Add a directory end to the root directory
-        memset(fs->blocks_ptr, 0, sizeof(DirEntry));
+        // Add a header and a directory end to the root directory
+        dir_init_block(fs, ROOT_DIR_BLOCK, FAT_EOF);
 
         return OK;
     }
@@ -92,6 +116,7 @@ FatResult dir_erase(FatFs *fs, const char *path) {
     res = dir_delete(fs, dir_block, DIR_ENTRY_DIRECTORY, name, &child_block);
     if (res != OK)
         return res;
+    dir_usage_add_child(fs, dir_block, child_block, DIR_ENTRY_DIRECTORY, -1);
 
     // Empty the child directory
     res = dir_empty(fs, child_block);
@@ -37,6 +37,22 @@ FatResult dir_open(FatFs *fs, const char *path, DirHandle **dir) {
     (*dir)->fs = fs;
     (*dir)->block_number = block;
     (*dir)->count = 0;
+    (*dir)->first_block = block;
+
+    // Sorted directories are listed in order of name
+    (*dir)->ordered = HAS_FEATURE(fs, FAT_FEATURE_DIR_SORTED);
+    (*dir)->include_last = 1;
+    (*dir)->last_name[0] = '\0';
+    (*dir)->prefix[0] = '\0';
+
+    // Nothing is listed ahead yet
+    (*dir)->page = NULL;
+    (*dir)->page_count = 0;
+    (*dir)->page_position = 0;
+    (*dir)->page_capacity = 0;
+
+    (*dir)->next_open = fs->open_dirs;
+    fs->open_dirs = *dir;
 
     return OK;
 }
@@ -47,83 +63,99 @@ FatResult dir_open(FatFs *fs, const char *path, DirHandle **dir) {
  * @author Cicim
  */
 FatResult dir_close(DirHandle *dir) {
+    if (dir == NULL)
+        return OK;
+
+    // Forget about the directory in the file system, unless it was closed first
+    if (dir->fs != NULL) {
+        DirHandle **prev = &dir->fs->open_dirs;
+        while (*prev != dir)
+            prev = &(*prev)->next_open;
+        *prev = dir->next_open;
+    }
+
+    free(dir->page);
     free(dir);
     return OK;
 }
 
 /**
- * Compare "name" with the first part of "path"
- * @example compare_name("foo/bar", "foo") -> 1
- * @example compare_name("foo/bar", "bar") -> 0
- * @author Cicim
- * @return 1 if the name is the same, 0 otherwise
+ * Moves the open handles of a directory to its copy in the contiguous run
+ * from "new_block", at the same position (the old chain must still be linked)
  */
-int compare_name(const char *path, const char *name) {
-    for (int i = 0; i < MAX_FILENAME_LENGTH; i++) {
-        if ((path[i] == '\0' || path[i] == '/') && name[i] == '\0')
-            return 1;
-        if (path[i] != name[i])
-            break;
+void dir_handles_move(FatFs *fs, int old_block, int new_block) {
+    for (DirHandle *dir = fs->open_dirs; dir != NULL; dir = dir->next_open) {
+        if (dir->first_block != old_block)
+            continue;
+
+        // Find the position of the current block in the old chain
+        int position = 0;
+        for (int block = old_block; block != FAT_EOF && block != dir->block_number;
+             block = fat_get_next_block(fs, block))
+            position++;
+
+        dir->first_block = new_block;
+        dir->block_number = new_block + position;
     }
-    return 0;
 }
 
-
 /**
  * Returns the first block of the directory given the absolute path
  * @author Cicim
  */
 FatResult dir_get_first_block(FatFs *fs, const char *path, int *block_number) {
-    int block = block_number ? *block_number : ROOT_DIR_BLOCK;
+    return dir_get_first_block_from(fs, ROOT_DIR_BLOCK, path, block_number);
+}
+
+/**
+ * Returns the first block of the directory given a path relative
+ * to the directory in "base_block" (absolute paths start from the root)
+ */
+FatResult dir_get_first_block_from(FatFs *fs, int base_block, const char *path, int *block_number) {
+    int block = base_block;
 
     // If the path is absolute, start from the root directory
     if (*path == '/') {
         path++;
         block = ROOT_DIR_BLOCK;
     }
-    // If the path was the root itself, return the root directory's block
+    // If the path was the starting directory itself, return its block
     if (*path == '\0') {
         if (block_number != NULL)
-            *block_number = ROOT_DIR_BLOCK;
+            *block_number = block;
         return OK;
     }
 
     // Get the name of the directory to look for
     FatResult res;
     DirHandle dir;
+    PathComponent component;
 
-    while (path) {
+    while (path_next_component(&path, &component)) {
         DirEntry *entry;
-        dir.block_number = block;
-        dir.count = 0;
+        char name[MAX_FILENAME_LENGTH];
+
+        // Stay in the same directory
+        if (component.length == 1 && component.name[0] == '.')
+            continue;
+
+        // A name too long can't be in the directory
+        if (component.length >= MAX_FILENAME_LENGTH)
+            return FILE_NOT_FOUND;
+        memcpy(name, component.name, component.length);
+        name[component.length] = '\0';
 
         // Get the entry with the given name
-        while (1) {
-            res = dir_handle_next(fs, &dir, &entry);
-
-            // Stop if there are no more entries
-            if (res == END_OF_DIR)
-                return FILE_NOT_FOUND;
-            // Stop if there is some other error
-            else if (res != OK)
-                return res;
-
-            // Continue if the name doesn't match
-            if (!compare_name(path, entry->name))
-                continue;
-
-            // Stop if the entry is not a directory
-            if (entry->type != DIR_ENTRY_DIRECTORY)
-                return NOT_A_DIRECTORY;
-
-            // Return the block number
-            block = entry->first_block;
-            // Advance the path
-            path = strchr(path, '/');
-            if (path) path++;
-            // Stop the inner loop
-            break;
-        }
+        res = dir_get_entry(fs, block, name, &entry, &dir);
+        if (res != OK)
+            return res;
+
+        // Stop if the entry is not a directory
+        if (entry->type != DIR_ENTRY_DIRECTORY)
+            return NOT_A_DIRECTORY;
+
+        // Return the block number
+        block = entry->first_block;
     }
 
     if (block_number != NULL)
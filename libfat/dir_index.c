@@ -0,0 +1,453 @@
+/**
+ * Hash index of the directories (FAT_FEATURE_DIR_INDEX),
+ * with the entries sorted by name (FAT_FEATURE_DIR_SORTED)
+ */
+#include <string.h>
+#include "internals.h"
+
+/**
+ * Returns the header of a directory, or NULL if it has none
+ */
+DirHeader *dir_get_header(FatFs *fs, int dir_block) {
+    if (!HAS_FEATURE(fs, FAT_FEATURE_DIR_INDEX))
+        return NULL;
+
+    DirHeader *header = DIR_HEADER(fs, dir_block);
+    if (header->type != DIR_ENTRY_HEADER)
+        return NULL;
+    return header;
+}
+
+/**
+ * Fills the first block of a new directory with its header
+ * (if the file system uses one) and the DIR_END entry
+ * "parent_block" is the directory containing it, for the usage totals
+ */
+void dir_init_block(FatFs *fs, int dir_block, int parent_block) {
+    // The block may have belonged to another directory
+    dir_cache_forget_dir(fs, dir_block);
+    fs->dir_changes++;
+
+    memset(fs->blocks_ptr + dir_block * fs->header->block_size, 0, fs->header->block_size);
+    if (!HAS_FEATURE(fs, FAT_FEATURE_DIR_INDEX))
+        return;
+
+    DirHeader *header = DIR_HEADER(fs, dir_block);
+    header->type = DIR_ENTRY_HEADER;
+    header->index_block = FAT_EOF;
+    header->flags = DIR_HEADER_TAIL;
+    header->end_block = dir_block;
+    header->end_prev_block = FAT_EOF;
+    dir_usage_init(fs, dir_block, parent_block);
+}
+
+/**
+ * Returns the header of a directory with the number of its entries
+ * and the block of its DIR_END, or NULL if it has no header
+ * Headers written without them get them from a listing of the directory
+ */
+DirHeader *dir_get_tail(FatFs *fs, int dir_block) {
+    DirHeader *header = dir_get_header(fs, dir_block);
+    if (header == NULL || (header->flags & DIR_HEADER_TAIL))
+        return header;
+
+    DirEntry *entry;
+    DirHandle dir;
+    dir.block_number = dir_block;
+    dir.count = 0;
+    int count = 0;
+    while (dir_handle_next(fs, &dir, &entry) == OK)
+        count++;
+    if (entry->type != DIR_END)
+        return NULL;
+
+    header->flags |= DIR_HEADER_TAIL;
+    header->entries = count;
+    header->end_block = dir.block_number;
+    header->end_prev_block = dir.block_number == dir_block ? FAT_EOF : DIR_PREV_UNKNOWN;
+    return header;
+}
+
+/**
+ * FNV-1a hash of an entry name
+ */
+uint32_t name_hash(const char *name) {
+    uint32_t hash = 2166136261u;
+    for (int i = 0; i < MAX_FILENAME_LENGTH && name[i]; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Returns the buckets of the index of a directory
+#define DIR_INDEX_BUCKETS(fs, header) \
+    ((uint32_t *)((fs)->blocks_ptr + (header)->index_block * (fs)->header->block_size))
+// Returns the tree of the entries sorted by name, after the buckets
+#define DIR_INDEX_TREE(fs, header) \
+    ((DirIndexTree *)(DIR_INDEX_BUCKETS(fs, header) + (header)->index_buckets))
+// Returns the nodes of the tree, numbered from 1
+#define DIR_INDEX_NODES(fs, header) ((DirIndexNode *)DIR_INDEX_TREE(fs, header))
+// Returns the name of the entry of a node
+#define NODE_NAME(fs, nodes, node) (DIR_INDEX_ENTRY(fs, (nodes)[node].value)->name)
+
+/**
+ * Returns the bucket of the entry with the given name,
+ * or the first empty bucket after it if it is not in the index
+ */
+static uint32_t *dir_index_find(FatFs *fs, DirHeader *header, const char *name) {
+    uint32_t *buckets = DIR_INDEX_BUCKETS(fs, header);
+    uint32_t mask = header->index_buckets - 1;
+
+    for (uint32_t i = name_hash(name) & mask; ; i = (i + 1) & mask) {
+        if (buckets[i] == DIR_INDEX_EMPTY)
+            return &buckets[i];
+        if (buckets[i] == DIR_INDEX_DELETED)
+            continue;
+
+        DirEntry *entry = DIR_INDEX_ENTRY(fs, buckets[i]);
+        if (strncmp(entry->name, name, MAX_FILENAME_LENGTH) == 0)
+            return &buckets[i];
+    }
+}
+
+/**
+ * Returns the bucket pointing to the given entry
+ */
+static uint32_t *dir_index_find_entry(FatFs *fs, DirHeader *header, DirEntry *entry) {
+    uint32_t *buckets = DIR_INDEX_BUCKETS(fs, header);
+    uint32_t mask = header->index_buckets - 1;
+    uint32_t value = DIR_INDEX_VALUE(fs, entry);
+
+    for (uint32_t i = name_hash(entry->name) & mask; ; i = (i + 1) & mask)
+        if (buckets[i] == value || buckets[i] == DIR_INDEX_EMPTY)
+            return &buckets[i];
+}
+
+/**
+ * Returns the first entry in order of name after "name",
+ * or equal to it if "include_name" (NULL if there is none)
+ */
+DirEntry *dir_index_next_sorted(FatFs *fs, DirHeader *header, const char *name, int include_name) {
+    DirIndexNode *nodes = DIR_INDEX_NODES(fs, header);
+    uint32_t next = 0;
+
+    // Keep the last node after the name on the way down
+    for (uint32_t node = DIR_INDEX_TREE(fs, header)->root; node != 0; ) {
+        int cmp = NAME_COMPARE(NODE_NAME(fs, nodes, node), name);
+        if (cmp > 0 || (cmp == 0 && include_name)) {
+            next = node;
+            node = nodes[node].left;
+        }
+        else
+            node = nodes[node].right;
+    }
+
+    return next ? DIR_INDEX_ENTRY(fs, nodes[next].value) : NULL;
+}
+
+/**
+ * Rotates right a node with a left child on its level, returning the new top
+ */
+static uint32_t dir_tree_skew(DirIndexNode *nodes, uint32_t node) {
+    uint32_t left = node ? nodes[node].left : 0;
+    if (left == 0 || nodes[left].level != nodes[node].level)
+        return node;
+
+    nodes[node].left = nodes[left].right;
+    nodes[left].right = node;
+    return left;
+}
+
+/**
+ * Rotates left a node with two right children on its level,
+ * moving the middle one up a level, and returns the new top
+ */
+static uint32_t dir_tree_split(DirIndexNode *nodes, uint32_t node) {
+    uint32_t right = node ? nodes[node].right : 0;
+    if (right == 0 || nodes[right].right == 0 || nodes[nodes[right].right].level != nodes[node].level)
+        return node;
+
+    nodes[node].right = nodes[right].left;
+    nodes[right].left = node;
+    nodes[right].level++;
+    return right;
+}
+
+/**
+ * Inserts a new node in the tree from "node", returning its new top
+ */
+static uint32_t dir_tree_insert(FatFs *fs, DirIndexNode *nodes, uint32_t node, uint32_t new_node) {
+    if (node == 0)
+        return new_node;
+
+    if (NAME_COMPARE(NODE_NAME(fs, nodes, new_node), NODE_NAME(fs, nodes, node)) < 0)
+        nodes[node].left = dir_tree_insert(fs, nodes, nodes[node].left, new_node);
+    else
+        nodes[node].right = dir_tree_insert(fs, nodes, nodes[node].right, new_node);
+
+    return dir_tree_split(nodes, dir_tree_skew(nodes, node));
+}
+
+/**
+ * Removes the node with the given name from the tree from "node",
+ * linking it to the free nodes, and returns the new top
+ */
+static uint32_t dir_tree_remove(FatFs *fs, DirIndexTree *tree, DirIndexNode *nodes, uint32_t node, const char *name) {
+    if (node == 0)
+        return 0;
+
+    int cmp = NAME_COMPARE(name, NODE_NAME(fs, nodes, node));
+    if (cmp < 0)
+        nodes[node].left = dir_tree_remove(fs, tree, nodes, nodes[node].left, name);
+    else if (cmp > 0)
+        nodes[node].right = dir_tree_remove(fs, tree, nodes, nodes[node].right, name);
+    else if (nodes[node].left == 0 && nodes[node].right == 0) {
+        nodes[node].left = tree->free;
+        tree->free = node;
+        return 0;
+    }
+    else {
+        // Take the place of the closest entry, removing that from the bottom instead
+        uint32_t other;
+        if (nodes[node].left == 0) {
+            for (other = nodes[node].right; nodes[other].left != 0; other = nodes[other].left);
+            nodes[node].value = nodes[other].value;
+            nodes[node].right = dir_tree_remove(fs, tree, nodes, nodes[node].right, NODE_NAME(fs, nodes, node));
+        }
+        else {
+            for (other = nodes[node].left; nodes[other].right != 0; other = nodes[other].right);
+            nodes[node].value = nodes[other].value;
+            nodes[node].left = dir_tree_remove(fs, tree, nodes, nodes[node].left, NODE_NAME(fs, nodes, node));
+        }
+    }
+
+    // Lower the levels left too high, and restore the shape of the tree
+    uint32_t left = nodes[node].left, right = nodes[node].right;
+    uint32_t level = MIN(left ? nodes[left].level : 0, right ? nodes[right].level : 0) + 1;
+    if (level < nodes[node].level) {
+        nodes[node].level = level;
+        if (right && level < nodes[right].level)
+            nodes[right].level = level;
+    }
+
+    node = dir_tree_skew(nodes, node);
+    nodes[node].right = dir_tree_skew(nodes, nodes[node].right);
+    if (nodes[node].right)
+        nodes[nodes[node].right].right = dir_tree_skew(nodes, nodes[nodes[node].right].right);
+    node = dir_tree_split(nodes, node);
+    nodes[node].right = dir_tree_split(nodes, nodes[node].right);
+    return node;
+}
+
+/**
+ * Adds an entry to the sorted entries of the index
+ */
+static void dir_index_sorted_add(FatFs *fs, DirHeader *header, DirEntry *entry) {
+    DirIndexTree *tree = DIR_INDEX_TREE(fs, header);
+    DirIndexNode *nodes = DIR_INDEX_NODES(fs, header);
+
+    // Reuse a node freed before, if any
+    uint32_t node = tree->free;
+    if (node != 0)
+        tree->free = nodes[node].left;
+    else
+        node = ++tree->count;
+
+    nodes[node].value = DIR_INDEX_VALUE(fs, entry);
+    nodes[node].left = nodes[node].right = 0;
+    nodes[node].level = 1;
+    tree->root = dir_tree_insert(fs, nodes, tree->root, node);
+}
+
+/**
+ * Looks up an entry in the index of a directory
+ * Returns FILE_NOT_FOUND if it is not there
+ */
+FatResult dir_index_lookup(FatFs *fs, DirHeader *header, const char *name, DirEntry **entry) {
+    uint32_t *bucket = dir_index_find(fs, header, name);
+    if (*bucket == DIR_INDEX_EMPTY)
+        return FILE_NOT_FOUND;
+
+    *entry = DIR_INDEX_ENTRY(fs, *bucket);
+    return OK;
+}
+
+/**
+ * Returns the number of bits needed to write "value"
+ */
+static int bit_length(unsigned int value) {
+    int bits = 0;
+    while (value >> bits)
+        bits++;
+    return bits;
+}
+
+/**
+ * Builds a new index for a directory, with room for as many entries again,
+ * freeing the old one. Without a run of free blocks long enough,
+ * the directory keeps the old one, if any
+ */
+FatResult dir_index_build(FatFs *fs, int dir_block) {
+    DirHeader *header = dir_get_tail(fs, dir_block);
+    if (header == NULL)
+        return OK;
+    int count = header->entries;
+
+    // Keep the buckets at most half full after doubling the entries
+    int buckets = DIR_INDEX_MIN_BUCKETS;
+    while (buckets < 4 * count)
+        buckets *= 2;
+
+    // The index must be contiguous to be read without following the FAT
+    int num_blocks = CEIL(DIR_INDEX_SIZE(fs, buckets), fs->header->block_size);
+    int first_block;
+    int run_length = bitmap_alloc_run(fs, -1, num_blocks, &first_block);
+    if (run_length < num_blocks && run_length > 0)
+        fat_unlink(fs, first_block);
+
+    // Keep the old index if there is no room for the new one,
+    // remembering when it failed not to look for a run again at every insert
+    if (run_length < num_blocks) {
+        header->flags |= DIR_HEADER_NO_INDEX;
+        header->retry_entries_bits = bit_length(count);
+        header->retry_free_bits = bit_length(fs->header->free_blocks);
+        return NO_FREE_BLOCKS;
+    }
+    header->flags &= ~DIR_HEADER_NO_INDEX;
+    dir_index_free(fs, dir_block);
+
+    header->index_block = first_block;
+    header->index_buckets = buckets;
+    header->index_used = 0;
+    header->index_entries = 0;
+    memset(DIR_INDEX_BUCKETS(fs, header), 0, num_blocks * fs->header->block_size);
+
+    // Add the entries
+    DirEntry *entry;
+    DirHandle dir;
+    dir.block_number = dir_block;
+    dir.count = 0;
+    while (dir_handle_next(fs, &dir, &entry) == OK) {
+        *dir_index_find(fs, header, entry->name) = DIR_INDEX_VALUE(fs, entry);
+        if (HAS_FEATURE(fs, FAT_FEATURE_DIR_SORTED))
+            dir_index_sorted_add(fs, header, entry);
+        header->index_used++;
+        header->index_entries++;
+    }
+
+    return OK;
+}
+
+/**
+ * Frees the index of a directory
+ */
+void dir_index_free(FatFs *fs, int dir_block) {
+    DirHeader *header = dir_get_header(fs, dir_block);
+    if (header == NULL || header->index_block == FAT_EOF)
+        return;
+
+    fat_unlink(fs, header->index_block);
+    header->index_block = FAT_EOF;
+}
+
+/**
+ * Returns if the index of a directory with "count" entries should be built again,
+ * after the last build failed only if the entries or the free blocks
+ * have got past the next power of 2 since
+ */
+static int dir_index_wanted(FatFs *fs, DirHeader *header, int count) {
+    if (!(header->flags & DIR_HEADER_NO_INDEX))
+        return 1;
+    return count >> header->retry_entries_bits != 0
+        || fs->header->free_blocks >> header->retry_free_bits != 0;
+}
+
+/**
+ * Returns if the index of a directory can take another entry,
+ * fuller than usual when a bigger one could not be built
+ */
+static int dir_index_has_room(FatFs *fs, DirHeader *header) {
+    if (HAS_FEATURE(fs, FAT_FEATURE_DIR_SORTED) && header->index_entries >= header->index_buckets / 2)
+        return 0;
+    return (header->index_used + 1) * 4 <= header->index_buckets * 3;
+}
+
+/**
+ * Adds a new entry to the index of a directory with "count" entries,
+ * building the index if the directory has grown past its first block
+ */
+void dir_index_add(FatFs *fs, int dir_block, DirEntry *entry, int count) {
+    DirHeader *header = dir_get_header(fs, dir_block);
+    if (header == NULL)
+        return;
+
+    // Build the index if it is missing or too full
+    if (header->index_block == FAT_EOF) {
+        if (count >= ENTRIES_PER_BLOCK(fs) && dir_index_wanted(fs, header, count))
+            dir_index_build(fs, dir_block);
+        return;
+    }
+    if ((header->index_used + 1) * 2 > header->index_buckets && dir_index_wanted(fs, header, count)
+        && dir_index_build(fs, dir_block) == OK)
+        return;
+
+    // Without a bigger one, keep using the old index while it has room
+    if (!dir_index_has_room(fs, header)) {
+        dir_index_free(fs, dir_block);
+        return;
+    }
+
+    uint32_t *bucket = dir_index_find(fs, header, entry->name);
+    *bucket = DIR_INDEX_VALUE(fs, entry);
+    header->index_used++;
+
+    if (HAS_FEATURE(fs, FAT_FEATURE_DIR_SORTED))
+        dir_index_sorted_add(fs, header, entry);
+    header->index_entries++;
+}
+
+/**
+ * Removes an entry from the index of a directory
+ */
+void dir_index_remove(FatFs *fs, int dir_block, DirEntry *entry) {
+    DirHeader *header = dir_get_header(fs, dir_block);
+    if (header == NULL || header->index_block == FAT_EOF)
+        return;
+
+    // Leave a mark so the entries after it can still be found
+    uint32_t *bucket = dir_index_find_entry(fs, header, entry);
+    if (*bucket == DIR_INDEX_EMPTY)
+        return;
+    *bucket = DIR_INDEX_DELETED;
+
+    header->index_entries--;
+    if (HAS_FEATURE(fs, FAT_FEATURE_DIR_SORTED)) {
+        DirIndexTree *tree = DIR_INDEX_TREE(fs, header);
+        tree->root = dir_tree_remove(fs, tree, DIR_INDEX_NODES(fs, header), tree->root, entry->name);
+    }
+}
+
+/**
+ * Points the index of a directory to an entry copied to a new slot
+ */
+void dir_index_move(FatFs *fs, int dir_block, DirEntry *from, DirEntry *to) {
+    DirHeader *header = dir_get_header(fs, dir_block);
+    if (header == NULL || header->index_block == FAT_EOF)
+        return;
+
+    uint32_t *bucket = dir_index_find_entry(fs, header, from);
+    if (*bucket == DIR_INDEX_EMPTY)
+        return;
+    *bucket = DIR_INDEX_VALUE(fs, to);
+
+    // Find its node on the way down the sorted entries
+    if (HAS_FEATURE(fs, FAT_FEATURE_DIR_SORTED)) {
+        DirIndexNode *nodes = DIR_INDEX_NODES(fs, header);
+        uint32_t node = DIR_INDEX_TREE(fs, header)->root;
+        while (node != 0 && nodes[node].value != DIR_INDEX_VALUE(fs, from))
+            node = NAME_COMPARE(from->name, NODE_NAME(fs, nodes, node)) < 0 ? nodes[node].left : nodes[node].right;
+        if (node != 0)
+            nodes[node].value = DIR_INDEX_VALUE(fs, to);
+    }
+}
@@ -12,37 +12,184 @@
  * @author Cicim
  */
 FatResult dir_handle_next(FatFs *fs, DirHandle *dir, DirEntry **entry) {
-    // Get the offset in the current block
-    int offset = dir->count % ENTRIES_PER_BLOCK(fs);
+    DirEntry *curr;
+
+    // Skip the header of the directory, if any
+    do {
+        // Get the offset in the current block
+        int offset = dir->count % ENTRIES_PER_BLOCK(fs);
 
-    // Get the pointer to the current block
-    DirEntry *curr = (DirEntry *)fs->blocks_ptr + 
-        dir->block_number * ENTRIES_PER_BLOCK(fs) + offset;
+        // Get the pointer to the current block
+        curr = (DirEntry *)fs->blocks_ptr + 
+            dir->block_number * ENTRIES_PER_BLOCK(fs) + offset;
+
+        // If the entry is a DIR_END, return NULL
+        if (curr->type == DIR_END) {
+            *entry = curr;
+            return END_OF_DIR;
+        }
 
-    // If the entry is a DIR_END, return NULL
-    if (curr->type == DIR_END) {
+        // Otherwise, return the entry
         *entry = curr;
-        return END_OF_DIR;
-    }
+        // Increment the count
+        dir->count++;
+
+        // If the count is in the next block, get the next block
+        if (dir->count % ENTRIES_PER_BLOCK(fs) == 0) {
+            // Get the next block
+            int next_block = fat_get_next_block(fs, dir->block_number);
+            // If the next block is FAT_EOF, throw an error
+            if (next_block == FAT_EOF) {
+                return DIR_END_NOT_FOUND;
+            }
+
+            // Set the block number
+            dir->block_number = next_block;
+        }
+    } while (curr->type == DIR_ENTRY_HEADER);
+
+    return OK;
+}
+
+/**
+ * Returns if "name" comes after the last name listed by the handle
+ */
+static int dir_after_last(DirHandle *dir, const char *name) {
+    int cmp = NAME_COMPARE(name, dir->last_name);
+    return cmp > 0 || (cmp == 0 && dir->include_last);
+}
+
+/**
+ * Returns if the directory keeps its entries sorted in its index
+ */
+static int dir_has_sorted_index(FatFs *fs, int dir_block) {
+    DirHeader *header = dir_get_header(fs, dir_block);
+    return HAS_FEATURE(fs, FAT_FEATURE_DIR_SORTED) && header != NULL && header->index_block != FAT_EOF;
+}
+
+/**
+ * Finds the next "max" entries in order of name looking at every entry once,
+ * for directories without a sorted index, and copies them to "out"
+ * Returns a FatResult or the number of entries found
+ */
+static int dir_find_next_ordered(FatFs *fs, DirHandle *dir, DirEntryPlus *out, int max) {
+    int count = 0;
+    int prefix_length = strlen(dir->prefix);
+
+    DirEntry *curr;
+    DirHandle scan;
+    scan.block_number = dir->first_block;
+    scan.count = 0;
+
+    FatResult res;
+    while ((res = dir_handle_next(fs, &scan, &curr)) == OK) {
+        if (!dir_after_last(dir, curr->name) || strncmp(curr->name, dir->prefix, prefix_length) != 0)
+            continue;
 
-    // Otherwise, return the entry
-    *entry = curr;
-    // Increment the count
-    dir->count++;
-
-    // If the count is in the next block, get the next block
-    if (dir->count % ENTRIES_PER_BLOCK(fs) == 0) {
-        // Get the next block
-        int next_block = fat_get_next_block(fs, dir->block_number);
-        // If the next block is FAT_EOF, throw an error
-        if (next_block == FAT_EOF) {
-            return DIR_END_NOT_FOUND;
+        // Keep the smallest names found so far in order
+        int low = 0, high = count;
+        while (low < high) {
+            int mid = (low + high) / 2;
+            if (NAME_COMPARE(out[mid].entry.name, curr->name) < 0)
+                low = mid + 1;
+            else
+                high = mid;
         }
+        if (low == max)
+            continue;
 
-        // Set the block number
-        dir->block_number = next_block;
+        memmove(&out[low + 1], &out[low], (MIN(count, max - 1) - low) * sizeof(DirEntryPlus));
+        out[low].entry = *curr;
+        if (count < max)
+            count++;
     }
+    if (res != END_OF_DIR)
+        return res;
+    return count;
+}
+
+/**
+ * Forgets the entries found ahead by the handle
+ */
+static void dir_page_reset(DirHandle *dir) {
+    dir->page_count = 0;
+    dir->page_position = 0;
+}
+
+/**
+ * Returns the next entry in order of name from the entries found ahead,
+ * finding the next ones with a single scan when they are all listed
+ * or the directories have changed since
+ */
+static FatResult dir_page_next(FatFs *fs, DirHandle *dir, DirEntry **entry) {
+    if (dir->page_position < dir->page_count && dir->page_changes == fs->dir_changes) {
+        *entry = &dir->page[dir->page_position++].entry;
+        return OK;
+    }
+
+    // Find more entries at a time if all the last ones were listed
+    int capacity = dir->page_capacity ? dir->page_capacity : DIR_PAGE_MIN;
+    if (dir->page_count == dir->page_capacity && dir->page_position == dir->page_count && capacity < DIR_PAGE_MAX)
+        capacity *= 2;
+    if (capacity != dir->page_capacity) {
+        DirEntryPlus *page = realloc(dir->page, capacity * sizeof(DirEntryPlus));
+        if (page == NULL)
+            return OUT_OF_MEMORY;
+        dir->page = page;
+        dir->page_capacity = capacity;
+    }
+
+    dir_page_reset(dir);
+    int count = dir_find_next_ordered(fs, dir, dir->page, dir->page_capacity);
+    if (count < 0)
+        return count;
+    if (count == 0)
+        return END_OF_DIR;
 
+    dir->page_count = count;
+    dir->page_changes = fs->dir_changes;
+    *entry = &dir->page[dir->page_position++].entry;
+    return OK;
+}
+
+/**
+ * Finds the next entry in order of name, in the sorted index
+ * of the directory if it has one, else in the entries found ahead
+ * (looking at every entry for each one without memory for them)
+ */
+static FatResult dir_handle_next_ordered(FatFs *fs, DirHandle *dir, DirEntry **entry) {
+    DirEntry *next = NULL;
+
+    if (dir_has_sorted_index(fs, dir->first_block))
+        next = dir_index_next_sorted(fs, dir_get_header(fs, dir->first_block), dir->last_name, dir->include_last);
+    else {
+        // Without a sorted index, find the next entries a page at a time
+        FatResult res = dir_page_next(fs, dir, &next);
+        if (res != OK && res != OUT_OF_MEMORY)
+            return res;
+    }
+    if (next == NULL && !dir_has_sorted_index(fs, dir->first_block)) {
+        // Without memory for them, keep the smallest name after the last one
+        DirEntry *curr;
+        DirHandle scan;
+        scan.block_number = dir->first_block;
+        scan.count = 0;
+
+        FatResult res;
+        while ((res = dir_handle_next(fs, &scan, &curr)) == OK)
+            if (dir_after_last(dir, curr->name) && (next == NULL || NAME_COMPARE(curr->name, next->name) < 0))
+                next = curr;
+        if (res != END_OF_DIR)
+            return res;
+    }
+
+    // Stop after the names with the prefix
+    if (next == NULL || strncmp(next->name, dir->prefix, strlen(dir->prefix)) != 0)
+        return END_OF_DIR;
+
+    strncpy(dir->last_name, next->name, MAX_FILENAME_LENGTH);
+    dir->include_last = 0;
+    *entry = next;
     return OK;
 }
 
@@ -54,7 +201,8 @@ FatResult dir_handle_next(FatFs *fs, DirHandle *dir, DirEntry **entry) {
 FatResult dir_list(DirHandle *dir, DirEntry *entry) {
     DirEntry *curr;
     // Get the next entry
-    FatResult res = dir_handle_next(dir->fs, dir, &curr);
+    FatResult res = dir->ordered ? dir_handle_next_ordered(dir->fs, dir, &curr)
+        : dir_handle_next(dir->fs, dir, &curr);
     if (res != OK)
         return res;
 
@@ -64,6 +212,149 @@ FatResult dir_list(DirHandle *dir, DirEntry *entry) {
     return OK;
 }
 
+/**
+ * Copies the entry of the element with a path relative to the directory
+ * of the handle, without moving the handle
+ */
+FatResult dir_list_at(DirHandle *dir, const char *path, DirEntry *entry) {
+    if (dir == NULL || entry == NULL)
+        return LS_INVALID_ARGUMENT;
+
+    // Get the directory containing the element
+    char path_buffer[MAX_PATH_LENGTH];
+    char *name;
+    int dir_block;
+    FatResult res = path_get_parent(dir->fs, dir->first_block, path, path_buffer, &dir_block, &name);
+    if (res != OK)
+        return res;
+
+    DirEntry *curr;
+    DirHandle scan;
+    res = dir_get_entry(dir->fs, dir_block, name, &curr, &scan);
+    if (res != OK)
+        return res;
+
+    *entry = *curr;
+    return OK;
+}
+
+/**
+ * Lists up to "max" entries with the sizes and dates of their elements,
+ * read from the entries themselves instead of from their paths
+ * Returns a FatResult or the number of listed entries
+ */
+int dir_list_batch(DirHandle *dir, DirEntryPlus *out, int max) {
+    if (dir == NULL || out == NULL || max <= 0)
+        return LS_INVALID_ARGUMENT;
+
+    // Without a sorted index, find all the entries in order at once
+    int count = 0;
+    if (dir->ordered && !dir_has_sorted_index(dir->fs, dir->first_block)) {
+        dir_page_reset(dir);
+        count = dir_find_next_ordered(dir->fs, dir, out, max);
+        if (count < 0)
+            return count;
+        if (count > 0) {
+            strncpy(dir->last_name, out[count - 1].entry.name, MAX_FILENAME_LENGTH);
+            dir->include_last = 0;
+        }
+    }
+    else while (count < max) {
+        DirEntry *curr;
+        FatResult res = dir->ordered ? dir_handle_next_ordered(dir->fs, dir, &curr)
+            : dir_handle_next(dir->fs, dir, &curr);
+        if (res == END_OF_DIR)
+            break;
+        else if (res != OK)
+            return res;
+
+        out[count++].entry = *curr;
+    }
+
+    for (int i = 0; i < count; i++) {
+        DirEntryPlus *plus = &out[i];
+        DirEntry entry = plus->entry;
+        memset(plus, 0, sizeof(DirEntryPlus));
+        plus->entry = entry;
+
+        FatResult res = get_recursive_size(dir->fs, entry.first_block, entry.type, &plus->size, &plus->blocks);
+        if (res != OK)
+            return res;
+
+        // Only files have dates
+        if (entry.type == DIR_ENTRY_FILE) {
+            FileHeader *fh = (FileHeader *)(dir->fs->blocks_ptr + entry.first_block * dir->fs->header->block_size);
+            plus->date_created = fh->date_created;
+            plus->date_modified = fh->date_modified;
+        }
+    }
+
+    return count;
+}
+
+/**
+ * Saves the position of a listing in order of name
+ * Listings not in order of name only have a position before they start
+ */
+FatResult dir_tell(DirHandle *dir, DirCookie *cookie) {
+    if (dir == NULL || cookie == NULL)
+        return INVALID_COOKIE;
+
+    memset(cookie, 0, sizeof(DirCookie));
+    if (!dir->ordered) {
+        if (dir->block_number != dir->first_block || dir->count != 0)
+            return INVALID_COOKIE;
+        cookie->include_last = 1;
+        return OK;
+    }
+
+    strncpy(cookie->last_name, dir->last_name, MAX_FILENAME_LENGTH);
+    strncpy(cookie->prefix, dir->prefix, MAX_FILENAME_LENGTH);
+    cookie->include_last = dir->include_last;
+    return OK;
+}
+
+/**
+ * Resumes a listing in order of name from a saved position
+ * The entries added or deleted meanwhile do not change what comes after it
+ */
+FatResult dir_seek(DirHandle *dir, const DirCookie *cookie) {
+    if (dir == NULL || cookie == NULL
+        || memchr(cookie->last_name, '\0', MAX_FILENAME_LENGTH) == NULL
+        || memchr(cookie->prefix, '\0', MAX_FILENAME_LENGTH) == NULL)
+        return INVALID_COOKIE;
+
+    dir->ordered = 1;
+    dir_page_reset(dir);
+    strcpy(dir->last_name, cookie->last_name);
+    strcpy(dir->prefix, cookie->prefix);
+    dir->include_last = cookie->include_last != 0;
+    return OK;
+}
+
+/**
+ * Makes the directory handle list the entries in order of name,
+ * starting from "start_name" and stopping after the ones beginning with "prefix"
+ */
+FatResult dir_list_range(DirHandle *dir, const char *start_name, const char *prefix) {
+    if (start_name == NULL)
+        start_name = "";
+    if (prefix == NULL)
+        prefix = "";
+    if (strlen(start_name) >= MAX_FILENAME_LENGTH || strlen(prefix) >= MAX_FILENAME_LENGTH)
+        return INVALID_PATH;
+
+    dir->ordered = 1;
+    dir_page_reset(dir);
+    strcpy(dir->prefix, prefix);
+
+    // The names before the prefix would not be listed anyway
+    strcpy(dir->last_name, NAME_COMPARE(start_name, prefix) < 0 ? prefix : start_name);
+    dir->include_last = 1;
+
+    return OK;
+}
+
 
 // Returns the size in blocks of the given directory
 FatResult file_size(FatFs *fs, const char *path, int *size, int *blocks) {
@@ -87,6 +378,8 @@ FatResult file_size(FatFs *fs, const char *path, int *size, int *blocks) {
     // Get the dir block
     int dir_block;
     res = dir_get_first_block(fs, dir_path, &dir_block);
+    if (res != OK)
+        return res;
 
     // Get the name entry
     DirEntry *entry;
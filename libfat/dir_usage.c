@@ -0,0 +1,209 @@
+/**
+ * Bytes and blocks used by the directories (FAT_FEATURE_DIR_USAGE),
+ * kept up to date along the chain of parent directories
+ */
+#include <stdlib.h>
+#include "internals.h"
+
+/**
+ * Returns if the totals must be computed again before being used
+ */
+static int dir_usage_stale(FatFs *fs) {
+    return (DIR_USAGE(fs, ROOT_DIR_BLOCK)->flags & DIR_USAGE_STALE) != 0;
+}
+
+/**
+ * Returns the usage totals of a directory, or NULL if it has none
+ */
+DirUsage *dir_get_usage(FatFs *fs, int dir_block) {
+    if (!HAS_FEATURE(fs, FAT_FEATURE_DIR_USAGE) || dir_get_header(fs, dir_block) == NULL)
+        return NULL;
+
+    DirUsage *usage = DIR_USAGE(fs, dir_block);
+    if (usage->type != DIR_ENTRY_HEADER)
+        return NULL;
+    return usage;
+}
+
+/**
+ * Gets the bytes and blocks used by the entries and the index of a directory,
+ * without the elements in it (as counted by get_recursive_size)
+ */
+void dir_usage_own(FatFs *fs, int dir_block, int *size, int *blocks) {
+    DirHeader *header = dir_get_tail(fs, dir_block);
+    if (header == NULL) {
+        *size = *blocks = 0;
+        return;
+    }
+
+    // The headers, the entries and the DIR_END
+    int slots = DIR_HEADER_ENTRIES(fs) + header->entries + 1;
+    *size = slots * sizeof(DirEntry);
+    *blocks = CEIL(slots, ENTRIES_PER_BLOCK(fs));
+
+    if (header->index_block != FAT_EOF)
+        *blocks += CEIL(DIR_INDEX_SIZE(fs, header->index_buckets), fs->header->block_size);
+}
+
+/**
+ * Starts the totals of a new directory, after its header
+ */
+void dir_usage_init(FatFs *fs, int dir_block, int parent_block) {
+    if (!HAS_FEATURE(fs, FAT_FEATURE_DIR_USAGE))
+        return;
+
+    DirUsage *usage = DIR_USAGE(fs, dir_block);
+    usage->type = DIR_ENTRY_HEADER;
+    usage->parent_block = parent_block;
+    usage->flags = 0;
+    dir_usage_own(fs, dir_block, &usage->size, &usage->blocks);
+}
+
+/**
+ * Adds to the totals of a directory and of all the ones containing it
+ */
+void dir_usage_add(FatFs *fs, int dir_block, int size, int blocks) {
+    if (!HAS_FEATURE(fs, FAT_FEATURE_DIR_USAGE) || dir_usage_stale(fs) || (size == 0 && blocks == 0))
+        return;
+
+    // A directory can't be in more directories than there are blocks
+    for (int depth = 0; dir_block != FAT_EOF; depth++) {
+        DirUsage *usage = dir_get_usage(fs, dir_block);
+        if (usage == NULL || depth == fs->header->blocks_count) {
+            dir_usage_invalidate(fs);
+            return;
+        }
+
+        usage->size += size;
+        usage->blocks += blocks;
+        dir_block = usage->parent_block;
+    }
+}
+
+/**
+ * Adds (or subtracts if "sign" is -1) the totals of an element to its directory
+ */
+void dir_usage_add_child(FatFs *fs, int dir_block, int child_block, int child_type, int sign) {
+    if (dir_get_usage(fs, dir_block) == NULL || dir_usage_stale(fs))
+        return;
+
+    int size, blocks;
+    if (get_recursive_size(fs, child_block, child_type, &size, &blocks) != OK) {
+        dir_usage_invalidate(fs);
+        return;
+    }
+    dir_usage_add(fs, dir_block, sign * size, sign * blocks);
+}
+
+/**
+ * Computes the totals of a directory from the ones of its elements
+ */
+void dir_usage_sum(FatFs *fs, int dir_block) {
+    DirUsage *usage = dir_get_usage(fs, dir_block);
+    if (usage == NULL || dir_usage_stale(fs))
+        return;
+
+    int total_size, total_blocks;
+    dir_usage_own(fs, dir_block, &total_size, &total_blocks);
+
+    DirEntry *entry;
+    DirHandle dir;
+    dir.block_number = dir_block;
+    dir.count = 0;
+    while (dir_handle_next(fs, &dir, &entry) == OK) {
+        int size, blocks;
+        if (get_recursive_size(fs, entry->first_block, entry->type, &size, &blocks) != OK) {
+            dir_usage_invalidate(fs);
+            return;
+        }
+        total_size += size;
+        total_blocks += blocks;
+    }
+
+    usage->size = total_size;
+    usage->blocks = total_blocks;
+}
+
+/**
+ * Marks every total as stale, to be computed again when needed
+ */
+void dir_usage_invalidate(FatFs *fs) {
+    if (HAS_FEATURE(fs, FAT_FEATURE_DIR_USAGE))
+        DIR_USAGE(fs, ROOT_DIR_BLOCK)->flags |= DIR_USAGE_STALE;
+}
+
+/**
+ * Computes the totals and the parent of every directory, from the root
+ * The directories in a directory get their totals before it
+ */
+static FatResult dir_usage_compute(FatFs *fs) {
+    DirWalk walk = {0};
+    FatResult res = dir_walk_push(&walk, ROOT_DIR_BLOCK);
+    while (res == OK) {
+        DirWalkFrame *frame = DIR_WALK_TOP(&walk);
+        DirEntry *entry;
+        res = dir_handle_next(fs, &frame->dir, &entry);
+
+        if (res == OK) {
+            if (entry->type == DIR_ENTRY_DIRECTORY) {
+                res = dir_walk_push(&walk, entry->first_block);
+                continue;
+            }
+
+            int size, blocks;
+            res = get_recursive_size(fs, entry->first_block, entry->type, &size, &blocks);
+            frame->size += size;
+            frame->blocks += blocks;
+            continue;
+        }
+        else if (res != END_OF_DIR)
+            break;
+
+        DirUsage *usage = dir_get_usage(fs, frame->dir_block);
+        if (usage == NULL) {
+            res = INVALID_BLOCK;
+            break;
+        }
+        res = OK;
+
+        int size, blocks;
+        dir_usage_own(fs, frame->dir_block, &size, &blocks);
+        usage->size = frame->size + size;
+        usage->blocks = frame->blocks + blocks;
+
+        // Add it to the directory containing it
+        if (--walk.depth == 0) {
+            usage->parent_block = FAT_EOF;
+            break;
+        }
+        usage->parent_block = DIR_WALK_TOP(&walk)->dir_block;
+        DIR_WALK_TOP(&walk)->size += usage->size;
+        DIR_WALK_TOP(&walk)->blocks += usage->blocks;
+    }
+
+    dir_walk_free(&walk);
+    return res;
+}
+
+/**
+ * Returns the totals of a directory, computing all of them again if they are stale
+ */
+FatResult dir_usage_get(FatFs *fs, int dir_block, int *size, int *blocks) {
+    DirUsage *usage = dir_get_usage(fs, dir_block);
+    if (usage == NULL)
+        return INVALID_BLOCK;
+
+    if (dir_usage_stale(fs)) {
+        // Every total is computed again, from the root
+        DIR_USAGE(fs, ROOT_DIR_BLOCK)->flags &= ~DIR_USAGE_STALE;
+        FatResult res = dir_usage_compute(fs);
+        if (res != OK) {
+            dir_usage_invalidate(fs);
+            return res;
+        }
+    }
+
+    *size = usage->size;
+    *blocks = usage->blocks;
+    return OK;
+}
@@ -0,0 +1,332 @@
+/**
+ * Traversal of directory trees, with a stack (or a queue)
+ * of the directories being visited
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "internals.h"
+
+/**
+ * Starts visiting a directory, on top of the stack
+ * Frames taken before are moved if the stack grows
+ */
+FatResult dir_walk_push(DirWalk *walk, int dir_block) {
+    // Double the stack when it is full
+    if (walk->depth == walk->capacity) {
+        int capacity = walk->capacity ? walk->capacity * 2 : DIR_WALK_MIN_DEPTH;
+        DirWalkFrame *frames = realloc(walk->frames, capacity * sizeof(DirWalkFrame));
+        if (frames == NULL)
+            return OUT_OF_MEMORY;
+
+        walk->frames = frames;
+        walk->capacity = capacity;
+    }
+
+    DirWalkFrame *frame = &walk->frames[walk->depth++];
+    frame->dir.block_number = dir_block;
+    frame->dir.count = 0;
+    frame->dir_block = dir_block;
+    frame->entry = NULL;
+    frame->size = 0;
+    frame->blocks = 0;
+    frame->count = 0;
+    frame->flags = 0;
+    frame->path_length = 0;
+    return OK;
+}
+
+/**
+ * Frees the stack of a traversal
+ */
+void dir_walk_free(DirWalk *walk) {
+    free(walk->frames);
+    walk->frames = NULL;
+    walk->depth = 0;
+    walk->capacity = 0;
+}
+
+// Path of the element being visited, that can grow past MAX_PATH_LENGTH
+typedef struct WalkPath {
+    char *buffer;
+    int capacity;
+} WalkPath;
+
+/**
+ * Writes "/name" after the first "length" characters of the path
+ * Returns the new length, or -1 without memory
+ */
+static int walk_path_append(WalkPath *path, int length, const char *name) {
+    int name_length = strnlen(name, MAX_FILENAME_LENGTH);
+    int new_length = length + 1 + name_length;
+
+    if (new_length + 1 > path->capacity) {
+        int capacity = path->capacity ? path->capacity : MAX_PATH_LENGTH;
+        while (capacity < new_length + 1)
+            capacity *= 2;
+
+        char *buffer = realloc(path->buffer, capacity);
+        if (buffer == NULL)
+            return -1;
+        path->buffer = buffer;
+        path->capacity = capacity;
+    }
+
+    path->buffer[length] = '/';
+    memcpy(path->buffer + length + 1, name, name_length);
+    path->buffer[new_length] = '\0';
+    return new_length;
+}
+
+/**
+ * Asks the kernel to read the first block of a directory from the file in advance
+ */
+static void walk_prefetch(FatFs *fs, int dir_block) {
+    long page_size = sysconf(_SC_PAGESIZE);
+    if (page_size <= 0)
+        return;
+
+    char *start = fs->blocks_ptr + dir_block * fs->header->block_size;
+    char *page = (char *)((uintptr_t)start & ~(uintptr_t)(page_size - 1));
+    madvise(page, start + fs->header->block_size - page, MADV_WILLNEED);
+}
+
+/**
+ * Calls the function on an element, with its path after "length" characters
+ * Returns what the function returned, or -1 without memory
+ */
+static int walk_visit(FatFs *fs, WalkPath *path, int length, DirEntry *entry, int depth,
+                      FatWalkCallback callback, void *arg, int *entry_length) {
+    *entry_length = walk_path_append(path, length, entry->name);
+    if (*entry_length < 0)
+        return -1;
+
+    // The function gets a copy, it can't change the entry
+    DirEntry copy = *entry;
+    return callback(fs, path->buffer, &copy, depth, arg);
+}
+
+/**
+ * Visits the tree depth-first, with the entries of each directory
+ * before the ones of the next
+ */
+static int walk_depth_first(FatFs *fs, int dir_block, WalkPath *path, int length,
+                            FatWalkCallback callback, void *arg) {
+    DirWalk walk = {0};
+    int res = dir_walk_push(&walk, dir_block);
+    if (res == OK)
+        DIR_WALK_TOP(&walk)->path_length = length;
+
+    while (res == OK && walk.depth > 0) {
+        DirWalkFrame *frame = DIR_WALK_TOP(&walk);
+        DirEntry *entry;
+        res = dir_handle_next(fs, &frame->dir, &entry);
+        if (res == END_OF_DIR) {
+            walk.depth--;
+            res = OK;
+            continue;
+        }
+        else if (res != OK)
+            break;
+
+        int entry_length;
+        int action = walk_visit(fs, path, frame->path_length, entry, walk.depth - 1, callback, arg, &entry_length);
+        if (action < 0)
+            res = OUT_OF_MEMORY;
+        else if (action == FAT_WALK_STOP)
+            res = FAT_WALK_STOP;
+
+        // The function may have moved the directory, so get its block again
+        else if (action != FAT_WALK_SKIP && entry->type == DIR_ENTRY_DIRECTORY) {
+            res = dir_walk_push(&walk, entry->first_block);
+            if (res == OK)
+                DIR_WALK_TOP(&walk)->path_length = entry_length;
+        }
+    }
+
+    dir_walk_free(&walk);
+    return res;
+}
+
+// Directory to visit at a depth of a breadth-first walk, and its path
+typedef struct WalkLevel {
+    // First blocks of the directories, with where their paths are in "paths"
+    int *dirs;
+    int *path_offsets;
+    int count;
+    int capacity;
+    // The paths one after the other
+    char *paths;
+    int paths_size;
+    int paths_capacity;
+} WalkLevel;
+
+/**
+ * Adds a directory to visit, copying its path
+ */
+static FatResult walk_level_add(WalkLevel *level, int dir_block, const char *path, int length) {
+    if (level->count == level->capacity) {
+        int capacity = level->capacity ? level->capacity * 2 : DIR_WALK_MIN_DEPTH;
+        int *dirs = realloc(level->dirs, capacity * sizeof(int));
+        if (dirs == NULL)
+            return OUT_OF_MEMORY;
+        level->dirs = dirs;
+
+        int *path_offsets = realloc(level->path_offsets, capacity * sizeof(int));
+        if (path_offsets == NULL)
+            return OUT_OF_MEMORY;
+        level->path_offsets = path_offsets;
+        level->capacity = capacity;
+    }
+
+    if (level->paths_size + length + 1 > level->paths_capacity) {
+        int capacity = level->paths_capacity ? level->paths_capacity : MAX_PATH_LENGTH;
+        while (capacity < level->paths_size + length + 1)
+            capacity *= 2;
+
+        char *paths = realloc(level->paths, capacity);
+        if (paths == NULL)
+            return OUT_OF_MEMORY;
+        level->paths = paths;
+        level->paths_capacity = capacity;
+    }
+
+    level->dirs[level->count] = dir_block;
+    level->path_offsets[level->count++] = level->paths_size;
+    memcpy(level->paths + level->paths_size, path, length);
+    level->paths[level->paths_size + length] = '\0';
+    level->paths_size += length + 1;
+    return OK;
+}
+
+// Directory of a level, in the order of the visit
+typedef struct WalkOrder {
+    int dir_block;
+    int index;
+} WalkOrder;
+
+// Orders the directories of a level by their first block
+static int walk_order_compare(const void *a, const void *b) {
+    return ((WalkOrder *)a)->dir_block - ((WalkOrder *)b)->dir_block;
+}
+
+/**
+ * Visits the tree breadth-first, a depth at a time, and optionally
+ * the directories at each depth in order of block
+ */
+static int walk_breadth_first(FatFs *fs, int dir_block, WalkPath *path, int length,
+                              FatWalkCallback callback, int flags, void *arg) {
+    WalkLevel levels[2] = {{0}};
+    WalkLevel *level = &levels[0], *next = &levels[1];
+    WalkOrder *order = NULL;
+    int res = walk_level_add(level, dir_block, path->buffer, length);
+
+    for (int depth = 0; res == OK && level->count > 0; depth++) {
+        // Choose the order of the directories
+        WalkOrder *new_order = realloc(order, level->count * sizeof(WalkOrder));
+        if (new_order == NULL) {
+            res = OUT_OF_MEMORY;
+            break;
+        }
+        order = new_order;
+        for (int i = 0; i < level->count; i++) {
+            order[i].dir_block = level->dirs[i];
+            order[i].index = i;
+        }
+        if (flags & FAT_WALK_BLOCK_ORDER)
+            qsort(order, level->count, sizeof(WalkOrder), walk_order_compare);
+
+        next->count = 0;
+        next->paths_size = 0;
+        for (int i = 0; res == OK && i < level->count; i++) {
+            // Read the next directory while this one is visited
+            if (i + 1 < level->count)
+                walk_prefetch(fs, order[i + 1].dir_block);
+
+            // The path of the directory is copied to be extended
+            const char *dir_path = level->paths + level->path_offsets[order[i].index];
+            int dir_length = strlen(dir_path);
+            if (dir_length + 1 > path->capacity) {
+                char *buffer = realloc(path->buffer, dir_length + 1);
+                if (buffer == NULL) {
+                    res = OUT_OF_MEMORY;
+                    break;
+                }
+                path->buffer = buffer;
+                path->capacity = dir_length + 1;
+            }
+            memcpy(path->buffer, dir_path, dir_length + 1);
+
+            DirEntry *entry;
+            DirHandle dir;
+            dir.block_number = order[i].dir_block;
+            dir.count = 0;
+            while (res == OK && (res = dir_handle_next(fs, &dir, &entry)) == OK) {
+                int entry_length;
+                int action = walk_visit(fs, path, dir_length, entry, depth, callback, arg, &entry_length);
+                if (action < 0)
+                    res = OUT_OF_MEMORY;
+                else if (action == FAT_WALK_STOP)
+                    res = FAT_WALK_STOP;
+                else if (action != FAT_WALK_SKIP && entry->type == DIR_ENTRY_DIRECTORY)
+                    res = walk_level_add(next, entry->first_block, path->buffer, entry_length);
+            }
+            if (res == END_OF_DIR)
+                res = OK;
+        }
+
+        // The next depth
+        WalkLevel *visited = level;
+        level = next;
+        next = visited;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        free(levels[i].dirs);
+        free(levels[i].path_offsets);
+        free(levels[i].paths);
+    }
+    free(order);
+    return res;
+}
+
+/**
+ * Calls "callback" on every element in the tree of a directory
+ * Each element is visited once, with its path, before the ones in it
+ */
+int fat_walk(FatFs *fs, const char *path, FatWalkCallback callback, int flags, void *arg) {
+    if (fs == NULL || path == NULL || callback == NULL)
+        return WALK_INVALID_ARGUMENT;
+
+    // Get the directory to walk
+    char path_buffer[MAX_PATH_LENGTH];
+    FatResult res = path_get_absolute(fs, path, path_buffer);
+    if (res != OK)
+        return res;
+
+    int dir_block;
+    res = dir_get_first_block(fs, path_buffer, &dir_block);
+    if (res != OK)
+        return res;
+
+    // The paths of the elements in the root begin with a single '/'
+    WalkPath walk_path;
+    walk_path.capacity = MAX_PATH_LENGTH;
+    walk_path.buffer = malloc(MAX_PATH_LENGTH);
+    if (walk_path.buffer == NULL)
+        return OUT_OF_MEMORY;
+    int length = IS_ROOT(path_buffer) ? 0 : strlen(path_buffer);
+    memcpy(walk_path.buffer, path_buffer, length);
+    walk_path.buffer[length] = '\0';
+
+    int result;
+    if (flags & (FAT_WALK_BREADTH_FIRST | FAT_WALK_BLOCK_ORDER))
+        result = walk_breadth_first(fs, dir_block, &walk_path, length, callback, flags, arg);
+    else
+        result = walk_depth_first(fs, dir_block, &walk_path, length, callback, arg);
+
+    free(walk_path.buffer);
+    return result;
+}
@@ -2,6 +2,7 @@
  * Header File for User-Accessible Structs and Functions
  * @authors Cicim, Claziero
  */
+#include <stdint.h>
 
 typedef int date_t;
 
@@ -9,6 +10,19 @@ typedef int date_t;
 #define FILE_SEEK_CUR 1
 #define FILE_SEEK_END 2
 
+// Optional features of the file system, chosen by fat_init_with_features
+// Files keep a map of their extents after their header
+#define FAT_FEATURE_EXTENTS 0x1
+// The FAT has 16-bit entries (at most FAT16_MAX_BLOCKS blocks)
+#define FAT_FEATURE_FAT16 0x2
+#define FAT16_MAX_BLOCKS 65535
+// Directories start with a header and keep a hash index of their entries
+#define FAT_FEATURE_DIR_INDEX 0x4
+// The directory indexes also keep the entries sorted by name in a balanced tree (needs FAT_FEATURE_DIR_INDEX)
+#define FAT_FEATURE_DIR_SORTED 0x8
+// Directories keep the bytes and blocks used by everything in them (needs FAT_FEATURE_DIR_INDEX)
+#define FAT_FEATURE_DIR_USAGE 0x10
+
 #define MAX_FILENAME_LENGTH 27
 #define MAX_PATH_LENGTH 512
 
@@ -35,12 +49,27 @@ typedef enum FatResult {
     FILE_OPEN_INVALID_ARGUMENT = -19,
     LS_INVALID_ARGUMENT = -20,
     SAME_PATH = -21,
+    INVALID_ALLOCATOR = -22,
+    FAT_SYNC_ERROR = -23,
+    FALLOCATE_INVALID_ARGUMENT = -24,
+    INVALID_FEATURES = -25,
+    INVALID_COOKIE = -26,
+    WALK_INVALID_ARGUMENT = -27,
+    FILE_ERASED = -28,
 } FatResult;
 
+typedef enum FatAllocator {
+    FAT_ALLOC_BITMAP = 0,
+    FAT_ALLOC_FIRST_FIT = 1,
+    FAT_ALLOC_BEST_FIT = 2
+} FatAllocator;
+
 typedef enum DirEntryType {
     DIR_END = 0,
     DIR_ENTRY_FILE = 1,
-    DIR_ENTRY_DIRECTORY = 2
+    DIR_ENTRY_DIRECTORY = 2,
+    // First entry of a directory with FAT_FEATURE_DIR_INDEX (never listed)
+    DIR_ENTRY_HEADER = 3
 } DirEntryType;
 
 
@@ -62,10 +91,40 @@ typedef struct FatFs {
     FatHeader *header;
     int buffer_fd;
     int buffer_size;
+    unsigned int features;
 
-    char *bitmap_ptr;
-    int *fat_ptr;
+    unsigned char *bitmap_ptr;
+    void *fat_ptr;
     char *blocks_ptr;
+
+    // The FAT has 16-bit entries (FAT_FEATURE_FAT16)
+    char fat16;
+
+    // Every block before this one is occupied
+    int free_cursor;
+    // Bit i of word j is set if bitmap word 64 * j + i has a free block
+    uint64_t *bitmap_summary;
+
+    // Free extents indexed by start and by length (unless using the bitmap)
+    FatAllocator allocator;
+    struct FreeExtent *free_extents;
+    struct FreeExtent *free_extents_by_length;
+
+    // Entries recently found in the directories, by directory and name
+    struct DentryCacheEntry *dentry_cache;
+    // Bloom filters of the names in the directories looked up recently
+    struct DirBloom *dir_blooms;
+
+    // Blocks promised to delayed writes, not yet taken from the bitmap
+    int reserved_blocks;
+    // Open files with delayed writes to place
+    struct FileHandle *delayed_files;
+    // Open files, to follow them when they are moved
+    struct FileHandle *open_files;
+    // Open directories, to follow them when they are moved
+    struct DirHandle *open_dirs;
+    // Changes to the entries of the directories, for the entries listed ahead
+    unsigned int dir_changes;
 } FatFs;
 
 // Time struct
@@ -95,6 +154,25 @@ typedef struct FileHandle {
     int file_offset;
     char can_write:1;
     char can_read:1;
+    // The file was erased while open, its blocks belong to no one
+    char detached:1;
+
+    // Appended data waiting for its blocks (delayed allocation)
+    char delayed:1;
+    char *pending;
+    int pending_size;
+    int pending_capacity;
+    int reserved_blocks;
+    struct FileHandle *next_delayed;
+
+    // Directory of the file (FAT_EOF if unknown), and the next open file
+    int dir_block;
+    struct FileHandle *next_open;
+
+    // Blocks of the file found so far, by position in the file
+    int *block_index;
+    int block_index_count;
+    int block_index_capacity;
 } FileHandle;
 
 // Data needed by operations on a directory
@@ -102,6 +180,24 @@ typedef struct DirHandle {
     FatFs *fs;
     int block_number;
     int count;
+
+    // Listing in order of name, after "last_name" (or from it if "include_last")
+    int first_block;
+    char ordered;
+    char include_last;
+    char last_name[MAX_FILENAME_LENGTH];
+    char prefix[MAX_FILENAME_LENGTH];
+
+    // Next entries in order of name, found a page at a time without a sorted index,
+    // valid until the directories change
+    struct DirEntryPlus *page;
+    int page_count;
+    int page_position;
+    int page_capacity;
+    unsigned int page_changes;
+
+    // Next open directory, to follow them when they are moved
+    struct DirHandle *next_open;
 } DirHandle;
 
 // Data returned by listing a directory
@@ -111,6 +207,42 @@ typedef struct DirEntry {
     unsigned int first_block;
 } DirEntry;
 
+// Position of a listing in order of name, that can be saved to resume it later
+typedef struct DirCookie {
+    char last_name[MAX_FILENAME_LENGTH];
+    char include_last;
+    char prefix[MAX_FILENAME_LENGTH];
+} DirCookie;
+
+// Data returned by listing a directory with the attributes of its elements
+typedef struct DirEntryPlus {
+    DirEntry entry;
+    int size;
+    int blocks;
+    // Only set for files
+    DateTime date_created;
+    DateTime date_modified;
+} DirEntryPlus;
+
+// Flags of fat_walk
+// Visit all the elements at a depth before the ones deeper (else depth-first)
+#define FAT_WALK_BREADTH_FIRST 0x1
+// Breadth-first, visiting the directories at a depth in order of their first block
+#define FAT_WALK_BLOCK_ORDER 0x2
+
+// Values returned by the function called by fat_walk
+typedef enum FatWalkAction {
+    FAT_WALK_CONTINUE = 0,
+    // Don't visit the elements in this directory
+    FAT_WALK_SKIP,
+    // Stop the walk (fat_walk returns FAT_WALK_STOP)
+    FAT_WALK_STOP
+} FatWalkAction;
+
+// Function called by fat_walk with the path of every element and its depth
+// (0 for the elements in the directory walked), "arg" is the one given to fat_walk
+typedef FatWalkAction (*FatWalkCallback)(FatFs *fs, const char *path, const DirEntry *entry, int depth, void *arg);
+
 
 /**
  * File System Functions
@@ -118,15 +250,26 @@ typedef struct DirEntry {
 // Create a file system and save it to a file
 FatResult fat_init(const char *fat_path, int block_size, int blocks_count);
 
+// Create a file system using the given features and save it to a file
+FatResult fat_init_with_features(const char *fat_path, int block_size, int blocks_count, unsigned int features);
+
 // Open an initialized FAT file system from a path
 FatResult fat_open(FatFs **fs, char *fat_path);
 
 // Close a file system and save its contents to a file
+// (returning the first error placing the delayed writes, which are lost)
 FatResult fat_close(FatFs *fs);
 
+// Places the blocks of every delayed write and saves the file system to its file
+FatResult fat_sync(FatFs *fs);
+
 // Return a string representation of a FAT result
 const char *fat_result_string(FatResult res);
 
+// Selects the block allocator used by this mount
+// (the free-extent index is built from the bitmap when needed)
+FatResult fat_set_allocator(FatFs *fs, FatAllocator allocator);
+
 
 /**
  * File Functions
@@ -135,10 +278,17 @@ const char *fat_result_string(FatResult res);
 // returns an error if path is invalid
 FatResult file_create(FatFs *fs, const char *path);
 
+// Creates a file with a path relative to an open directory
+// (absolute paths ignore the directory)
+FatResult file_create_at(DirHandle *dir, const char *path);
+
 // Erases the file from the given path
 // returns an error if path is invalid
 FatResult file_erase(FatFs *fs, const char *path);
 
+// Erases the file with a path relative to an open directory
+FatResult file_erase_at(DirHandle *dir, const char *path);
+
 // Returns a file descriptor (struct FileHandle) given a block number 
 FatResult file_open_by_block(FatFs *fs, int block_number, FileHandle **file);
 
@@ -146,16 +296,29 @@ FatResult file_open_by_block(FatFs *fs, int block_number, FileHandle **file);
 // returns an error if path is invalid
 FatResult file_open(FatFs *fs, const char *path, FileHandle **file, char *mode);
 
+// Creates a file handle given a path relative to an open directory
+FatResult file_open_at(DirHandle *dir, const char *path, FileHandle **file, char *mode);
+
 // Frees the memory occupied by a file handle
+// (placing the blocks of its delayed writes first, which are lost if that fails)
 FatResult file_close(FileHandle *file);
 
+// Places the blocks of the delayed writes of a file handle
+// (keeping them to try again if that fails)
+FatResult file_flush(FileHandle *file);
+
 // Prints the file contents to stdout
 FatResult file_print(FileHandle *file);
 
 // Changes file dimension
 FatResult change_file_dimension(FileHandle *file, int size);
 
-// Writes data from a buffer into file
+// Links the blocks for a range of the file without writing
+// or changing its size, so later writes there don't allocate
+// (the blocks past the size are not counted by file_size and the usage totals)
+FatResult file_fallocate(FileHandle *file, int offset, int len);
+
+// Writes data from a buffer into file, which then ends with it
 // returns a FatResult or the number of written bytes
 int file_write(FileHandle *file, const char *data, int size);
 
@@ -176,7 +339,12 @@ FatResult file_move(FatFs *fs, const char *source_path, const char *dest_path);
 // Copy a file or directory from to another location
 FatResult file_copy(FatFs *fs, const char *source_path, const char *dest_path);
 
+// Moves the blocks of a file or directory to a single run of contiguous blocks
+// returns how many blocks were moved (the open handles of it follow its blocks)
+FatResult file_defrag(FatFs *fs, const char *path, int *moved_blocks);
+
 // Gets the size and block size of a file or a directory
+// (without the blocks preallocated past the size of the files)
 FatResult file_size(FatFs *fs, const char *path, int *size, int *blocks);
 
 /**
@@ -186,6 +354,9 @@ FatResult file_size(FatFs *fs, const char *path, int *size, int *blocks);
 // returns an error if path is invalid
 FatResult dir_create(FatFs *fs, const char *path);
 
+// Creates a directory with a path relative to an open directory
+FatResult dir_create_at(DirHandle *dir, const char *path);
+
 // Erases the directory given a path
 // returns an error if path is invalid
 FatResult dir_erase(FatFs *fs, const char *path);
@@ -199,8 +370,35 @@ FatResult dir_close(DirHandle *dir);
 
 // Get the next element in the directory
 // returns END_OF_DIR if there are no more elements
+// In order of creation (the default without FAT_FEATURE_DIR_SORTED) erasing elements
+// during a listing may make it skip others: list in order of name with
+// dir_list_range (or dir_seek) before the first call to erase while listing
 FatResult dir_list(DirHandle *dir, DirEntry *entry);
 
+// Gets the entry of the element with a path relative to an open directory
+// returns FILE_NOT_FOUND if there is no such element
+FatResult dir_list_at(DirHandle *dir, const char *path, DirEntry *entry);
+
+// Gets up to "max" next elements in the directory, with their size and dates
+// returns the number of elements (0 if there are no more) or an error
+int dir_list_batch(DirHandle *dir, DirEntryPlus *out, int max);
+
+// Saves the position of a listing in order of name in a cookie
+// returns INVALID_COOKIE for listings not in order of name that have started
+FatResult dir_tell(DirHandle *dir, DirCookie *cookie);
+
+// Resumes a listing in order of name from a cookie, even if the directory changed
+FatResult dir_seek(DirHandle *dir, const DirCookie *cookie);
+
+// Makes dir_list return the elements in order of name, from "start_name" on,
+// as long as they begin with "prefix" (both can be NULL)
+FatResult dir_list_range(DirHandle *dir, const char *start_name, const char *prefix);
+
 // Changes the current directory to the given path
 // returns an error if path is invalid
 FatResult dir_change(FatFs *fs, const char *path);
+
+// Calls "callback" on every element in the tree of a directory, with "flags" FAT_WALK_*
+// "callback" may move the blocks of the element it gets, not add or remove elements
+// returns OK, FAT_WALK_STOP if "callback" stopped the walk, or an error
+int fat_walk(FatFs *fs, const char *path, FatWalkCallback callback, int flags, void *arg);
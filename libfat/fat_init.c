@@ -16,17 +16,50 @@
  * @author Claziero
  */
 FatResult fat_init(const char *fat_path, int block_size, int blocks_count) {
+    return fat_init_with_features(fat_path, block_size, blocks_count, 0);
+}
+
+/**
+ * Create a file system using the given features and save it to a file
+ */
+FatResult fat_init_with_features(const char *fat_path, int block_size, int blocks_count, unsigned int features) {
+    // Check if the features are known
+    if (features & ~FAT_FEATURES_ALL)
+        return INVALID_FEATURES;
+
+    // The entries are sorted in the directory index
+    if ((features & FAT_FEATURE_DIR_SORTED) && !(features & FAT_FEATURE_DIR_INDEX))
+        return INVALID_FEATURES;
+
+    // And the usage totals after the header of the directory
+    if ((features & FAT_FEATURE_DIR_USAGE) && !(features & FAT_FEATURE_DIR_INDEX))
+        return INVALID_FEATURES;
+
     // Check if the number of blocks is valid (must be multiple of 32)
     if (blocks_count <= 0 || blocks_count % 32 != 0) 
         return INVALID_BLOCKS_COUNT;
 
+    // A 16-bit FAT can't address more blocks (FAT16_EOF is reserved)
+    if ((features & FAT_FEATURE_FAT16) && blocks_count > FAT16_MAX_BLOCKS)
+        return INVALID_BLOCKS_COUNT;
+
     // Check if the block size is valid (must be multiple of 32)
     if (block_size <= 0 || block_size % 32 != 0) 
         return INVALID_BLOCK_SIZE;
 
+    // The extent map must leave room for data in the first block of a file
+    if ((features & FAT_FEATURE_EXTENTS) && block_size <= sizeof(FileHeader) + sizeof(FileExtentMap))
+        return INVALID_BLOCK_SIZE;
+
+    // The header of a directory must leave room for the DIR_END in its first block
+    if ((features & FAT_FEATURE_DIR_INDEX) && block_size < 2 * sizeof(DirEntry))
+        return INVALID_BLOCK_SIZE;
+    if ((features & FAT_FEATURE_DIR_USAGE) && block_size < 3 * sizeof(DirEntry))
+        return INVALID_BLOCK_SIZE;
+
     // Create and initialize the FAT header
     FatHeader header;
-    header.magic = FAT_MAGIC;
+    header.magic = FAT_MAGIC | features;
     header.block_size = block_size;
     header.blocks_count = blocks_count;
     header.free_blocks = blocks_count - 1;
@@ -36,7 +69,8 @@ FatResult fat_init(const char *fat_path, int block_size, int blocks_count) {
     // The FAT table begins after the bitmap
     int fat_offset = bitmap_offset + (blocks_count / 8);
     // The blocks begin after the FAT
-    int blocks_offset = fat_offset + (blocks_count * sizeof(int));
+    int entry_size = FAT_ENTRY_SIZE(features);
+    int blocks_offset = fat_offset + (blocks_count * entry_size);
 
 
     // Open the FAT file
@@ -79,10 +113,10 @@ FatResult fat_init(const char *fat_path, int block_size, int blocks_count) {
     for (int i = 0; i < blocks_count; i++) {
         int written_bytes = 0;
         while (written_bytes < sizeof(FatHeader)) {
-            written_bytes += write(fat_fd, &ff + written_bytes, sizeof(int) - written_bytes);   
+            written_bytes += write(fat_fd, &ff + written_bytes, entry_size - written_bytes);   
             
             // Check if the write succeeded
-            if (written_bytes == sizeof(int))
+            if (written_bytes == entry_size)
                 break;
             else if (errno == EINTR)
                 // If the write was interrupted by a signal, try again
@@ -97,6 +131,33 @@ FatResult fat_init(const char *fat_path, int block_size, int blocks_count) {
     if (ftruncate(fat_fd, blocks_offset + (blocks_count * block_size)) != 0)
         return FAT_BUFFER_ERROR;
 
+    // Start the root directory with its header
+    if (features & FAT_FEATURE_DIR_INDEX) {
+        DirHeader root_header = {0};
+        root_header.index_block = FAT_EOF;
+        root_header.type = DIR_ENTRY_HEADER;
+        root_header.flags = DIR_HEADER_TAIL;
+        root_header.end_block = ROOT_DIR_BLOCK;
+        root_header.end_prev_block = FAT_EOF;
+
+        if (lseek(fat_fd, blocks_offset, SEEK_SET) == -1)
+            return FAT_BUFFER_ERROR;
+        if (write(fat_fd, &root_header, sizeof(DirHeader)) != sizeof(DirHeader))
+            return FAT_BUFFER_ERROR;
+    }
+
+    // Followed by its usage totals: the two headers and the DIR_END
+    if (features & FAT_FEATURE_DIR_USAGE) {
+        DirUsage root_usage = {0};
+        root_usage.size = 3 * sizeof(DirEntry);
+        root_usage.blocks = 1;
+        root_usage.parent_block = FAT_EOF;
+        root_usage.type = DIR_ENTRY_HEADER;
+
+        if (write(fat_fd, &root_usage, sizeof(DirUsage)) != sizeof(DirUsage))
+            return FAT_BUFFER_ERROR;
+    }
+
     // Close the FAT file
     close(fat_fd);
 
@@ -128,8 +189,9 @@ FatResult fat_open(FatFs **fs, char *fat_path) {
         return FAT_OPEN_ERROR;
     }
 
-    // If the magic is wrong
-    if (*(int *)fat_buffer != FAT_MAGIC) {
+    // If the magic is wrong or the features are unknown
+    unsigned int magic = *(unsigned int *)fat_buffer;
+    if ((magic & FAT_MAGIC_MASK) != FAT_MAGIC || (magic & ~FAT_MAGIC_MASK & ~FAT_FEATURES_ALL)) {
         munmap(fat_buffer, file_size);
         close(fd);
         return FAT_OPEN_ERROR;
@@ -144,6 +206,7 @@ FatResult fat_open(FatFs **fs, char *fat_path) {
     }
     (*fs)->buffer_fd = fd;
     (*fs)->buffer_size = file_size;
+    (*fs)->features = magic & ~FAT_MAGIC_MASK;
     (*fs)->header = (FatHeader *) fat_buffer;
     (*fs)->current_directory[0] = '/';
     (*fs)->current_directory[1] = '\0';
@@ -151,11 +214,60 @@ FatResult fat_open(FatFs **fs, char *fat_path) {
     int blocks_count = (*fs)->header->blocks_count;
 
     // The bitmap begins after the header
-    (*fs)->bitmap_ptr = fat_buffer + sizeof(FatHeader);
+    (*fs)->bitmap_ptr = (unsigned char *)fat_buffer + sizeof(FatHeader);
     // The FAT table begins after the bitmap
-    (*fs)->fat_ptr = (int*)((*fs)->bitmap_ptr + (blocks_count / 8));
+    (*fs)->fat_ptr = (*fs)->bitmap_ptr + (blocks_count / 8);
     // The blocks begin after the FAT
-    (*fs)->blocks_ptr = (char*)(*fs)->fat_ptr + (blocks_count * sizeof(int));
+    (*fs)->blocks_ptr = (char*)(*fs)->fat_ptr + (blocks_count * FAT_ENTRY_SIZE((*fs)->features));
+
+    // Remember the width of the FAT entries
+    (*fs)->fat16 = HAS_FEATURE(*fs, FAT_FEATURE_FAT16) != 0;
+
+    // Start looking for free blocks from the beginning
+    (*fs)->free_cursor = 0;
+
+    // Allocate from the bitmap until told otherwise
+    (*fs)->allocator = FAT_ALLOC_BITMAP;
+    (*fs)->free_extents = NULL;
+    (*fs)->free_extents_by_length = NULL;
+
+    // No delayed writes yet
+    (*fs)->reserved_blocks = 0;
+    (*fs)->delayed_files = NULL;
+    (*fs)->open_files = NULL;
+    (*fs)->open_dirs = NULL;
+    (*fs)->dir_changes = 0;
+
+    // Nothing was looked up yet
+    dir_cache_init(*fs);
+
+    // Summarize which bitmap words have free blocks
+    if (bitmap_build_summary(*fs) != OK) {
+        dir_cache_destroy(*fs);
+        munmap(fat_buffer, file_size);
+        close(fd);
+        free(*fs);
+        *fs = NULL;
+        return FAT_OPEN_ERROR;
+    }
+
+    return OK;
+}
+
+/**
+ * Places the blocks of every delayed write
+ * and saves the file system to its file
+ */
+FatResult fat_sync(FatFs *fs) {
+    // Flushing a file removes it from the list
+    while (fs->delayed_files) {
+        FatResult res = file_flush(fs->delayed_files);
+        if (res != OK)
+            return res;
+    }
+
+    if (msync(fs->header, fs->buffer_size, MS_SYNC) == -1)
+        return FAT_SYNC_ERROR;
 
     return OK;
 }
@@ -165,6 +277,29 @@ FatResult fat_open(FatFs **fs, char *fat_path) {
  * @author Cicim
  */
 FatResult fat_close(FatFs *fs) {
+    // Place the blocks of the files still open, returning the first error
+    FatResult flush_res = OK;
+    while (fs->delayed_files) {
+        FatResult res = file_flush(fs->delayed_files);
+        if (res != OK) {
+            if (flush_res == OK)
+                flush_res = res;
+            file_drop_pending(fs->delayed_files);
+        }
+    }
+
+    // The files still open can only be closed
+    while (fs->open_files) {
+        FileHandle *file = fs->open_files;
+        fs->open_files = file->next_open;
+        file->fs = NULL;
+    }
+    while (fs->open_dirs) {
+        DirHandle *dir = fs->open_dirs;
+        fs->open_dirs = dir->next_open;
+        dir->fs = NULL;
+    }
+
     // Unmap the file from memory
     int ret = munmap(fs->header, fs->buffer_size);
     if (ret == -1) {
@@ -178,7 +313,10 @@ FatResult fat_close(FatFs *fs) {
     }
 
     // Free the memory
+    extents_destroy(fs);
+    dir_cache_destroy(fs);
+    free(fs->bitmap_summary);
     free(fs);
     
-    return OK;
+    return flush_res;
 }
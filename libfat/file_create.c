@@ -10,34 +10,22 @@
 #include "internals.h"
 
 /**
- * Create a file inside a directory
- * @authors Cicim, Claziero
+ * Create a file with the given name in a directory
  */
-FatResult file_create(FatFs *fs, const char *path) {
-    FatResult res;
-
-    // Transform the path into an absolute path
-    char path_buffer[MAX_PATH_LENGTH];
-    char *dir_path, *name;
-    res = path_get_components(fs, path, path_buffer, &dir_path, &name);
-    if (res != OK)
-        return res;
-
-    // Get the block number of the parent directory
-    int parent_block;
-    res = dir_get_first_block(fs, dir_path, &parent_block);
-    if (res != OK)
-        return res;
-
+FatResult file_create_in(FatFs *fs, int parent_block, const char *name) {
     // Get an entry in the parent directory
     DirEntry *entry;
-    res = dir_insert(fs, parent_block, &entry, FAT_EOF, DIR_ENTRY_FILE, name);
+    FatResult res = dir_insert(fs, parent_block, &entry, FAT_EOF, DIR_ENTRY_FILE, name);
     if (res != OK)
         return res;
 
     // Fill the file header
     FileHeader *header = (FileHeader *)(fs->blocks_ptr + entry->first_block * fs->header->block_size);
     header->size = 0;
+
+    // Start the extent map with the header block
+    file_extents_init(fs, entry->first_block);
+    dir_usage_add_child(fs, parent_block, entry->first_block, DIR_ENTRY_FILE, 1);
     
     // Get the date
     time_t rawtime;
@@ -62,3 +50,36 @@ FatResult file_create(FatFs *fs, const char *path) {
 
     return OK;
 }
+
+/**
+ * Create a file, with relative paths starting from "base_block"
+ * (the current directory if FAT_EOF)
+ */
+static FatResult file_create_from(FatFs *fs, int base_block, const char *path) {
+    // Get the block number of the parent directory
+    char path_buffer[MAX_PATH_LENGTH];
+    char *name;
+    int parent_block;
+    FatResult res = path_get_parent(fs, base_block, path, path_buffer, &parent_block, &name);
+    if (res != OK)
+        return res;
+
+    return file_create_in(fs, parent_block, name);
+}
+
+/**
+ * Create a file inside a directory
+ * @authors Cicim, Claziero
+ */
+FatResult file_create(FatFs *fs, const char *path) {
+    return file_create_from(fs, FAT_EOF, path);
+}
+
+/**
+ * Create a file with a path relative to an open directory
+ */
+FatResult file_create_at(DirHandle *dir, const char *path) {
+    if (dir == NULL)
+        return INVALID_PATH;
+    return file_create_from(dir->fs, dir->first_block, path);
+}
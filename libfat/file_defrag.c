@@ -0,0 +1,131 @@
+/**
+ * File defragmentation function
+ */
+
+#include <string.h>
+#include "internals.h"
+
+/**
+ * Moves the blocks of a file or directory to a single run of contiguous blocks
+ * The new chain is complete before the entry is pointed to it,
+ * and the old blocks are freed only after that
+ * Returns how many blocks were moved (0 if they were already contiguous)
+ */
+FatResult file_defrag(FatFs *fs, const char *path, int *moved_blocks) {
+    FatResult res;
+    *moved_blocks = 0;
+
+    // Split "path" in directory and element name
+    char path_buffer[MAX_PATH_LENGTH];
+    char *dir_path, *name;
+    res = path_get_components(fs, path, path_buffer, &dir_path, &name);
+    if (res != OK)
+        return res;
+
+    // Find the entry in its directory
+    int dir_block;
+    res = dir_get_first_block(fs, dir_path, &dir_block);
+    if (res != OK)
+        return res;
+
+    DirEntry *entry;
+    DirHandle dir;
+    res = dir_get_entry(fs, dir_block, name, &entry, &dir);
+    if (res != OK)
+        return res;
+
+    // Count the blocks, checking if they are already contiguous
+    int num_blocks = 0, contiguous = 1;
+    for (int block = entry->first_block; block != FAT_EOF; block = fat_get_next_block(fs, block)) {
+        if (num_blocks > 0 && block != entry->first_block + num_blocks)
+            contiguous = 0;
+        num_blocks++;
+    }
+    if (contiguous)
+        return OK;
+
+    // Get a run long enough for all of them
+    if (num_blocks > FREE_BLOCKS(fs))
+        return NO_FREE_BLOCKS;
+
+    int first_block;
+    int run_length = bitmap_alloc_run(fs, -1, num_blocks, &first_block);
+    if (run_length < num_blocks) {
+        if (run_length > 0)
+            fat_unlink(fs, first_block);
+        return NO_FREE_BLOCKS;
+    }
+
+    // Copy the blocks in order, finding where the DIR_END of a directory goes
+    DirHeader *header = entry->type == DIR_ENTRY_DIRECTORY ? dir_get_header(fs, entry->first_block) : NULL;
+    int end_block = FAT_EOF;
+    int old_block = entry->first_block;
+    for (int i = 0; i < num_blocks; i++) {
+        memcpy(fs->blocks_ptr + (first_block + i) * fs->header->block_size,
+            fs->blocks_ptr + old_block * fs->header->block_size,
+            fs->header->block_size);
+        if (header != NULL && (header->flags & DIR_HEADER_TAIL) && old_block == header->end_block)
+            end_block = first_block + i;
+        old_block = fat_get_next_block(fs, old_block);
+    }
+
+    // Remember the space used by a directory alone, its index may change size
+    int own_size = 0, own_blocks = 0;
+    if (entry->type == DIR_ENTRY_DIRECTORY)
+        dir_usage_own(fs, entry->first_block, &own_size, &own_blocks);
+
+    // Point the entry to the new blocks
+    old_block = entry->first_block;
+    entry->first_block = first_block;
+    fs->dir_changes++;
+    dir_cache_invalidate(fs, dir_block, name);
+    if (entry->type == DIR_ENTRY_FILE) {
+        file_extents_rebuild(fs, first_block);
+        file_handles_move(fs, old_block, first_block);
+    }
+    else {
+        // The header and the index of a directory must point to the new blocks
+        header = dir_get_header(fs, first_block);
+        if (header != NULL && end_block != FAT_EOF) {
+            header->end_block = end_block;
+            header->end_prev_block = end_block == first_block ? FAT_EOF : end_block - 1;
+        }
+        else if (header != NULL)
+            header->flags &= ~DIR_HEADER_TAIL;
+        if (header != NULL && header->index_block != FAT_EOF && dir_index_build(fs, first_block) != OK)
+            dir_index_free(fs, first_block);
+        dir_handles_move(fs, old_block, first_block);
+
+        // And the cache must forget the old ones, and what it knew of the new ones
+        dir_cache_forget_dir(fs, old_block);
+        dir_cache_forget_dir(fs, first_block);
+
+        // The elements in the directory are now contained in the new blocks
+        if (dir_get_usage(fs, first_block) != NULL) {
+            DirEntry *child;
+            DirHandle child_dir;
+            child_dir.block_number = first_block;
+            child_dir.count = 0;
+            while (dir_handle_next(fs, &child_dir, &child) == OK) {
+                DirUsage *usage = child->type == DIR_ENTRY_DIRECTORY ? dir_get_usage(fs, child->first_block) : NULL;
+                if (usage != NULL)
+                    usage->parent_block = first_block;
+            }
+            for (FileHandle *file = fs->open_files; file != NULL; file = file->next_open)
+                if (file->dir_block == old_block)
+                    file->dir_block = first_block;
+
+            int size, blocks;
+            dir_usage_own(fs, first_block, &size, &blocks);
+            dir_usage_add(fs, first_block, size - own_size, blocks - own_blocks);
+        }
+    }
+
+    // Free the old blocks
+    res = fat_unlink(fs, old_block);
+    if (res != OK)
+        return res;
+
+    *moved_blocks = num_blocks;
+    return OK;
+}
@@ -7,23 +7,17 @@
 #include "internals.h"
 
 /**
- * Erases the file from the given path
- * Returns an error if path is invalid
- * @author Claziero
+ * Erases the file from the given path, with relative paths
+ * starting from "base_block" (the current directory if FAT_EOF)
  */
-FatResult file_erase(FatFs *fs, const char *path) {
+static FatResult file_erase_from(FatFs *fs, int base_block, const char *path) {
     FatResult res;
 
-    // Split "path" in directory and file name
+    // Split "path" in the directory and the file name
     char path_buffer[MAX_PATH_LENGTH];
-    char *dir_path, *name;
-    res = path_get_components(fs, path, path_buffer, &dir_path, &name);
-    if (res != OK)
-        return res;
-
-    // Open the directory
+    char *name;
     int dir_block;
-    res = dir_get_first_block(fs, dir_path, &dir_block);
+    res = path_get_parent(fs, base_block, path, path_buffer, &dir_block, &name);
     if (res != OK)
         return res;
 
@@ -32,6 +26,8 @@ FatResult file_erase(FatFs *fs, const char *path) {
     res = dir_delete(fs, dir_block, DIR_ENTRY_FILE, name, &child_block);
     if (res != OK)
         return res;
+    dir_usage_add_child(fs, dir_block, child_block, DIR_ENTRY_FILE, -1);
+    file_handles_detach(fs, child_block);
 
     // Unlink the file
     res = fat_unlink(fs, child_block);
@@ -40,3 +36,21 @@ FatResult file_erase(FatFs *fs, const char *path) {
 
     return OK;
 }
+
+/**
+ * Erases the file from the given path
+ * Returns an error if path is invalid
+ * @author Claziero
+ */
+FatResult file_erase(FatFs *fs, const char *path) {
+    return file_erase_from(fs, FAT_EOF, path);
+}
+
+/**
+ * Erases the file from a path relative to an open directory
+ */
+FatResult file_erase_at(DirHandle *dir, const char *path) {
+    if (dir == NULL)
+        return INVALID_PATH;
+    return file_erase_from(dir->fs, dir->first_block, path);
+}
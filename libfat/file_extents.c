@@ -0,0 +1,135 @@
+/**
+ * Extent maps of the files (FAT_FEATURE_EXTENTS)
+ */
+#include "internals.h"
+
+/**
+ * Starts the extent map of a new file, made of its first block only
+ */
+void file_extents_init(FatFs *fs, int first_block) {
+    if (!HAS_FEATURE(fs, FAT_FEATURE_EXTENTS))
+        return;
+
+    FileExtentMap *map = FILE_EXTENT_MAP(fs, first_block);
+    map->count = 1;
+    map->num_blocks = 1;
+    map->extents[0].file_block = 0;
+    map->extents[0].disk_block = first_block;
+    map->extents[0].length = 1;
+}
+
+/**
+ * Adds a run of blocks at the end of the extent map of a file
+ */
+void file_extents_append(FatFs *fs, int first_block, int disk_block, int length) {
+    if (!HAS_FEATURE(fs, FAT_FEATURE_EXTENTS))
+        return;
+
+    FileExtentMap *map = FILE_EXTENT_MAP(fs, first_block);
+    if (map->count == FILE_EXTENTS_OVERFLOW)
+        return;
+
+    // Grow the last extent if the run continues it
+    FileExtent *last = &map->extents[map->count - 1];
+    if (last->disk_block + last->length == disk_block)
+        last->length += length;
+    // Else the file must be read through the FAT from now on
+    else if (map->count == FILE_EXTENTS_MAX) {
+        map->count = FILE_EXTENTS_OVERFLOW;
+        return;
+    }
+    else {
+        last++;
+        last->file_block = map->num_blocks;
+        last->disk_block = disk_block;
+        last->length = length;
+        map->count++;
+    }
+
+    map->num_blocks += length;
+}
+
+/**
+ * Builds the extent map of a file from its FAT chain
+ */
+void file_extents_rebuild(FatFs *fs, int first_block) {
+    if (!HAS_FEATURE(fs, FAT_FEATURE_EXTENTS))
+        return;
+
+    file_extents_init(fs, first_block);
+
+    int block = fat_get_next_block(fs, first_block);
+    while (block != FAT_EOF && FILE_EXTENT_MAP(fs, first_block)->count != FILE_EXTENTS_OVERFLOW) {
+        file_extents_append(fs, first_block, block, 1);
+        block = fat_get_next_block(fs, block);
+    }
+}
+
+/**
+ * Drops the blocks after the first "num_blocks" from the extent map of a file
+ */
+void file_extents_truncate(FatFs *fs, int first_block, int num_blocks) {
+    if (!HAS_FEATURE(fs, FAT_FEATURE_EXTENTS))
+        return;
+
+    // The file may fit in the map again
+    FileExtentMap *map = FILE_EXTENT_MAP(fs, first_block);
+    if (map->count == FILE_EXTENTS_OVERFLOW) {
+        file_extents_rebuild(fs, first_block);
+        return;
+    }
+
+    // Drop the extents after the new end and cut the last one
+    while (map->extents[map->count - 1].file_block >= num_blocks)
+        map->count--;
+
+    FileExtent *last = &map->extents[map->count - 1];
+    last->length = MIN(last->length, num_blocks - last->file_block);
+    map->num_blocks = last->file_block + last->length;
+}
+
+/**
+ * Returns the number of blocks in the extent map of a file,
+ * or -1 if the FAT chain must be followed instead
+ */
+int file_extents_count_blocks(FatFs *fs, int first_block) {
+    if (!HAS_FEATURE(fs, FAT_FEATURE_EXTENTS))
+        return -1;
+
+    FileExtentMap *map = FILE_EXTENT_MAP(fs, first_block);
+    if (map->count == FILE_EXTENTS_OVERFLOW)
+        return -1;
+
+    return map->num_blocks;
+}
+
+/**
+ * Returns the block at position "index" in a file (FAT_EOF if there is none),
+ * looking it up in the extent map if possible
+ */
+int file_block_at(FatFs *fs, int first_block, int index) {
+    // Binary search the last extent starting before the block
+    if (file_extents_count_blocks(fs, first_block) != -1) {
+        FileExtentMap *map = FILE_EXTENT_MAP(fs, first_block);
+        if (index >= map->num_blocks)
+            return FAT_EOF;
+
+        int low = 0, high = map->count - 1;
+        while (low < high) {
+            int mid = (low + high + 1) / 2;
+            if (map->extents[mid].file_block <= index)
+                low = mid;
+            else
+                high = mid - 1;
+        }
+
+        FileExtent *extent = &map->extents[low];
+        return extent->disk_block + index - extent->file_block;
+    }
+
+    // Else follow the FAT chain
+    int block = first_block;
+    while (index-- > 0 && block != FAT_EOF)
+        block = fat_get_next_block(fs, block);
+    return block;
+}
@@ -26,19 +26,37 @@ FatResult file_open_by_block(FatFs *fs, int block_number, FileHandle **file) {
     (*file)->fs = fs;
     (*file)->initial_block_number = block_number;
     (*file)->current_block_number = block_number;
-    (*file)->block_offset = sizeof(FileHeader); // Offset initially pointing to the actual data
+    (*file)->block_offset = FILE_DATA_OFFSET(fs); // Offset initially pointing to the actual data
     (*file)->file_offset = 0;
     (*file)->fh = (FileHeader *) (fs->blocks_ptr + block_number * fs->header->block_size);
+    (*file)->detached = 0;
+
+    // Nothing is delayed yet
+    (*file)->delayed = 0;
+    (*file)->pending = NULL;
+    (*file)->pending_size = 0;
+    (*file)->pending_capacity = 0;
+    (*file)->reserved_blocks = 0;
+    (*file)->next_delayed = NULL;
+
+    // The block index is filled when needed
+    (*file)->block_index = NULL;
+    (*file)->block_index_count = 0;
+    (*file)->block_index_capacity = 0;
+
+    // The directory of the file is not known from its block
+    (*file)->dir_block = FAT_EOF;
+    (*file)->next_open = fs->open_files;
+    fs->open_files = *file;
 
     return OK;
 }
 
 /**
- * Creates a file handle given a path
- * Returns an error if "path" is invalid
- * @author Claziero
+ * Creates a file handle given a path, with relative paths
+ * starting from "base_block" (the current directory if FAT_EOF)
  */
-FatResult file_open(FatFs *fs, const char *path, FileHandle **file, char *mode) {
+static FatResult file_open_from(FatFs *fs, int base_block, const char *path, FileHandle **file, char *mode) {
     FatResult res;
 
     // Check if mode is valid
@@ -46,7 +64,7 @@ FatResult file_open(FatFs *fs, const char *path, FileHandle **file, char *mode)
         return FILE_OPEN_INVALID_ARGUMENT;
 
     // Get the file open mode
-    int can_read = 0, can_write = 0, create = 0, append = 0;
+    int can_read = 0, can_write = 0, create = 0, append = 0, delayed = 0;
     do {
         if (*mode == 'r')
             can_read = 1;
@@ -56,57 +74,44 @@ FatResult file_open(FatFs *fs, const char *path, FileHandle **file, char *mode)
             append = can_write = 1;
         else if (*mode == '+')
             create = 1;
+        else if (*mode == 'd')
+            delayed = 1;
         else
             return FILE_OPEN_INVALID_ARGUMENT;
     } while (*++mode);
 
-    // Split "path" in directory and file name
+    // Split "path" in the directory and the file name
     char path_buffer[MAX_PATH_LENGTH];
-    char *dir_path, *name;
-    res = path_get_components(fs, path, path_buffer, &dir_path, &name);
-    if (res != OK)
-        return res;
-
-    // Open the directory
+    char *name;
     int dir_block;
-    res = dir_get_first_block(fs, dir_path, &dir_block);
+    res = path_get_parent(fs, base_block, path, path_buffer, &dir_block, &name);
     if (res != OK)
         return res;
 
-    // Create the Directory Handle
-    DirHandle dir;
-    dir.block_number = dir_block;
-    dir.count = 0;
-
     // Look for the file in the directory
+    DirHandle dir;
     DirEntry *entry;
     int file_block;
-    while (1) {
-        res = dir_handle_next(fs, &dir, &entry);
-        
-        // If the file does not exist
-        if (res == END_OF_DIR) {
-            // If you don't want to create it, return an error
-            if (!create)
-                return FILE_NOT_FOUND;
-
-            // Else create it
-            res = file_create(fs, path);
-            if (res != OK)
-                return res;
-            break;
-        }
+    res = dir_get_entry(fs, dir_block, name, &entry, &dir);
 
-        // Else there's another error
-        else if (res != OK)
-            return res;
+    // If the file does not exist
+    if (res == FILE_NOT_FOUND) {
+        // If you don't want to create it, return an error
+        if (!create)
+            return FILE_NOT_FOUND;
 
-        if (strcmp(entry->name, name) == 0) {
-            if (entry->type != DIR_ENTRY_FILE)
-                return NOT_A_FILE;
-            break;
-        }            
+        // Else create it in the directory already found
+        res = file_create_in(fs, dir_block, name);
+        if (res != OK)
+            return res;
+        res = dir_get_entry(fs, dir_block, name, &entry, &dir);
     }
+    // Else there's another error
+    if (res != OK)
+        return res;
+
+    if (entry->type != DIR_ENTRY_FILE)
+        return NOT_A_FILE;
 
     // Save the file block number
     file_block = entry->first_block;
@@ -116,9 +121,13 @@ FatResult file_open(FatFs *fs, const char *path, FileHandle **file, char *mode)
     if (res != OK)
         return res;
 
+    // Its directory gets the changes to its size
+    (*file)->dir_block = dir_block;
+
     // Set the file mode
     (*file)->can_read = can_read;
     (*file)->can_write = can_write;
+    (*file)->delayed = delayed;
 
     // If the file is opened in append mode, seek to the end of the file
     if (append)
@@ -127,13 +136,165 @@ FatResult file_open(FatFs *fs, const char *path, FileHandle **file, char *mode)
     return OK;
 }
 
+/**
+ * Creates a file handle given a path
+ * Returns an error if "path" is invalid
+ * @author Claziero
+ */
+FatResult file_open(FatFs *fs, const char *path, FileHandle **file, char *mode) {
+    return file_open_from(fs, FAT_EOF, path, file, mode);
+}
+
+/**
+ * Creates a file handle given a path relative to an open directory
+ */
+FatResult file_open_at(DirHandle *dir, const char *path, FileHandle **file, char *mode) {
+    if (dir == NULL)
+        return FILE_OPEN_INVALID_ARGUMENT;
+    return file_open_from(dir->fs, dir->first_block, path, file, mode);
+}
+
 /**
  * Frees the memory occupied by a file handle
  * @author Claziero
  */
 FatResult file_close(FileHandle *file) {
+    if (file == NULL)
+        return OK;
+
+    // Place the blocks of the delayed writes, which are lost if they can't be
+    FatResult res = file_flush(file);
+    if (res != OK)
+        file_drop_pending(file);
+
+    // Forget about the file in the file system, unless it was closed first
+    if (file->fs != NULL) {
+        FileHandle **prev = &file->fs->open_files;
+        while (*prev != file)
+            prev = &(*prev)->next_open;
+        *prev = file->next_open;
+    }
+
+    free(file->pending);
+    free(file->block_index);
     free(file);
-    return OK;
+    return res;
+}
+
+/**
+ * Returns how many of the first "max_blocks" blocks of a file exist, and the last of them,
+ * remembering the blocks found in the block index of the handle
+ */
+int file_index_blocks(FileHandle *file, int max_blocks, int *last_block) {
+    FatFs *fs = file->fs;
+
+    // The extent map is already an index
+    int num_blocks = file_extents_count_blocks(fs, file->initial_block_number);
+    if (num_blocks != -1) {
+        num_blocks = MIN(num_blocks, max_blocks);
+        *last_block = file_block_at(fs, file->initial_block_number, num_blocks - 1);
+        return num_blocks;
+    }
+
+    // The blocks may be already known
+    if (max_blocks <= file->block_index_count) {
+        *last_block = file->block_index[max_blocks - 1];
+        return max_blocks;
+    }
+
+    // Make room for the blocks (without memory they are just not remembered)
+    if (max_blocks > file->block_index_capacity) {
+        int capacity = file->block_index_capacity ? file->block_index_capacity : FILE_INDEX_MIN;
+        while (capacity < MIN(max_blocks, (int)fs->header->blocks_count))
+            capacity *= 2;
+
+        int *block_index = realloc(file->block_index, capacity * sizeof(int));
+        if (block_index != NULL) {
+            file->block_index = block_index;
+            file->block_index_capacity = capacity;
+        }
+    }
+
+    // Start from the first block
+    if (file->block_index_count == 0 && file->block_index_capacity > 0)
+        file->block_index[file->block_index_count++] = file->initial_block_number;
+
+    // Continue from the last block known
+    int block = file->block_index_count ? file->block_index[file->block_index_count - 1] : file->initial_block_number;
+    num_blocks = file->block_index_count ? file->block_index_count : 1;
+
+    while (num_blocks < max_blocks && fat_get_next_block(fs, block) != FAT_EOF) {
+        block = fat_get_next_block(fs, block);
+        if (num_blocks == file->block_index_count && num_blocks < file->block_index_capacity)
+            file->block_index[file->block_index_count++] = block;
+        num_blocks++;
+    }
+
+    *last_block = block;
+    return num_blocks;
+}
+
+/**
+ * Forgets the blocks of the file after the first "num_blocks"
+ */
+void file_index_truncate(FileHandle *file, int num_blocks) {
+    file->block_index_count = MIN(file->block_index_count, num_blocks);
+}
+
+/**
+ * Makes every open handle of a file forget its blocks after the first "num_blocks",
+ * when the chain of the file is cut there
+ */
+void file_handles_truncate(FatFs *fs, int file_block, int num_blocks) {
+    for (FileHandle *file = fs->open_files; file != NULL; file = file->next_open)
+        if (file->initial_block_number == file_block)
+            file_index_truncate(file, num_blocks);
+}
+
+/**
+ * Detaches the open handles of a file that is being erased,
+ * discarding their delayed writes since the blocks will be freed
+ */
+void file_handles_detach(FatFs *fs, int file_block) {
+    for (FileHandle *file = fs->open_files; file != NULL; file = file->next_open)
+        if (file->initial_block_number == file_block) {
+            file_drop_pending(file);
+            file_index_truncate(file, 0);
+            file->dir_block = FAT_EOF;
+            file->detached = 1;
+        }
+}
+
+/**
+ * Moves the open handles of a file to its copy in the contiguous run
+ * from "new_block", at the same position (the old chain must still be linked)
+ */
+void file_handles_move(FatFs *fs, int old_block, int new_block) {
+    for (FileHandle *file = fs->open_files; file != NULL; file = file->next_open) {
+        if (file->initial_block_number != old_block)
+            continue;
+
+        // Find the position of the current block in the old chain
+        int position = 0;
+        for (int block = old_block; block != FAT_EOF && block != file->current_block_number;
+             block = fat_get_next_block(fs, block))
+            position++;
+
+        file->initial_block_number = new_block;
+        file->current_block_number = new_block + position;
+        file->fh = (FileHeader *)(fs->blocks_ptr + new_block * fs->header->block_size);
+        file_index_truncate(file, 0);
+    }
+}
+
+/**
+ * Tells the open handles of a file in which directory it is now
+ * (FAT_EOF if it is in none)
+ */
+void file_handles_set_dir(FatFs *fs, int file_block, int dir_block) {
+    for (FileHandle *file = fs->open_files; file != NULL; file = file->next_open)
+        if (file->initial_block_number == file_block)
+            file->dir_block = dir_block;
 }
 
 /** 
@@ -117,72 +117,174 @@ FatResult path_get_data(FatFs *fs, const char *source_path, const char *dest_pat
 }
 
 /**
- * Copy the file and directory structures
- * @author Cicim
+ * Copies the chain of blocks of a file or directory into runs of contiguous blocks,
+ * placing the copy close to "goal_block" if possible
  */
-FatResult file_copy_recursive(FatFs *fs, int src_block, int src_type, int *copy_block) {
-    FatResult res;
+static FatResult file_copy_chain(FatFs *fs, int src_block, int goal_block, int *copy_block) {
+    // Count the blocks in the source chain
+    int num_blocks = 0;
+    for (int block = src_block; block != FAT_EOF; block = fat_get_next_block(fs, block))
+        num_blocks++;
+    if (num_blocks > FREE_BLOCKS(fs))
+        return NO_FREE_BLOCKS;
 
-    // For all blocks in the source file
+    // Copy the chain into runs of contiguous blocks
     int curr_src_block = src_block;
-    int curr_new_block = bitmap_get_free_block(fs);
-    *copy_block = curr_new_block;
+    int last_new_block = FAT_EOF;
+    while (num_blocks > 0) {
+        // Continue the copy right after the previous run if possible
+        if (last_new_block != FAT_EOF)
+            goal_block = last_new_block + 1;
+
+        int first_block;
+        int run_length = bitmap_alloc_run(fs, goal_block, num_blocks, &first_block);
+        if (run_length == 0) {
+            // Free the part already copied
+            if (last_new_block != FAT_EOF)
+                fat_unlink(fs, *copy_block);
+            return NO_FREE_BLOCKS;
+        }
 
-    do {
-        // Copy the block with memcpy
-        char *src_block_data = fs->blocks_ptr + curr_src_block * fs->header->block_size;
-        char *new_block_data = fs->blocks_ptr + curr_new_block * fs->header->block_size;
-        memcpy(new_block_data, src_block_data, fs->header->block_size);
-        bitmap_set(fs, curr_new_block, 1);
+        // Link the run after the previous one
+        if (last_new_block == FAT_EOF)
+            *copy_block = first_block;
+        else
+            fat_set_next_block(fs, last_new_block, first_block);
 
-        if (curr_src_block == EOF)
-            break;
+        // Copy the blocks with memcpy
+        for (int i = 0; i < run_length; i++) {
+            char *src_block_data = fs->blocks_ptr + curr_src_block * fs->header->block_size;
+            char *new_block_data = fs->blocks_ptr + (first_block + i) * fs->header->block_size;
+            memcpy(new_block_data, src_block_data, fs->header->block_size);
 
-        // If this bcurr_src_block == FAT_EOFlock is EOF, stop
-        curr_src_block = fat_get_next_block(fs, curr_src_block);
+            curr_src_block = fat_get_next_block(fs, curr_src_block);
+        }
 
+        last_new_block = first_block + run_length - 1;
+        num_blocks -= run_length;
+    }
+
+    return OK;
+}
+
+/**
+ * Frees the copies of the entries of the directories still being copied,
+ * and the directories themselves: in each one only the first "count" entries
+ * were copied, the last of them being the directory in the frame above
+ */
+static void file_copy_undo(FatFs *fs, DirWalk *walk) {
+    for (int depth = walk->depth - 1; depth >= 0; depth--) {
+        DirWalkFrame *frame = &walk->frames[depth];
+        int copied = depth == walk->depth - 1 ? frame->count : frame->count - 1;
+
+        DirEntry *entry;
+        DirHandle dir;
+        dir.block_number = frame->dir_block;
+        dir.count = 0;
+        for (int i = 0; i < copied && dir_handle_next(fs, &dir, &entry) == OK; i++) {
+            if (entry->type == DIR_ENTRY_DIRECTORY)
+                dir_empty(fs, entry->first_block);
+            fat_unlink(fs, entry->first_block);
+        }
 
-        // Else, get a new block
-        int next_new_block = bitmap_get_free_block(fs);
-        // Connect the two
-        fat_set_next_block(fs, curr_new_block, next_new_block);
-        // Update the current block
-        curr_new_block = next_new_block;
-    } while (curr_src_block != EOF);
+        fat_unlink(fs, frame->dir_block);
+    }
+}
 
+/**
+ * Copy the file and directory structures,
+ * placing the copy close to "goal_block" if possible
+ * The directories are copied without recursion, and nothing
+ * is left allocated if the copy can't be completed
+ * @author Cicim
+ */
+FatResult file_copy_recursive(FatFs *fs, int src_block, int src_type, int goal_block, int *copy_block) {
+    FatResult res = file_copy_chain(fs, src_block, goal_block, copy_block);
+    if (res != OK)
+        return res;
 
-    if (src_type != DIR_ENTRY_DIRECTORY)
+    // The extent map of a file must point to the new blocks
+    if (src_type != DIR_ENTRY_DIRECTORY) {
+        file_extents_rebuild(fs, *copy_block);
         return OK;
+    }
 
     // If the source is a directory, copy the various files inside of the directory
-    // Loop over the two directories
-    DirHandle new_dir_handle;
-    new_dir_handle.block_number = *copy_block;
-    new_dir_handle.count = 0;
-    DirEntry *new_entry;
+    DirWalk walk = {0};
+    res = dir_walk_push(&walk, *copy_block);
+    if (res != OK) {
+        fat_unlink(fs, *copy_block);
+        return res;
+    }
 
-    while (1) {
-        // Get the next entry in the source directory
-        res = dir_handle_next(fs, &new_dir_handle, &new_entry);
-        if (res == END_OF_DIR)
-            break;
+    int new_dir_block = *copy_block;
+    while (walk.depth > 0) {
+        // Start the copy of a directory
+        if (new_dir_block != FAT_EOF) {
+            // The cache may know about a directory that used the same blocks
+            dir_cache_forget_dir(fs, new_dir_block);
+
+            // And the header of the copy must not point to the blocks of the source
+            DirHeader *header = dir_get_header(fs, new_dir_block);
+            if (header != NULL) {
+                header->flags &= ~DIR_HEADER_TAIL;
+                DIR_WALK_TOP(&walk)->flags = header->index_block != FAT_EOF;
+                header->index_block = FAT_EOF;
+            }
+
+            // A copied directory is contained in the copy
+            DirUsage *usage = walk.depth > 1 ? dir_get_usage(fs, new_dir_block) : NULL;
+            if (usage != NULL)
+                usage->parent_block = walk.frames[walk.depth - 2].dir_block;
+            new_dir_block = FAT_EOF;
+        }
+
+        // Get the next entry in the directory
+        DirWalkFrame *frame = DIR_WALK_TOP(&walk);
+        DirEntry *new_entry;
+        res = dir_handle_next(fs, &frame->dir, &new_entry);
+        if (res == END_OF_DIR) {
+            // The copy needs an index of its own
+            if (frame->flags)
+                dir_index_build(fs, frame->dir_block);
+
+            // Which may not be as big as the one of the source
+            dir_usage_sum(fs, frame->dir_block);
+
+            walk.depth--;
+            res = OK;
+            continue;
+        }
         else if (res != OK)
-            return res;
+            break;
 
-        // Get the entry source block and type
-        int src_entry_block = new_entry->first_block;
-        int src_entry_type = new_entry->type;
-        // Copy it recursively
+        // Copy it close to this directory
         int new_entry_block;
-        res = file_copy_recursive(fs, src_entry_block, src_entry_type, &new_entry_block);
+        res = file_copy_chain(fs, new_entry->first_block, frame->dir.block_number, &new_entry_block);
         if (res != OK)
-            return res;
+            break;
+
+        // A directory is copied before going on with this one
+        if (new_entry->type == DIR_ENTRY_DIRECTORY) {
+            res = dir_walk_push(&walk, new_entry_block);
+            if (res != OK) {
+                fat_unlink(fs, new_entry_block);
+                break;
+            }
+            new_dir_block = new_entry_block;
+        }
+        else
+            file_extents_rebuild(fs, new_entry_block);
 
         // Copy the new block to this entry
         new_entry->first_block = new_entry_block;
+        walk.frames[walk.depth - (new_dir_block != FAT_EOF ? 2 : 1)].count++;
     }
 
-    return OK;
+    if (res != OK)
+        file_copy_undo(fs, &walk);
+    dir_walk_free(&walk);
+    return res;
 }
 
 
@@ -202,9 +304,19 @@ FatResult file_move(FatFs *fs, const char *source_path, const char *dest_path) {
     res = dir_insert(fs, data.destination_block, &new_entry, data.src_block, data.src_type, data.destination_name);
     if (res != OK)
         return res;
+    dir_usage_add_child(fs, data.destination_block, data.src_block, data.src_type, 1);
 
     // Delete the entry from the source directory
-    return dir_delete(fs, data.src_dir_block, -1, data.source_name, NULL);
+    res = dir_delete(fs, data.src_dir_block, -1, data.source_name, NULL);
+    if (res != OK)
+        return res;
+    dir_usage_add_child(fs, data.src_dir_block, data.src_block, data.src_type, -1);
+
+    // The open handles of a file must update its new directory
+    if (data.src_type == DIR_ENTRY_FILE)
+        file_handles_set_dir(fs, data.src_block, data.destination_block);
+
+    return OK;
 }
 
 /**
@@ -226,16 +338,33 @@ FatResult file_copy(FatFs *fs, const char *source_path, const char *dest_path) {
         return res;
 
     // Exit if it is too big
-    if (src_block_size + 1 > fs->header->free_blocks)
+    if (src_block_size + 1 > FREE_BLOCKS(fs))
         return NO_FREE_BLOCKS;
 
+    // Don't copy anything if the name is already used
+    DirEntry *new_entry;
+    DirHandle dest_dir;
+    res = dir_get_entry(fs, data.destination_block, data.destination_name, &new_entry, &dest_dir);
+    if (res == OK)
+        return FILE_ALREADY_EXISTS;
+    else if (res != FILE_NOT_FOUND)
+        return res;
+
     // Copy the source block to the destination block folder and give it the destination_name
     int new_block;
-    res = file_copy_recursive(fs, data.src_block, data.src_type, &new_block);
+    res = file_copy_recursive(fs, data.src_block, data.src_type, data.destination_block, &new_block);
     if (res != OK)
         return res;
 
-    // Add an entry to the destination directory
-    DirEntry *new_entry;
-    return dir_insert(fs, data.destination_block, &new_entry, new_block, data.src_type, data.destination_name);
+    // Add an entry to the destination directory, or free the copy
+    res = dir_insert(fs, data.destination_block, &new_entry, new_block, data.src_type, data.destination_name);
+    if (res != OK) {
+        if (data.src_type == DIR_ENTRY_DIRECTORY)
+            dir_empty(fs, new_block);
+        fat_unlink(fs, new_block);
+        return res;
+    }
+    dir_usage_add_child(fs, data.destination_block, new_block, data.src_type, 1);
+
+    return OK;
 }
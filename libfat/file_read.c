@@ -7,7 +7,6 @@
 #include <string.h>
 #include "internals.h"
 
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 /**
  * Reads data from file into a buffer
@@ -19,6 +18,11 @@ int file_read(FileHandle *file, char *buffer, int size) {
     if (file == NULL)
         return -1;
 
+    // Place the delayed writes to read them
+    FatResult res = file_flush(file);
+    if (res != OK)
+        return res;
+
     // Check if size exceeds the file size from the current offset
     if (file->file_offset + size >= file->fh->size)
         size = file->fh->size - file->file_offset;
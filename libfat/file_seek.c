@@ -19,84 +19,49 @@ FatResult file_seek(FileHandle *file, int offset, int whence) {
     // Check if "offset" parameter is valid
     if (offset < 0)
         return SEEK_INVALID_ARGUMENT;
+
+    // Place the delayed writes before moving around the file
+    FatResult res = file_flush(file);
+    if (res != OK)
+        return res;
     
-    int num_blocks, last_offset;
-    
-    // Switch on "whence" parameter
+    // Switch on "whence" parameter to get the new offset
+    int new_offset;
     switch (whence) {
         case FILE_SEEK_SET:
-            if (offset > file->fh->size)
-                return SEEK_INVALID_ARGUMENT;
-
-            // Calculate the number of blocks to move starting from the first
-            num_blocks = (offset + sizeof(FileHeader)) / file->fs->header->block_size;
-
-            // Calculate the offset in the last block
-            last_offset = (offset + sizeof(FileHeader)) % file->fs->header->block_size;
-
-            // Move the file current block to the last block calculated
-            file->current_block_number = file->initial_block_number;
-            if (file->file_offset == file->fh->size && file->block_offset == 0)
-                num_blocks--;
-            while (num_blocks-- > 0)
-                file->current_block_number = fat_get_next_block(file->fs, file->current_block_number);
-
-            // Set the file offset to the last offset calculated
-            file->block_offset = last_offset;  
-            file->file_offset = offset;
+            new_offset = offset;
             break;
 
         case FILE_SEEK_CUR:
-            if (file->file_offset + offset > file->fh->size)
-                return SEEK_INVALID_ARGUMENT;
-
-            // Calculate the number of blocks to move starting from the current block
-            num_blocks = (file->block_offset + offset) / file->fs->header->block_size;
-
-            // Calculate the offset in the last block
-            last_offset = (file->block_offset + offset) % file->fs->header->block_size;
-
-            // Move the file current block to the last block calculated
-            if (file->file_offset == file->fh->size && file->block_offset == 0)
-                num_blocks--;
-            while (num_blocks-- > 0)
-                file->current_block_number = fat_get_next_block(file->fs, file->current_block_number);
-
-            // Set the file offset to the last offset calculated
-            file->block_offset = last_offset;
-            file->file_offset += offset;
+            new_offset = file->file_offset + offset;
             break;
 
-        case FILE_SEEK_END:            
-            if (file->fh->size - offset < 0)
-                return SEEK_INVALID_ARGUMENT;
-
-            // Calculate the number of blocks to move starting from the first
-            num_blocks = (file->fh->size + sizeof(FileHeader) - offset) / file->fs->header->block_size;
-
-            // Calculate the offset in the last block
-            last_offset = (file->fh->size - offset + sizeof(FileHeader)) % file->fs->header->block_size;
-
-            // Move the file current block to the last block calculated
-            file->current_block_number = file->initial_block_number;
-
-            if (offset == 0 && last_offset == 0)
-                num_blocks--;
-            while (num_blocks-- > 0)
-                file->current_block_number = fat_get_next_block(file->fs, file->current_block_number);
-
-            // Set the file offset to the last offset calculated
-            file->block_offset = last_offset;
-            file->file_offset = file->fh->size - offset;
+        case FILE_SEEK_END:
+            new_offset = file->fh->size - offset;
             break;
 
         default:
             return SEEK_INVALID_ARGUMENT;
     }
 
+    if (new_offset < 0 || new_offset > file->fh->size)
+        return SEEK_INVALID_ARGUMENT;
+
+    // Calculate the block of the new offset and the offset in it
+    int data_offset = new_offset + FILE_DATA_OFFSET(file->fs);
+    int block_index = data_offset / file->fs->header->block_size;
+    int last_offset = data_offset % file->fs->header->block_size;
+
     // If you reached the end of the file and it coincides with the end of a block
-    if (file->file_offset == file->fh->size && file->block_offset == 0)
-        file->block_offset = file->fs->header->block_size;        
+    if (new_offset == file->fh->size && last_offset == 0) {
+        block_index--;
+        last_offset = file->fs->header->block_size;
+    }
+
+    // Move the file current block to the block calculated
+    file_index_blocks(file, block_index + 1, &file->current_block_number);
+    file->block_offset = last_offset;
+    file->file_offset = new_offset;
 
     return OK;
 }
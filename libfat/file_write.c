@@ -8,111 +8,114 @@
 #include <time.h>
 #include "internals.h"
 
+// Number of blocks holding the header and "size" bytes of data
 #define NUM_BLOCKS_BY_SIZE(size) \
-    (sizeof(FileHeader) + size) / file->fs->header->block_size;
-#define OFFSET_BY_SIZE(size) \
-    (sizeof(FileHeader) + size) % file->fs->header->block_size;
-#define MIN(a, b) ((a) < (b) ? (a) : (b))
+    CEIL(FILE_DATA_OFFSET(file->fs) + (size), file->fs->header->block_size)
+
+/**
+ * Links "num_blocks" new blocks after the last block of the file,
+ * in runs as long as possible
+ */
+static FatResult file_add_blocks(FileHandle *file, int last_block, int num_blocks) {
+    if (num_blocks > FREE_BLOCKS(file->fs))
+        return NO_FREE_BLOCKS;
+
+    // Continue the file if possible
+    while (num_blocks > 0) {
+        int first_block;
+        int run_length = bitmap_alloc_run(file->fs, last_block + 1, num_blocks, &first_block);
+        if (run_length == 0)
+            return NO_FREE_BLOCKS;
+
+        // Link the run after the last block
+        fat_set_next_block(file->fs, last_block, first_block);
+        file_extents_append(file->fs, file->initial_block_number, first_block, run_length);
+
+        last_block = first_block + run_length - 1;
+        num_blocks -= run_length;
+    }
+
+    return OK;
+}
 
 /**
  * Function for changing file dimension
  * @author Claziero
  */
 FatResult change_file_dimension(FileHandle *file, int size) {
-    FatResult res;    
-    int old_num_blocks = NUM_BLOCKS_BY_SIZE(file->fh->size);
+    FatResult res;
     int new_num_blocks = NUM_BLOCKS_BY_SIZE(size);
-    int offset = OFFSET_BY_SIZE(size);
-
-    // If the old offset is 0 then the old block number is old_num_blocks - 1
-    int old_offset = OFFSET_BY_SIZE(file->fh->size);
-    if (old_offset == 0)
-        old_num_blocks--;
-
-    // If "offset" is 0 then the last block will be full
-    // and we don't need to add another block
-    if (new_num_blocks > 0 && offset == 0)
-        new_num_blocks--;
-
-    // If the file is too big, truncate it
-    if (new_num_blocks < old_num_blocks) {
-        int next = file->initial_block_number;
-
-        // Go to the last useful block
-        while (new_num_blocks--) {
-            // Get the next block
-            int next = fat_get_next_block(file->fs, next);
-            
-            // If the next block is unlinked, then we need to extend the file
-            if (next == FAT_EOF) {
-                // Get a new block
-                int new_block = bitmap_get_free_block(file->fs);
-                if (new_block == -1)
-                    return NO_FREE_BLOCKS;
-
-                // Set the new block as the next block
-                bitmap_set(file->fs, new_block, 1);
-                fat_set_next_block(file->fs, new_block, FAT_EOF);
-                fat_set_next_block(file->fs, next, new_block);
-                next = new_block;
-            }
-        }
 
-        // Unlink the rest of the blocks if necessary
-        res = fat_unlink(file->fs, next);
+    // Use the blocks already linked (some may be preallocated)
+    int last_block;
+    int num_blocks = file_index_blocks(file, new_num_blocks, &last_block);
+
+    // Extend the file if necessary
+    if (num_blocks < new_num_blocks) {
+        res = file_add_blocks(file, last_block, new_num_blocks - num_blocks);
         if (res != OK)
             return res;
     }
-    // Extend the file if necessary
-    else if (new_num_blocks > old_num_blocks) {
-        // Go to the last block
-        int block = file->initial_block_number;
-        while (fat_get_next_block(file->fs, block) != FAT_EOF)
-            block = fat_get_next_block(file->fs, block);
-
-        // Get the number of blocks to add
-        int num_blocks_to_add = new_num_blocks - old_num_blocks;
-        while (num_blocks_to_add--) {
-            // Get a new block
-            int new_block = bitmap_get_free_block(file->fs);
-            if (new_block == -1)
-                return NO_FREE_BLOCKS;
-
-            // Set the new block as the next block
-            bitmap_set(file->fs, new_block, 1);
-
-            // Set the new block as the next block of the last block
-            fat_set_next_block(file->fs, block, new_block);
-            fat_set_next_block(file->fs, new_block, FAT_EOF);
-
-            block = new_block;
-        }
+    // If the file is too big, unlink the rest of the blocks
+    else if (size < file->fh->size && fat_get_next_block(file->fs, last_block) != FAT_EOF) {
+        int next = fat_get_next_block(file->fs, last_block);
+        fat_set_next_block(file->fs, last_block, FAT_EOF);
+        file_extents_truncate(file->fs, file->initial_block_number, new_num_blocks);
+        file_handles_truncate(file->fs, file->initial_block_number, new_num_blocks);
+
+        res = fat_unlink(file->fs, next);
+        if (res != OK)
+            return res;
     }
 
+    // The directories containing the file use more or less space
+    if (file->dir_block != FAT_EOF)
+        dir_usage_add(file->fs, file->dir_block, size - file->fh->size,
+            NUM_BLOCKS_BY_SIZE(size) - NUM_BLOCKS_BY_SIZE(file->fh->size));
+    else if (size != file->fh->size)
+        dir_usage_invalidate(file->fs);
+
     file->fh->size = size;
     return OK;
 }
 
 /**
- * Writes data from a buffer into file
- * Returns a FatResult or the number of written bytes
- * @author Claziero
+ * Links the blocks for the bytes from "offset" to "offset + len" to the file,
+ * without changing its size
  */
-int file_write(FileHandle *file, const char *data, int size) {
-    // Check if size is valid
-    if (size <= 0)
-        return WRITE_INVALID_ARGUMENT;
-
-    // Check if file is valid
-    if (file == NULL)
-        return WRITE_INVALID_ARGUMENT;
+FatResult file_fallocate(FileHandle *file, int offset, int len) {
+    // Check the arguments
+    if (file == NULL || offset < 0 || len <= 0)
+        return FALLOCATE_INVALID_ARGUMENT;
 
     // Check if file is opened for writing
     if (!file->can_write)
-        return WRITE_INVALID_ARGUMENT;
+        return FALLOCATE_INVALID_ARGUMENT;
+    if (file->detached)
+        return FILE_ERASED;
 
-    FatResult res;
-    res = change_file_dimension(file, file->file_offset + size);
+    // The delayed writes go before the preallocated blocks
+    FatResult res = file_flush(file);
+    if (res != OK)
+        return res;
+
+    // Add the blocks missing after the last one
+    int last_block;
+    int new_num_blocks = NUM_BLOCKS_BY_SIZE(offset + len);
+    int num_blocks = file_index_blocks(file, new_num_blocks, &last_block);
+    if (num_blocks == new_num_blocks)
+        return OK;
+
+    return file_add_blocks(file, last_block, new_num_blocks - num_blocks);
+}
+
+/**
+ * Writes data into the blocks of the file, allocating them if needed
+ * Returns a FatResult or the number of written bytes
+ */
+static int file_write_blocks(FileHandle *file, const char *data, int size) {
+    // The file ends where the data written ends
+    FatResult res = change_file_dimension(file, file->file_offset + size);
     if (res != OK)
         return res;
 
@@ -136,14 +139,14 @@ int file_write(FileHandle *file, const char *data, int size) {
         // Update the written size
         written_size += size_to_write;
 
-        // Change the block
-        if (fat_get_next_block(file->fs, file->current_block_number) != FAT_EOF) {
+        // Change the block if this one is full
+        file->block_offset += size_to_write;
+        if (file->block_offset == file->fs->header->block_size
+            && fat_get_next_block(file->fs, file->current_block_number) != FAT_EOF) {
             file->current_block_number = fat_get_next_block(file->fs, file->current_block_number);
             file->block_offset = 0;
         }
-        else 
-            file->block_offset += size_to_write;
-        
+
     }
     file->file_offset += written_size;
 
@@ -162,3 +165,147 @@ int file_write(FileHandle *file, const char *data, int size) {
 
     return written_size;
 }
+
+/**
+ * Appends data to the pending buffer of the file,
+ * only reserving the blocks needed to store it
+ * Returns a FatResult or the number of written bytes
+ */
+static int file_write_delayed(FileHandle *file, const char *data, int size) {
+    FatFs *fs = file->fs;
+    int block_size = fs->header->block_size;
+
+    // Reserve the blocks needed after the last one of the file
+    int file_blocks = NUM_BLOCKS_BY_SIZE(file->fh->size);
+    int new_blocks = NUM_BLOCKS_BY_SIZE(file->fh->size + file->pending_size + size);
+    int to_reserve = new_blocks - file_blocks - file->reserved_blocks;
+    if (to_reserve > FREE_BLOCKS(fs))
+        return NO_FREE_BLOCKS;
+
+    // Make room in the pending buffer
+    if (file->pending_size + size > file->pending_capacity) {
+        int capacity = file->pending_capacity ? file->pending_capacity : block_size;
+        while (capacity < file->pending_size + size)
+            capacity *= 2;
+
+        // Without memory, write everything right away
+        char *pending = realloc(file->pending, capacity);
+        if (pending == NULL) {
+            FatResult res = file_flush(file);
+            if (res != OK)
+                return res;
+            return file_write_blocks(file, data, size);
+        }
+        file->pending = pending;
+        file->pending_capacity = capacity;
+    }
+
+    // Remember to place the blocks of the file
+    if (file->pending_size == 0) {
+        file->next_delayed = fs->delayed_files;
+        fs->delayed_files = file;
+    }
+
+    memcpy(file->pending + file->pending_size, data, size);
+    file->pending_size += size;
+    file->file_offset += size;
+
+    file->reserved_blocks += to_reserve;
+    fs->reserved_blocks += to_reserve;
+
+    return size;
+}
+
+/**
+ * Removes a file handle from the delayed writes of the file system
+ */
+static void file_unlink_delayed(FileHandle *file) {
+    FileHandle **prev = &file->fs->delayed_files;
+    while (*prev != file)
+        prev = &(*prev)->next_delayed;
+    *prev = file->next_delayed;
+}
+
+/**
+ * Places the blocks of the delayed writes of a file handle,
+ * all at once right after the end of the file
+ * If they can't be placed, the data is kept to try again
+ */
+FatResult file_flush(FileHandle *file) {
+    if (file == NULL)
+        return WRITE_INVALID_ARGUMENT;
+    if (file->pending_size == 0)
+        return OK;
+    if (file->detached)
+        return FILE_ERASED;
+
+    // The reserved blocks are allocated now
+    int reserved_blocks = file->reserved_blocks;
+    file->fs->reserved_blocks -= reserved_blocks;
+    file->reserved_blocks = 0;
+
+    // Write the data from the end of the file
+    int size = file->pending_size;
+    file->pending_size = 0;
+    file->file_offset -= size;
+
+    int res = file_write_blocks(file, file->pending, size);
+    if (res < 0) {
+        // Keep the data and its blocks reserved
+        file->pending_size = size;
+        file->file_offset += size;
+        file->reserved_blocks = reserved_blocks;
+        file->fs->reserved_blocks += reserved_blocks;
+        return res;
+    }
+
+    // Forget about the file in the file system
+    file_unlink_delayed(file);
+    return OK;
+}
+
+/**
+ * Discards the delayed writes of a file handle that could not be placed
+ */
+void file_drop_pending(FileHandle *file) {
+    if (file->pending_size == 0)
+        return;
+
+    file_unlink_delayed(file);
+    file->fs->reserved_blocks -= file->reserved_blocks;
+    file->reserved_blocks = 0;
+    file->file_offset -= file->pending_size;
+    file->pending_size = 0;
+}
+
+/**
+ * Writes data from a buffer into file
+ * Returns a FatResult or the number of written bytes
+ * @author Claziero
+ */
+int file_write(FileHandle *file, const char *data, int size) {
+    // Check if size is valid
+    if (size <= 0)
+        return WRITE_INVALID_ARGUMENT;
+
+    // Check if file is valid
+    if (file == NULL)
+        return WRITE_INVALID_ARGUMENT;
+
+    // Check if file is opened for writing
+    if (!file->can_write)
+        return WRITE_INVALID_ARGUMENT;
+    if (file->detached)
+        return FILE_ERASED;
+
+    // Only keep appended data when delaying the allocation
+    if (file->delayed && file->file_offset == file->fh->size + file->pending_size)
+        return file_write_delayed(file, data, size);
+
+    // Else the pending data goes first
+    FatResult res = file_flush(file);
+    if (res != OK)
+        return res;
+
+    return file_write_blocks(file, data, size);
+}
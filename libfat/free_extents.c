@@ -0,0 +1,356 @@
+/**
+ * Free-extent index used as an alternative block allocator
+ */
+#include <stdlib.h>
+#include "internals.h"
+
+/**
+ * Every free extent is a node of two treaps sharing the same priority:
+ * one ordered by start block (keeping the longest extent of each subtree)
+ * and one ordered by length, then by start block
+ */
+typedef struct FreeExtent {
+    int start;
+    int length;
+    int max_length;
+    unsigned int priority;
+
+    struct FreeExtent *start_left, *start_right;
+    struct FreeExtent *length_left, *length_right;
+} FreeExtent;
+
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#define MAX_LENGTH(node) ((node) ? (node)->max_length : 0)
+
+/**
+ * Start-ordered treap
+ */
+// Recomputes the longest extent in the subtree
+static void start_update(FreeExtent *node) {
+    node->max_length = MAX(node->length, MAX(MAX_LENGTH(node->start_left), MAX_LENGTH(node->start_right)));
+}
+
+// Splits the tree in the extents starting before "start" and the others
+static void start_split(FreeExtent *tree, int start, FreeExtent **left, FreeExtent **right) {
+    if (tree == NULL) {
+        *left = *right = NULL;
+        return;
+    }
+
+    if (tree->start < start) {
+        start_split(tree->start_right, start, &tree->start_right, right);
+        *left = tree;
+    } else {
+        start_split(tree->start_left, start, left, &tree->start_left);
+        *right = tree;
+    }
+    start_update(tree);
+}
+
+// Joins two trees, every extent in "left" starting before those in "right"
+static FreeExtent *start_merge(FreeExtent *left, FreeExtent *right) {
+    if (left == NULL)
+        return right;
+    if (right == NULL)
+        return left;
+
+    if (left->priority > right->priority) {
+        left->start_right = start_merge(left->start_right, right);
+        start_update(left);
+        return left;
+    }
+    right->start_left = start_merge(left, right->start_left);
+    start_update(right);
+    return right;
+}
+
+/**
+ * Length-ordered treap
+ */
+// Returns if the node comes before the (length, start) key
+static int length_before(FreeExtent *node, int length, int start) {
+    return node->length < length || (node->length == length && node->start < start);
+}
+
+// Splits the tree in the extents before the (length, start) key and the others
+static void length_split(FreeExtent *tree, int length, int start, FreeExtent **left, FreeExtent **right) {
+    if (tree == NULL) {
+        *left = *right = NULL;
+        return;
+    }
+
+    if (length_before(tree, length, start)) {
+        length_split(tree->length_right, length, start, &tree->length_right, right);
+        *left = tree;
+    } else {
+        length_split(tree->length_left, length, start, left, &tree->length_left);
+        *right = tree;
+    }
+}
+
+// Joins two trees, every extent in "left" coming before those in "right"
+static FreeExtent *length_merge(FreeExtent *left, FreeExtent *right) {
+    if (left == NULL)
+        return right;
+    if (right == NULL)
+        return left;
+
+    if (left->priority > right->priority) {
+        left->length_right = length_merge(left->length_right, right);
+        return left;
+    }
+    right->length_left = length_merge(left, right->length_left);
+    return right;
+}
+
+// Adds a node to the length-ordered tree
+static void length_insert(FatFs *fs, FreeExtent *node) {
+    FreeExtent *left, *right;
+    length_split(fs->free_extents_by_length, node->length, node->start, &left, &right);
+    fs->free_extents_by_length = length_merge(length_merge(left, node), right);
+}
+
+// Removes a node from the length-ordered tree
+static void length_remove(FatFs *fs, FreeExtent *node) {
+    FreeExtent *left, *middle, *right;
+    length_split(fs->free_extents_by_length, node->length, node->start, &left, &right);
+    length_split(right, node->length, node->start + 1, &middle, &right);
+    fs->free_extents_by_length = length_merge(left, right);
+}
+
+/**
+ * Extent nodes
+ */
+// Returns a pseudo-random priority for the node of an extent
+static unsigned int extent_priority(int start) {
+    unsigned int hash = start;
+    hash ^= hash >> 16;
+    hash *= 0x85EBCA6B;
+    hash ^= hash >> 13;
+    hash *= 0xC2B2AE35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// Creates a node for an extent, already inserted in the length-ordered tree
+static FreeExtent *extent_new(FatFs *fs, int start, int length) {
+    FreeExtent *node = malloc(sizeof(FreeExtent));
+    if (node == NULL)
+        return NULL;
+
+    node->start = start;
+    node->length = length;
+    node->max_length = length;
+    node->priority = extent_priority(start);
+    node->start_left = node->start_right = NULL;
+    node->length_left = node->length_right = NULL;
+
+    length_insert(fs, node);
+    return node;
+}
+
+// Frees every node in the start-ordered tree
+static void extent_free_all(FreeExtent *tree) {
+    if (tree == NULL)
+        return;
+
+    extent_free_all(tree->start_left);
+    extent_free_all(tree->start_right);
+    free(tree);
+}
+
+// Returns the last extent in the start-ordered tree
+static FreeExtent *extent_last(FreeExtent *tree) {
+    while (tree && tree->start_right)
+        tree = tree->start_right;
+    return tree;
+}
+
+// Returns the first extent in the start-ordered tree
+static FreeExtent *extent_first(FreeExtent *tree) {
+    while (tree && tree->start_left)
+        tree = tree->start_left;
+    return tree;
+}
+
+/**
+ * Index maintenance
+ */
+
+/**
+ * Drops the index and goes back to the bitmap allocator
+ */
+void extents_destroy(FatFs *fs) {
+    extent_free_all(fs->free_extents);
+    fs->free_extents = NULL;
+    fs->free_extents_by_length = NULL;
+    fs->allocator = FAT_ALLOC_BITMAP;
+}
+
+/**
+ * Adds the free blocks from "start" to the index,
+ * merging them with the extents right before and after
+ */
+void extents_add(FatFs *fs, int start, int length) {
+    FreeExtent *left, *right, *node;
+    start_split(fs->free_extents, start, &left, &right);
+
+    // Merge with the extent ending at "start"
+    node = extent_last(left);
+    if (node && node->start + node->length == start) {
+        FreeExtent *rest;
+        start_split(left, node->start, &left, &rest);
+        length_remove(fs, node);
+
+        start = node->start;
+        length += node->length;
+        free(node);
+    }
+
+    // Merge with the extent beginning after the blocks
+    node = extent_first(right);
+    if (node && node->start == start + length) {
+        FreeExtent *rest;
+        start_split(right, node->start + 1, &rest, &right);
+        length_remove(fs, node);
+
+        length += node->length;
+        free(node);
+    }
+
+    node = extent_new(fs, start, length);
+    fs->free_extents = start_merge(start_merge(left, node), right);
+
+    // Without memory the index can't be trusted anymore
+    if (node == NULL)
+        extents_destroy(fs);
+}
+
+/**
+ * Removes the blocks from "start" from the index,
+ * splitting the extent containing them
+ */
+void extents_remove(FatFs *fs, int start, int length) {
+    FreeExtent *left, *right, *node;
+    start_split(fs->free_extents, start + 1, &left, &right);
+
+    // Find the extent containing the blocks
+    node = extent_last(left);
+    if (node == NULL || node->start + node->length < start + length) {
+        fs->free_extents = start_merge(left, right);
+        return;
+    }
+
+    FreeExtent *rest;
+    start_split(left, node->start, &left, &rest);
+    length_remove(fs, node);
+
+    // Keep the free blocks before and after the removed ones
+    FreeExtent *before = NULL, *after = NULL;
+    int ok = 1;
+    if (node->start < start)
+        ok &= (before = extent_new(fs, node->start, start - node->start)) != NULL;
+    if (node->start + node->length > start + length)
+        ok &= (after = extent_new(fs, start + length, node->start + node->length - start - length)) != NULL;
+    free(node);
+
+    fs->free_extents = start_merge(start_merge(left, before), start_merge(after, right));
+
+    // Without memory the index can't be trusted anymore
+    if (!ok)
+        extents_destroy(fs);
+}
+
+/**
+ * Builds the index from the bitmap
+ */
+FatResult extents_build(FatFs *fs) {
+    int blocks_count = fs->header->blocks_count;
+
+    int start = bitmap_next_free(fs, 0);
+    while (start != -1) {
+        int end = bitmap_next_used(fs, start, blocks_count);
+
+        // Extents are found in order, so just append them
+        FreeExtent *node = extent_new(fs, start, end - start);
+        if (node == NULL) {
+            extent_free_all(fs->free_extents);
+            fs->free_extents = NULL;
+            fs->free_extents_by_length = NULL;
+            return OUT_OF_MEMORY;
+        }
+        fs->free_extents = start_merge(fs->free_extents, node);
+
+        if (end == blocks_count)
+            break;
+        start = bitmap_next_free(fs, end);
+    }
+
+    return OK;
+}
+
+// Returns the extent chosen by the allocator among those of at least "length" blocks
+static FreeExtent *extent_fit(FatFs *fs, int length) {
+    FreeExtent *node = NULL;
+
+    if (fs->allocator == FAT_ALLOC_FIRST_FIT) {
+        // Go to the leftmost extent long enough
+        FreeExtent *tree = fs->free_extents;
+        while (tree && MAX_LENGTH(tree) >= length) {
+            if (MAX_LENGTH(tree->start_left) >= length)
+                tree = tree->start_left;
+            else if (tree->length >= length)
+                return tree;
+            else
+                tree = tree->start_right;
+        }
+    } else {
+        // Go to the shortest extent long enough
+        FreeExtent *tree = fs->free_extents_by_length;
+        while (tree) {
+            if (tree->length >= length) {
+                node = tree;
+                tree = tree->length_left;
+            } else
+                tree = tree->length_right;
+        }
+    }
+
+    return node;
+}
+
+/**
+ * Chooses the free blocks for a run of up to "max_blocks" blocks
+ * Returns the length of the run (0 if there are no free blocks)
+ */
+int extents_find(FatFs *fs, int max_blocks, int *first_block) {
+    // If no extent is long enough, take the first of the longest
+    int length = MIN(max_blocks, MAX_LENGTH(fs->free_extents));
+    if (length == 0)
+        return 0;
+
+    FreeExtent *node = extent_fit(fs, length);
+    *first_block = node->start;
+    return length;
+}
+
+/**
+ * Selects the block allocator used by this mount
+ */
+FatResult fat_set_allocator(FatFs *fs, FatAllocator allocator) {
+    if (allocator != FAT_ALLOC_BITMAP && allocator != FAT_ALLOC_FIRST_FIT && allocator != FAT_ALLOC_BEST_FIT)
+        return INVALID_ALLOCATOR;
+
+    // Build the index when leaving the bitmap allocator
+    if (fs->allocator == FAT_ALLOC_BITMAP && allocator != FAT_ALLOC_BITMAP) {
+        FatResult res = extents_build(fs);
+        if (res != OK)
+            return res;
+    }
+    // And drop it when going back to it
+    else if (allocator == FAT_ALLOC_BITMAP)
+        extents_destroy(fs);
+
+    fs->allocator = allocator;
+    return OK;
+}
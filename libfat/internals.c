@@ -3,6 +3,8 @@
  * @authors Claziero, Cicim
  */
 
+#include <endian.h>
+#include <stdlib.h>
 #include <string.h>
 #include "internals.h"
 
@@ -35,202 +37,359 @@ void bitmap_set(FatFs *fs, int block_number, int value) {
         fs->bitmap_ptr[byte_index] |= (1 << bit_index);
     else
         fs->bitmap_ptr[byte_index] &= ~(1 << bit_index);
+
+    // A freed block below the cursor becomes the new lowest free block
+    if (!value && block_number < fs->free_cursor)
+        fs->free_cursor = block_number;
+
+    // Keep the summary bit of the block's word in sync
+    bitmap_update_summary(fs, block_number / 64);
+
+    // Keep the free-extent index in sync
+    if (fs->allocator != FAT_ALLOC_BITMAP && value != old_value) {
+        if (value)
+            extents_remove(fs, block_number, 1);
+        else
+            extents_add(fs, block_number, 1);
+    }
 }
 
 /**
- * Returns the first free block in the bitmap
- * @author Claziero
+ * Sets the bit value of "count" blocks from the given one,
+ * a bitmap word at a time, updating the free blocks count once
  */
-int bitmap_get_free_block(FatFs *fs) {
-    int bitmap_size = fs->header->blocks_count / 8;
-
-    // Loop through the bitmap
-    for (int i = 0; i < bitmap_size; i++) {
-        // For every byte in the bitmap check if its value is not 0xFF
-        if (fs->bitmap_ptr[i] != 0xFF) {
-            // Loop through the bits in the byte
-            for (int j = 0; j < 8; j++) {
-                // If the bit is 0, return the block index
-                if (!((fs->bitmap_ptr[i] >> j) & 1))
-                    return i * 8 + j;
+void bitmap_set_range(FatFs *fs, int block_number, int count, int value) {
+    int changed = 0;
+
+    for (int block = block_number; block < block_number + count; ) {
+        // Mask the blocks of the range in this word
+        int word_index = block / 64;
+        int bits = MIN(64 - block % 64, block_number + count - block);
+        uint64_t mask = (bits == 64 ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1)) << (block % 64);
+
+        uint64_t word = bitmap_get_word(fs, word_index);
+        uint64_t changed_bits = (value ? ~word : word) & mask;
+        bitmap_put_word(fs, word_index, value ? word | mask : word & ~mask);
+        bitmap_update_summary(fs, word_index);
+        changed += __builtin_popcountll(changed_bits);
+
+        // Keep the free-extent index in sync, block by block if only some changed
+        if (fs->allocator != FAT_ALLOC_BITMAP && changed_bits != mask) {
+            for (; changed_bits; changed_bits &= changed_bits - 1) {
+                int changed_block = word_index * 64 + __builtin_ctzll(changed_bits);
+                if (value)
+                    extents_remove(fs, changed_block, 1);
+                else
+                    extents_add(fs, changed_block, 1);
             }
         }
+        else if (fs->allocator != FAT_ALLOC_BITMAP) {
+            if (value)
+                extents_remove(fs, block, bits);
+            else
+                extents_add(fs, block, bits);
+        }
+
+        block += bits;
     }
 
-    // If no free block was found, return -1
-    return -1;
+    if (value)
+        fs->header->free_blocks -= changed;
+    else
+        fs->header->free_blocks += changed;
+
+    // A freed block below the cursor becomes the new lowest free block
+    if (!value && count > 0 && block_number < fs->free_cursor)
+        fs->free_cursor = block_number;
 }
 
 /**
- * Stores the absolute path of the given file/directory
- * TODO: implement cases when "./" or "../" are inside the path, not only at the beginning
- * @author Claziero
+ * Returns the 64-bit bitmap word at the given index
+ * The bits after the last block are returned as occupied
  */
-FatResult path_get_absolute(FatFs *fs, const char *path, char *dest) {
-    char result[MAX_PATH_LENGTH];
+uint64_t bitmap_get_word(FatFs *fs, int word_index) {
+    int bitmap_size = fs->header->blocks_count / 8;
+    int byte_index = word_index * sizeof(uint64_t);
 
-    // If the path is empty, return an error
-    if (path == NULL || path[0] == '\0')
-        return INVALID_PATH;
+    // The bitmap size is only a multiple of 4 bytes
+    uint64_t word = ~(uint64_t)0;
+    if (bitmap_size - byte_index >= sizeof(uint64_t))
+        memcpy(&word, fs->bitmap_ptr + byte_index, sizeof(uint64_t));
+    else
+        memcpy(&word, fs->bitmap_ptr + byte_index, bitmap_size - byte_index);
 
-    // If the path is wrong, return an error
-    if (strncmp(path, "..", 2) == 0 && path[2] != '\0' && path[2] != '/')
-        return INVALID_PATH;
+    // Bit j of byte i is block 8 * i + j, so read the word as little endian
+    return le64toh(word);
+}
 
-    // If the path is already absolute, copy it to the destination
-    if (strncmp(path, fs->current_directory, strlen(fs->current_directory)) == 0) {
-        if (strcmp(path, "/") == 0)
-            strcpy(result, "/");
-        else {
-            strcpy(result, path);
+/**
+ * Stores the 64-bit bitmap word at the given index
+ * The bits after the last block are not stored
+ */
+void bitmap_put_word(FatFs *fs, int word_index, uint64_t word) {
+    int bitmap_size = fs->header->blocks_count / 8;
+    int byte_index = word_index * sizeof(uint64_t);
 
-            // Check if there are trailing slashes
-            while (result[strlen(result) - 1] == '/' && strlen(result) != 1)
-                result[strlen(result) - 1] = '\0';
-        }
+    word = htole64(word);
+    memcpy(fs->bitmap_ptr + byte_index, &word, MIN(bitmap_size - byte_index, sizeof(uint64_t)));
+}
 
-        strcpy(dest, result);
-        return OK;
-    }
+/**
+ * Sets or clears the summary bit of a bitmap word
+ * The bit is set if the word has at least a free block
+ */
+void bitmap_update_summary(FatFs *fs, int word_index) {
+    uint64_t bit = (uint64_t)1 << (word_index % 64);
 
-    // If the path contains only ".."
-    if (strcmp(path, "..") == 0) {
-        // Get the parent directory
-        char *parent_dir = strrchr(fs->current_directory, '/');
+    if (~bitmap_get_word(fs, word_index))
+        fs->bitmap_summary[word_index / 64] |= bit;
+    else
+        fs->bitmap_summary[word_index / 64] &= ~bit;
+}
 
-        // If the current directory is the root directory, return an error
-        if (strcmp(fs->current_directory, "/") == 0)
-            return INVALID_PATH;
+/**
+ * Builds the summary of the bitmap
+ */
+FatResult bitmap_build_summary(FatFs *fs) {
+    int words_count = BITMAP_WORDS(fs);
+    int summary_count = CEIL(words_count, 64);
 
-        // If the parent directory is the root directory
-        if (parent_dir == fs->current_directory) {
-            strcpy(result, "/");
-            strcpy(dest, result);
-            return OK;
-        }
+    fs->bitmap_summary = calloc(summary_count, sizeof(uint64_t));
+    if (fs->bitmap_summary == NULL)
+        return OUT_OF_MEMORY;
 
-        // Otherwise, copy the parent directory to the destination
-        strncpy(result, fs->current_directory, strlen(fs->current_directory) - strlen(parent_dir));
-        result[strlen(fs->current_directory) - strlen(parent_dir)] = '\0';
+    for (int i = 0; i < words_count; i++)
+        bitmap_update_summary(fs, i);
 
-        strcpy(dest, result);
-        return OK;
+    return OK;
+}
+
+/**
+ * Returns the first free block starting from the given one
+ */
+int bitmap_next_free(FatFs *fs, int block_number) {
+    int summary_count = CEIL(BITMAP_WORDS(fs), 64);
+
+    // Check the rest of the first word
+    int word_index = block_number / 64;
+    uint64_t word = ~bitmap_get_word(fs, word_index) & (~(uint64_t)0 << (block_number % 64));
+    if (word != 0)
+        return word_index * 64 + __builtin_ctzll(word);
+
+    // Ignore the summary bits of the words up to the first
+    word_index++;
+    uint64_t mask = ~(uint64_t)0 << (word_index % 64);
+
+    // Look for the next word with a free block in the summary
+    for (int i = word_index / 64; i < summary_count; i++, mask = ~(uint64_t)0) {
+        uint64_t summary = fs->bitmap_summary[i] & mask;
+        if (summary == 0)
+            continue;
+
+        // Look for the first zero bit in the word
+        word_index = i * 64 + __builtin_ctzll(summary);
+        word = ~bitmap_get_word(fs, word_index);
+        return word_index * 64 + __builtin_ctzll(word);
     }
 
-    // If the path begins with "../"
-    int flag = 0;
-    strcpy(result, fs->current_directory);
-    while (strncmp(path, "../", 3) == 0) {
-        flag = 1;
-        // Get the parent directory
-        char *parent_dir = strrchr(result, '/');
+    return -1;
+}
 
-        // If the current directory is the root directory, return an error
-        if (strcmp(result, "/") == 0)
-            return INVALID_PATH;
+/**
+ * Returns the first occupied block starting from the given one,
+ * looking no further than the limit block (returned if all are free)
+ */
+int bitmap_next_used(FatFs *fs, int block_number, int limit) {
+    int word_index = block_number / 64;
+    uint64_t word = bitmap_get_word(fs, word_index) & (~(uint64_t)0 << (block_number % 64));
 
-        // If the parent directory is the root directory
-        if (parent_dir == result) {
-            strcpy(result, "/");
-            path += 3;
-            continue;
-        }
+    // The bits after the last block are always set, so the loop ends
+    while (word == 0 && word_index * 64 < limit)
+        word = bitmap_get_word(fs, ++word_index);
 
-        // Otherwise, copy the parent directory to the destination
-        strncpy(result, fs->current_directory, strlen(fs->current_directory) - strlen(parent_dir));
-        result[strlen(fs->current_directory) - strlen(parent_dir)] = '\0';
-        
-        // Get the next path component
-        path += 3;
-    }
-    // If the path is terminated
-    if (flag && strcmp(path, "") == 0) {
-        strcpy(dest, result);
-        return OK;
-    }
-    else if (flag) {
-        // Append the rest of the path to the destination
-        if (result[1] != '\0')
-            strcat(result, "/");
-        strcat(result, path);
-
-        // Check if there are trailing slashes
-        while (result[strlen(result) - 1] == '/' && strlen(result) != 1)
-            result[strlen(result) - 1] = '\0';
-        
-        strcpy(dest, result);
-        return OK;
+    if (word == 0)
+        return limit;
+    return MIN(word_index * 64 + __builtin_ctzll(word), limit);
+}
+
+/**
+ * Returns the first free block in the bitmap
+ * @author Claziero
+ */
+int bitmap_get_free_block(FatFs *fs) {
+    // Skip the scan if the file system is full
+    if (fs->header->free_blocks == 0)
+        return -1;
+
+    // Ask the free-extent index, if used
+    int first_block;
+    if (fs->allocator != FAT_ALLOC_BITMAP)
+        return extents_find(fs, 1, &first_block) ? first_block : -1;
+
+    // Every block before the cursor is occupied, so start from it
+    int block_number = -1;
+    if (fs->free_cursor < fs->header->blocks_count)
+        block_number = bitmap_next_free(fs, fs->free_cursor);
+
+    // Move the cursor to the block found
+    fs->free_cursor = block_number == -1 ? fs->header->blocks_count : block_number;
+    return block_number;
+}
+
+/**
+ * Looks for free blocks close to the goal block:
+ * the run starting at the goal if it is free, otherwise
+ * the first run of "max_blocks" blocks in the window after it
+ * Returns the length of the run (0 if there is none)
+ */
+int bitmap_find_near(FatFs *fs, int goal_block, int max_blocks, int *first_block) {
+    int blocks_count = fs->header->blocks_count;
+    if (goal_block < 0 || goal_block >= blocks_count)
+        return 0;
+
+    // Continue right from the goal block if possible
+    int limit = MIN(goal_block + ALLOC_GOAL_WINDOW, blocks_count);
+    int start = goal_block;
+    while (start < limit && (start = bitmap_next_free(fs, start)) != -1 && start < limit) {
+        int end = bitmap_next_used(fs, start, MIN(start + max_blocks, blocks_count));
+        if (start == goal_block || end - start == max_blocks) {
+            *first_block = start;
+            return end - start;
+        }
+        start = end;
     }
 
-    // If the path contains only "."
-    if (strcmp(path, ".") == 0) {
-        strcpy(result, fs->current_directory);
+    return 0;
+}
 
-        // Check if there are trailing slashes
-        while (result[strlen(result) - 1] == '/' && strlen(result) != 1)
-            result[strlen(result) - 1] = '\0';
+/**
+ * Allocates a run of free blocks, up to "max_blocks", and links it in the FAT.
+ * The run is taken near "goal_block" if possible (-1 for no goal),
+ * otherwise it is the first long enough or the longest one
+ * Returns the number of allocated blocks (0 if there are no free blocks)
+ */
+int bitmap_alloc_run(FatFs *fs, int goal_block, int max_blocks, int *first_block) {
+    int best_start = -1, best_length = 0;
+
+    // Leave the blocks reserved by delayed writes
+    max_blocks = MIN(max_blocks, FREE_BLOCKS(fs));
+    if (max_blocks <= 0)
+        return 0;
+
+    // Stay close to the goal block
+    best_length = bitmap_find_near(fs, goal_block, max_blocks, &best_start);
+
+    // Ask the free-extent index, if used
+    if (best_length == 0 && fs->allocator != FAT_ALLOC_BITMAP)
+        best_length = extents_find(fs, max_blocks, &best_start);
+
+    // The first free block is where the search starts
+    int start = best_length == 0 && fs->allocator == FAT_ALLOC_BITMAP ? bitmap_get_free_block(fs) : -1;
+
+    // Stop at the first run long enough, otherwise keep the longest
+    while (start != -1 && best_length < max_blocks) {
+        int end = bitmap_next_used(fs, start, start + max_blocks);
+        if (end - start > best_length) {
+            best_start = start;
+            best_length = end - start;
+        }
 
-        
-        strcpy(dest, result);
-        return OK;
-    }
-    
-    // If the path begins with "./"
-    flag = 0;
-    while (strncmp(path, "./", 2) == 0) {
-        flag = 1;
-
-        // Copy the current directory to the destination
-        strcpy(result, fs->current_directory);
-        
-        // Get the next path component
-        path += 2;
-    }
-    // If the path is terminated
-    if (flag && strcmp(path, "") == 0) {
-        strcpy(dest, result);
-        return OK;
+        if (end >= fs->header->blocks_count)
+            break;
+        start = bitmap_next_free(fs, end);
     }
-    else if (flag) {
-        // Append the rest of the path to the destination
-        if (result[1] != '\0')
-            strcat(result, "/");
-        strcat(result, path);
-
-        // Check if there are trailing slashes
-        while (result[strlen(result) - 1] == '/' && strlen(result) != 1)
-            result[strlen(result) - 1] = '\0';
-        
-        strcpy(dest, result);
-        return OK;
+
+    // Occupy the run and link its blocks
+    bitmap_set_range(fs, best_start, best_length, 1);
+    for (int i = 0; i < best_length; i++)
+        fat_set_next_block(fs, best_start + i, i + 1 < best_length ? best_start + i + 1 : FAT_EOF);
+
+    *first_block = best_start;
+    return best_length;
+}
+
+/**
+ * Gets the next component of a path, skipping the slashes before it,
+ * and moves "path" after it. Returns 0 if there are no more components
+ */
+int path_next_component(const char **path, PathComponent *component) {
+    const char *start = *path;
+    while (*start == '/')
+        start++;
+    if (*start == '\0')
+        return 0;
+
+    const char *end = start;
+    while (*end != '\0' && *end != '/')
+        end++;
+
+    component->name = start;
+    component->length = end - start;
+    *path = end;
+    return 1;
+}
+
+/**
+ * Stores the absolute path of the given file/directory, in a single pass
+ * over its components: "." and ".." are resolved wherever they are
+ * and repeated or trailing slashes are removed
+ * Relative paths start from "base", that "dest" may be
+ */
+static FatResult path_join(const char *base, const char *path, char *dest) {
+    // If the path is empty, return an error
+    if (path == NULL || path[0] == '\0')
+        return INVALID_PATH;
+
+    // Relative paths start from the base (without its last slash)
+    int length = 0;
+    if (path[0] != '/') {
+        length = strlen(base);
+        if (dest != base)
+            memcpy(dest, base, length);
+        while (length > 0 && dest[length - 1] == '/')
+            length--;
     }
 
-    // If the path begins with "/", then copy the given path to the destination
-    if (strncmp(path, "/", 1) == 0) {
-        strcpy(result, path);
+    PathComponent component;
+    while (path_next_component(&path, &component)) {
+        // Stay in the same directory
+        if (component.length == 1 && component.name[0] == '.')
+            continue;
 
-        // Check if there are trailing slashes
-        while (result[strlen(result) - 1] == '/' && strlen(result) != 1)
-            result[strlen(result) - 1] = '\0';
+        // Go to the parent directory, if there is one
+        if (component.length == 2 && component.name[0] == '.' && component.name[1] == '.') {
+            if (length == 0)
+                return INVALID_PATH;
+            while (dest[--length] != '/')
+                ;
+            continue;
+        }
 
-        strcpy(dest, result);
-        return OK;
+        // Append the name after a slash
+        if (length + 1 + component.length >= MAX_PATH_LENGTH)
+            return INVALID_PATH;
+        dest[length++] = '/';
+        memcpy(dest + length, component.name, component.length);
+        length += component.length;
     }
-    
-    // Else the path is relative, so concatenate the current directory and the path
-    strcpy(result, fs->current_directory);
-    if (strcmp(fs->current_directory, "/") != 0) 
-        strcat(result, "/");
-    strcat(result, path);
 
-    // Check if there are trailing slashes
-    while (result[strlen(result) - 1] == '/' && strlen(result) != 1)
-        result[strlen(result) - 1] = '\0';
+    // The root is the only path ending with a slash
+    if (length == 0)
+        dest[length++] = '/';
+    dest[length] = '\0';
 
-    strcpy(dest, result);
     return OK;
 }
 
+/**
+ * Stores the absolute path of the given file/directory
+ * "dest" may be the current directory itself
+ * @author Claziero
+ */
+FatResult path_get_absolute(FatFs *fs, const char *path, char *dest) {
+    return path_join(fs->current_directory, path, dest);
+}
+
 /**
  * Convert a path to absolute, then store the pointers to the
  * directory and the element
@@ -262,6 +421,38 @@ FatResult path_get_components(FatFs *fs, const char *path, char *path_buffer, ch
     return OK;
 }
 
+/**
+ * Gets the first block of the directory containing the element of a path,
+ * and the name of the element. Relative paths start from the directory
+ * in "base_block", or from the current directory if it is FAT_EOF
+ */
+FatResult path_get_parent(FatFs *fs, int base_block, const char *path, char *path_buffer, int *parent_block, char **name) {
+    FatResult res;
+    char *dir_path;
+
+    if (base_block == FAT_EOF || (path != NULL && path[0] == '/')) {
+        res = path_get_components(fs, path, path_buffer, &dir_path, name);
+        if (res != OK)
+            return res;
+        return dir_get_first_block(fs, dir_path, parent_block);
+    }
+
+    // The base directory has no known path, so ".." can't leave it
+    res = path_join("/", path, path_buffer);
+    if (res != OK)
+        return res;
+    if (IS_ROOT(path_buffer))
+        return INVALID_PATH;
+
+    // Split the name from the directories to go through
+    *name = strrchr(path_buffer, '/');
+    **name = '\0';
+    *name += 1;
+
+    // The directories are the path without its first slash (none for the base itself)
+    return dir_get_first_block_from(fs, base_block, path_buffer[0] == '/' ? path_buffer + 1 : path_buffer, parent_block);
+}
+
 static const char *fat_result_str_table[] = {
     [OK]                          = "Ok",
     [-INVALID_BLOCKS_COUNT]       = "Invalid number of blocks",
@@ -284,6 +475,13 @@ static const char *fat_result_str_table[] = {
     [-FILE_OPEN_INVALID_ARGUMENT] = "Invalid argument for file open",
     [-LS_INVALID_ARGUMENT]        = "Invalid argument for ls",
     [-SAME_PATH]                  = "Same paths",
+    [-INVALID_ALLOCATOR]          = "Invalid allocator",
+    [-FAT_SYNC_ERROR]             = "Error syncing the file system",
+    [-FALLOCATE_INVALID_ARGUMENT] = "Invalid argument for fallocate",
+    [-INVALID_FEATURES]           = "Invalid file system features",
+    [-INVALID_COOKIE]             = "Invalid directory cookie",
+    [-WALK_INVALID_ARGUMENT]      = "Invalid argument for walk",
+    [-FILE_ERASED]                = "The file was erased",
 };
 
 /**
@@ -299,11 +497,18 @@ const char *fat_result_string(FatResult res) {
  * @authors Cicim, Claziero
  */
 FatResult fat_unlink(FatFs *fs, int block_number) {
+    int run_start = block_number, run_length = 0;
+
     // Update the FAT table and bitmap references
     do {
-        // Set the bitmap
-        bitmap_set(fs, block_number, 0);
-        
+        // Free the blocks in runs of contiguous blocks
+        if (block_number != run_start + run_length) {
+            bitmap_set_range(fs, run_start, run_length, 0);
+            run_start = block_number;
+            run_length = 0;
+        }
+        run_length++;
+
         // Update the FAT table
         int next = fat_get_next_block(fs, block_number);
         fat_set_next_block(fs, block_number, FAT_EOF);
@@ -311,6 +516,9 @@ FatResult fat_unlink(FatFs *fs, int block_number) {
         block_number = next;
     } while (block_number != FAT_EOF);
 
+    // Free the last run
+    bitmap_set_range(fs, run_start, run_length, 0);
+
     return OK;
 }
 
@@ -325,12 +533,38 @@ FatResult dir_get_entry(FatFs *fs, int dir_block, const char *name, DirEntry **e
     dir->block_number = dir_block;
     dir->count = 0;
 
+    // Look the name up in the cache, then in the index if the directory has one
+    DirCacheResult cached = dir_cache_lookup(fs, dir_block, name, &curr);
+    if (cached == DIR_CACHE_MISSING)
+        return FILE_NOT_FOUND;
+
+    DirHeader *header = dir_get_header(fs, dir_block);
+    if (cached == DIR_CACHE_UNKNOWN && header != NULL && header->index_block != FAT_EOF) {
+        res = dir_index_lookup(fs, header, name, &curr);
+        if (res != OK) {
+            dir_cache_insert_missing(fs, dir_block, name);
+            return res;
+        }
+        dir_cache_insert(fs, dir_block, curr);
+        cached = DIR_CACHE_FOUND;
+    }
+
+    if (cached == DIR_CACHE_FOUND) {
+        // Leave the handle right after the entry, as if the directory was listed
+        int entry_number = curr - (DirEntry *)fs->blocks_ptr;
+        dir->block_number = entry_number / ENTRIES_PER_BLOCK(fs);
+        dir->count = entry_number % ENTRIES_PER_BLOCK(fs);
+        return dir_handle_next(fs, dir, entry);
+    }
+
     while (1) {
         res = dir_handle_next(fs, dir, &curr);
 
         // If you found a DIR_END, the file is not in this directory
-        if (res == END_OF_DIR)
+        if (res == END_OF_DIR) {
+            dir_cache_insert_missing(fs, dir_block, name);
             return FILE_NOT_FOUND;
+        }
         else if (res != OK)
             return res;
 
@@ -338,6 +572,7 @@ FatResult dir_get_entry(FatFs *fs, int dir_block, const char *name, DirEntry **e
         if (strcmp(curr->name, name) != 0) 
             continue;
         *entry = curr;
+        dir_cache_insert(fs, dir_block, curr);
         break;
     }
 
@@ -345,6 +580,24 @@ FatResult dir_get_entry(FatFs *fs, int dir_block, const char *name, DirEntry **e
 }
 
 
+/**
+ * Returns the block before the one with the DIR_END of a directory,
+ * finding it in the FAT after "from_block" if the header doesn't know it
+ */
+static int dir_tail_prev_block(FatFs *fs, DirHeader *header, int from_block) {
+    if (header->end_prev_block != DIR_PREV_UNKNOWN)
+        return header->end_prev_block;
+
+    // The blocks of a directory are usually one after the other
+    int prev_block = header->end_block - 1;
+    if (prev_block < 0 || fat_get_next_block(fs, prev_block) != header->end_block)
+        for (prev_block = from_block; fat_get_next_block(fs, prev_block) != header->end_block; )
+            prev_block = fat_get_next_block(fs, prev_block);
+
+    header->end_prev_block = prev_block;
+    return prev_block;
+}
+
 /**
  * Delete an entry in a directory
  * @author Claziero
@@ -372,38 +625,91 @@ FatResult dir_delete(FatFs *fs, int block_number, DirEntryType type, const char
     if (child_block != NULL)
         *child_block = curr->first_block;
 
-    // Keep listing the directory until you find the end
-    DirEntry *next;
-    int last_entry_block;
-    while (curr->type != DIR_END) {
-        last_entry_block = dir.block_number;
-
-        // Get the next entry
-        res = dir_handle_next(fs, &dir, &next);
-        if (res != OK && res != END_OF_DIR)
-            return res;
+    int epb = ENTRIES_PER_BLOCK(fs);
+    int curr_block = (curr - (DirEntry *)fs->blocks_ptr) / epb;
+    int prev_block = FAT_EOF;
+    int end_block, end_offset;
+
+    // The header knows where the DIR_END is, and the block before it
+    DirHeader *header = dir_get_tail(fs, block_number);
+    if (header != NULL) {
+        end_block = header->end_block;
+        end_offset = DIR_END_OFFSET(fs, header);
+        if (end_offset == 0)
+            prev_block = dir_tail_prev_block(fs, header, curr_block);
+    }
+    else {
+        // Else find the block with the DIR_END, after the one of the entry
+        end_block = curr_block;
+        while (fat_get_next_block(fs, end_block) != FAT_EOF) {
+            prev_block = end_block;
+            end_block = fat_get_next_block(fs, end_block);
+        }
+        // A block left empty by a deletion may follow it
+        if (prev_block != FAT_EOF && ((DirEntry *)fs->blocks_ptr + (prev_block + 1) * epb - 1)->type == DIR_END)
+            end_block = prev_block;
+
+        DirEntry *block_entries = (DirEntry *)fs->blocks_ptr + end_block * epb;
+        end_offset = 0;
+        while (end_offset < epb && block_entries[end_offset].type != DIR_END)
+            end_offset++;
+        if (end_offset == epb)
+            return DIR_END_NOT_FOUND;
+    }
 
-        // Copy the next entry to the current entry
-        *curr = *next;
+    // The last entry is the one before the DIR_END, at the end of the block before if it starts a block
+    int last_block = end_block;
+    if (end_offset == 0 && header != NULL)
+        last_block = prev_block;
+    else if (end_offset == 0) {
+        for (last_block = curr_block; fat_get_next_block(fs, last_block) != end_block; )
+            last_block = fat_get_next_block(fs, last_block);
+    }
+    int last_offset = (end_offset + epb - 1) % epb;
+    DirEntry *last = (DirEntry *)fs->blocks_ptr + last_block * epb + last_offset;
+
+    // Remember the space used by the directory alone, to remove how much it shrinks
+    int own_size = 0, own_blocks = 0;
+    DirUsage *usage = dir_get_usage(fs, block_number);
+    if (usage != NULL)
+        dir_usage_own(fs, block_number, &own_size, &own_blocks);
+
+    // Move the last entry in its place, instead of moving back all the ones after it
+    fs->dir_changes++;
+    dir_index_remove(fs, block_number, curr);
+    dir_cache_insert_missing(fs, block_number, curr->name);
+    if (last != curr) {
+        dir_index_move(fs, block_number, last, curr);
+        *curr = *last;
+        dir_cache_insert(fs, block_number, curr);
+    }
+    memset(last, 0, sizeof(DirEntry));
+    last->type = DIR_END;
+    if (header != NULL) {
+        header->entries--;
+
+        // The block before the new one with the DIR_END is found when needed
+        if (last_block != end_block)
+            header->end_prev_block = last_block == block_number ? FAT_EOF : DIR_PREV_UNKNOWN;
+        header->end_block = last_block;
+    }
 
-        // Move pointers
-        curr = next;
+    // Free the blocks after the one with the DIR_END, if any
+    int next_block = fat_get_next_block(fs, last_block);
+    if (next_block != FAT_EOF) {
+        fat_set_next_block(fs, last_block, FAT_EOF);
+        fat_unlink(fs, next_block);
     }
 
-    // Compact the directory if necessary
-    if (dir.block_number != last_entry_block) {
-        // Free the last block
-        bitmap_set(fs, dir.block_number, 0);
-        // Set the next block to FAT_EOF
-        fat_set_next_block(fs, last_entry_block, FAT_EOF);
+    if (usage != NULL) {
+        int size, blocks;
+        dir_usage_own(fs, block_number, &size, &blocks);
+        dir_usage_add(fs, block_number, size - own_size, blocks - own_blocks);
     }
 
     return OK;
 }
 
-#define CEIL(x, y) (((x) + (y) - 1) / (y))
-
-
 /**
  * Get the size of a directory or a file
  * @author Cicim
@@ -416,46 +722,61 @@ FatResult get_recursive_size(FatFs *fs, int block_number, int type, int *size, i
         // Get the size
         *size = header->size;
         // Get the number of occupied blocks
-        *blocks = CEIL(header->size + sizeof(FileHeader), fs->header->block_size);
+        *blocks = CEIL(header->size + FILE_DATA_OFFSET(fs), fs->header->block_size);
 
         return OK;
     }
 
-    // Loop over the directory
-    DirEntry *curr;
-    DirHandle dir;
-    FatResult res;
-    dir.block_number = block_number;
-    dir.count = 0;
-
-    int total_blocks = 0;
-    int total_size = 0;
-
-    while (1) {
-        res = dir_handle_next(fs, &dir, &curr);
+    // Directories keeping their totals don't need to be walked
+    if (dir_get_usage(fs, block_number) != NULL)
+        return dir_usage_get(fs, block_number, size, blocks);
+
+    // Visit the directories in it without recursion
+    DirWalk walk = {0};
+    FatResult res = dir_walk_push(&walk, block_number);
+    while (res == OK) {
+        DirWalkFrame *frame = DIR_WALK_TOP(&walk);
+        DirEntry *curr;
+        res = dir_handle_next(fs, &frame->dir, &curr);
+
+        if (res == OK) {
+            // Visit the directories that don't know their totals
+            if (curr->type == DIR_ENTRY_DIRECTORY && dir_get_usage(fs, curr->first_block) == NULL) {
+                res = dir_walk_push(&walk, curr->first_block);
+                continue;
+            }
 
-        if (res == END_OF_DIR)
+            // Count the file size
+            int file_blocks, file_size;
+            res = get_recursive_size(fs, curr->first_block, curr->type, &file_size, &file_blocks);
+            // Add the file size and the number of blocks to the total
+            frame->size += file_size;
+            frame->blocks += file_blocks;
+            continue;
+        }
+        else if (res != END_OF_DIR)
             break;
-        else if (res != OK)
-            return res;
+        res = OK;
 
-        // Count the file size
-        int file_blocks, file_size;
-        res = get_recursive_size(fs, curr->first_block, curr->type, &file_size, &file_blocks);
-        if (res != OK)
-            return res;
-        // Add the file size to the total
-        total_size += file_size;
-        // Add the number of blocks to the total
-        total_blocks += file_blocks;
-    }
+        // Add the directory size
+        frame->blocks += CEIL(frame->dir.count + 1, ENTRIES_PER_BLOCK(fs));
+        frame->size += (frame->dir.count + 1) * sizeof(DirEntry);
 
-    // Add the directory size
-    total_blocks += CEIL(dir.count + 1, ENTRIES_PER_BLOCK(fs));
-    total_size += (dir.count + 1) * sizeof(DirEntry);
+        // And the blocks of its index
+        DirHeader *header = dir_get_header(fs, frame->dir_block);
+        if (header != NULL && header->index_block != FAT_EOF)
+            frame->blocks += CEIL(DIR_INDEX_SIZE(fs, header->index_buckets), fs->header->block_size);
 
-    *blocks = total_blocks;
-    *size = total_size;
+        // Add it to the directory containing it, until the first one is done
+        if (--walk.depth == 0) {
+            *blocks = frame->blocks;
+            *size = frame->size;
+            break;
+        }
+        DIR_WALK_TOP(&walk)->size += frame->size;
+        DIR_WALK_TOP(&walk)->blocks += frame->blocks;
+    }
 
-    return OK;
+    dir_walk_free(&walk);
+    return res;
 }
@@ -5,40 +5,180 @@
 #include "fat.h"
 
 #define FAT_MAGIC 0xFA7F50C0
+// The low bits of the magic hold the features of the file system
+#define FAT_MAGIC_MASK 0xFFFFFFC0
+#define FAT_FEATURES_ALL \
+    (FAT_FEATURE_EXTENTS | FAT_FEATURE_FAT16 | FAT_FEATURE_DIR_INDEX | FAT_FEATURE_DIR_SORTED \
+    | FAT_FEATURE_DIR_USAGE)
+
+// Returns if the file system uses the given feature
+#define HAS_FEATURE(fs, feature) (((fs)->features & (feature)) != 0)
+
+#define CEIL(x, y) (((x) + (y) - 1) / (y))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
 
 
 /**
  * Bitmap
  */
+// Number of 64-bit words in the bitmap
+#define BITMAP_WORDS(fs) (((fs)->header->blocks_count + 63) / 64)
+// Number of blocks after the goal block searched before giving up on it
+#define ALLOC_GOAL_WINDOW 64
+// Number of free blocks not reserved by delayed writes
+#define FREE_BLOCKS(fs) ((int)(fs)->header->free_blocks - (fs)->reserved_blocks)
+
 // Returns the bit value at the given block index
 int bitmap_get(FatFs *fs, int block_number);
 // Sets the bit value at the given block index
 void bitmap_set(FatFs *fs, int block_number, int value);
+// Returns the 64-bit word at the given index (blocks past the end are set)
+uint64_t bitmap_get_word(FatFs *fs, int word_index);
+// Stores the 64-bit bitmap word at the given index
+void bitmap_put_word(FatFs *fs, int word_index, uint64_t word);
+// Sets the bit value of "count" blocks from the given one
+void bitmap_set_range(FatFs *fs, int block_number, int count, int value);
+// Updates the summary bit of the given bitmap word
+void bitmap_update_summary(FatFs *fs, int word_index);
+// Allocates and fills the summary of the bitmap
+FatResult bitmap_build_summary(FatFs *fs);
+// Returns the first free block starting from the given one
+int bitmap_next_free(FatFs *fs, int block_number);
+// Returns the first occupied block starting from the given one, up to a limit
+int bitmap_next_used(FatFs *fs, int block_number, int limit);
 // Returns the first free block in the bitmap
 int bitmap_get_free_block(FatFs *fs);
+// Returns a run of up to "max_blocks" free blocks close to the goal block
+int bitmap_find_near(FatFs *fs, int goal_block, int max_blocks, int *first_block);
+// Allocates and links a run of up to "max_blocks" free blocks, close to the goal block if possible
+int bitmap_alloc_run(FatFs *fs, int goal_block, int max_blocks, int *first_block);
+
+/**
+ * Free extents
+ */
+// Builds the free-extent index from the bitmap
+FatResult extents_build(FatFs *fs);
+// Frees the index and goes back to the bitmap allocator
+void extents_destroy(FatFs *fs);
+// Adds free blocks to the index
+void extents_add(FatFs *fs, int start, int length);
+// Removes free blocks from the index
+void extents_remove(FatFs *fs, int start, int length);
+// Chooses a run of up to "max_blocks" free blocks and returns its length
+int extents_find(FatFs *fs, int max_blocks, int *first_block);
 
 /**
  * FAT
  */
 #define FAT_EOF -1
+// FAT_EOF in a 16-bit entry
+#define FAT16_EOF 0xFFFF
+// Size in bytes of an entry of the FAT table
+#define FAT_ENTRY_SIZE(features) \
+    (((features) & FAT_FEATURE_FAT16) ? sizeof(uint16_t) : sizeof(int))
 
-// Returns the next block in the FAT table
-#define fat_get_next_block(fs, block_number) (fs->fat_ptr[block_number])
+// Returns the next block in the FAT table (FAT16_EOF in a 16-bit entry is FAT_EOF)
+static inline int fat_get_next_block(FatFs *fs, int block_number) {
+    if (fs->fat16) {
+        uint16_t next_block = ((uint16_t *)fs->fat_ptr)[block_number];
+        return next_block == FAT16_EOF ? FAT_EOF : next_block;
+    }
+    return ((int *)fs->fat_ptr)[block_number];
+}
 // Sets the next block in the FAT table
-#define fat_set_next_block(fs, block_number, next_block)\
-    (fs->fat_ptr[block_number] = next_block)
+static inline void fat_set_next_block(FatFs *fs, int block_number, int next_block) {
+    if (fs->fat16)
+        ((uint16_t *)fs->fat_ptr)[block_number] = (uint16_t)next_block;
+    else
+        ((int *)fs->fat_ptr)[block_number] = next_block;
+}
 // Removes all blocks linked from "block_number" from the fat and frees them
 FatResult fat_unlink(FatFs *fs, int block_number);
 
+/**
+ * File extents
+ */
+#define FILE_EXTENTS_MAX 6
+// The file has too many extents for the map, so the FAT must be followed
+#define FILE_EXTENTS_OVERFLOW -1
+
+// Run of contiguous blocks of a file
+typedef struct FileExtent {
+    int file_block;
+    int disk_block;
+    int length;
+} FileExtent;
+
+// Extents of a file, stored after its FileHeader
+typedef struct FileExtentMap {
+    int count;
+    int num_blocks;
+    FileExtent extents[FILE_EXTENTS_MAX];
+} FileExtentMap;
+
+// Returns the extent map of the file starting at the given block
+#define FILE_EXTENT_MAP(fs, first_block) \
+    ((FileExtentMap *)((fs)->blocks_ptr + (first_block) * (fs)->header->block_size + sizeof(FileHeader)))
+// Offset of the data in the first block of a file
+#define FILE_DATA_OFFSET(fs) \
+    (sizeof(FileHeader) + (HAS_FEATURE(fs, FAT_FEATURE_EXTENTS) ? sizeof(FileExtentMap) : 0))
+
+// Starts the extent map of a new file
+void file_extents_init(FatFs *fs, int first_block);
+// Adds a run of blocks at the end of the extent map of a file
+void file_extents_append(FatFs *fs, int first_block, int disk_block, int length);
+// Builds the extent map of a file from its FAT chain
+void file_extents_rebuild(FatFs *fs, int first_block);
+// Drops the blocks after the first "num_blocks" from the extent map of a file
+void file_extents_truncate(FatFs *fs, int first_block, int num_blocks);
+// Returns the number of blocks in the extent map (-1 if the FAT must be followed)
+int file_extents_count_blocks(FatFs *fs, int first_block);
+// Returns the block at position "index" in a file (FAT_EOF if there is none)
+int file_block_at(FatFs *fs, int first_block, int index);
+
+/**
+ * File handles
+ */
+// Initial number of blocks in the block index of a file handle
+#define FILE_INDEX_MIN 16
+
+// Returns how many of the first "max_blocks" blocks of a file exist, and the last of them
+int file_index_blocks(FileHandle *file, int max_blocks, int *last_block);
+// Forgets the blocks of the file after the first "num_blocks"
+void file_index_truncate(FileHandle *file, int num_blocks);
+// Makes every open handle of a file forget its blocks after the first "num_blocks"
+void file_handles_truncate(FatFs *fs, int file_block, int num_blocks);
+// Discards the delayed writes of a file handle that could not be placed
+void file_drop_pending(FileHandle *file);
+// Detaches the open handles of a file that is being erased
+void file_handles_detach(FatFs *fs, int file_block);
+// Moves the open handles of a file to its copy in a contiguous run of blocks
+void file_handles_move(FatFs *fs, int old_block, int new_block);
+// Tells the open handles of a file in which directory it is now
+void file_handles_set_dir(FatFs *fs, int file_block, int dir_block);
+// Creates a file with the given name in a directory
+FatResult file_create_in(FatFs *fs, int parent_block, const char *name);
+
 /**
  * Paths
  */
 // Returns if the given path is root
 #define IS_ROOT(path) (path[0] == '/' && path[1] == '\0')
+// Name in a path, pointing inside the path (not terminated)
+typedef struct PathComponent {
+    const char *name;
+    int length;
+} PathComponent;
+
+// Gets the next component of a path and moves "path" after it (0 if there are no more)
+int path_next_component(const char **path, PathComponent *component);
 // Stores the absolute path of the given file/directory
 FatResult path_get_absolute(FatFs *fs, const char *path, char *dest);
 // Divides the given path into a directory and an element name
 FatResult path_get_components(FatFs *fs, const char *path, char *path_buffer, char **dir_ptr, char **element_ptr);
+// Gets the first block of the directory containing the element of a path and its name,
+// with relative paths starting from "base_block" (the current directory if FAT_EOF)
+FatResult path_get_parent(FatFs *fs, int base_block, const char *path, char *path_buffer, int *parent_block, char **name);
 
 /**
  * Directories
@@ -50,8 +190,16 @@ FatResult path_get_components(FatFs *fs, const char *path, char *path_buffer, ch
 
 #define ENTRIES_PER_BLOCK(fs) (fs->header->block_size >> DIR_ENTRY_BITS)
 
-// Returns the first block of the directory given the path
+// Returns the first block of the directory given the absolute path (only written to "block_number")
 FatResult dir_get_first_block(FatFs *fs, const char *path, int *block_number);
+// Returns the first block of the directory given a path relative to "base_block"
+FatResult dir_get_first_block_from(FatFs *fs, int base_block, const char *path, int *block_number);
+// Entries found at a time by a listing in order of name without a sorted index,
+// doubling each time all of them are listed
+#define DIR_PAGE_MIN 16
+#define DIR_PAGE_MAX 256
+// Moves the open handles of a directory to its copy in a contiguous run of blocks
+void dir_handles_move(FatFs *fs, int old_block, int new_block);
 // Puts the next directory entry in *entry given the block number
 FatResult dir_handle_next(FatFs *fs, DirHandle *dir, DirEntry **entry);
 // Creates a new directory entry in the given directory
@@ -62,3 +210,223 @@ FatResult dir_delete(FatFs *fs, int block_number, DirEntryType type, const char
 FatResult dir_get_entry(FatFs *fs, int dir_block, const char *name, DirEntry **entry, DirHandle *dir);
 // Returns the size in blocks of the given directory
 FatResult get_recursive_size(FatFs *fs, int block_number, int type, int *size, int *blocks);
+// Recursively empty a directory and all its subdirectories
+FatResult dir_empty(FatFs *fs, int dir_block);
+// Copy the file and directory structures, placing the copy close to "goal_block"
+FatResult file_copy_recursive(FatFs *fs, int src_block, int src_type, int goal_block, int *copy_block);
+
+/**
+ * Directory tree traversal, with a stack of the directories being visited
+ * instead of C recursion, so deep trees can't overflow the stack
+ */
+// Initial number of directories in the stack of a traversal
+#define DIR_WALK_MIN_DEPTH 16
+
+// Directory being visited, with what the traversal found in it so far
+typedef struct DirWalkFrame {
+    DirHandle dir;
+    // First block of the directory
+    int dir_block;
+    // Entry of the directory visited in the frame above
+    DirEntry *entry;
+    // Totals, or entries done, up to now
+    int size;
+    int blocks;
+    int count;
+    char flags;
+    // Length of the path of the directory
+    int path_length;
+} DirWalkFrame;
+
+// Stack of the directories being visited (initialize it with zeros)
+typedef struct DirWalk {
+    DirWalkFrame *frames;
+    int depth;
+    int capacity;
+} DirWalk;
+
+// Returns the directory being visited, on top of the stack
+#define DIR_WALK_TOP(walk) (&(walk)->frames[(walk)->depth - 1])
+
+// Starts visiting a directory, on top of the stack
+FatResult dir_walk_push(DirWalk *walk, int dir_block);
+// Frees the stack of a traversal
+void dir_walk_free(DirWalk *walk);
+
+/**
+ * Directory index
+ */
+// First entry of a directory with FAT_FEATURE_DIR_INDEX
+typedef struct DirHeader {
+    // First block of the contiguous hash buckets (FAT_EOF without an index)
+    int index_block;
+    // Number of buckets (a power of 2)
+    int index_buckets;
+    // Buckets not empty, deleted ones included
+    int index_used;
+    // Entries in the index
+    int index_entries;
+    // Entries in the directory (if DIR_HEADER_TAIL)
+    int entries;
+    // Block with the DIR_END (if DIR_HEADER_TAIL)
+    int end_block;
+    char flags;
+    // Bits of the entries and of the free blocks when the last index could not be built,
+    // to try again only when either gets past the next power of 2 (if DIR_HEADER_NO_INDEX)
+    unsigned char retry_entries_bits;
+    unsigned char retry_free_bits;
+    char type;
+    // Block before the one with the DIR_END, FAT_EOF if it is the first one
+    // or DIR_PREV_UNKNOWN if not found yet (if DIR_HEADER_TAIL)
+    int end_prev_block;
+} DirHeader;
+
+// The header knows the entries and the DIR_END of the directory
+// (0x1 marked headers with the slot of the DIR_END, now found from the entries)
+#define DIR_HEADER_TAIL 0x2
+// The block before the one with the DIR_END must be found in the FAT
+#define DIR_PREV_UNKNOWN -2
+// The last index could not be built (the directory may still have the one before)
+#define DIR_HEADER_NO_INDEX 0x4
+
+#define DIR_INDEX_MIN_BUCKETS 16
+
+// Node of the balanced tree (AA tree) of the entries of a directory sorted by name,
+// where the nodes are numbered from 1 and 0 is the empty tree
+typedef struct DirIndexNode {
+    // Entry of the node, as stored in the buckets
+    uint32_t value;
+    uint32_t left;
+    uint32_t right;
+    // Nodes at the bottom have level 1, a left child has a lower level than its parent,
+    // a right child the same at most, but not its own right child
+    uint32_t level;
+} DirIndexNode;
+
+// Tree in place of node 0, before the nodes
+typedef struct DirIndexTree {
+    uint32_t root;
+    // First node freed by a removal, linked to the next by "left"
+    uint32_t free;
+    // Nodes used so far
+    uint32_t count;
+    uint32_t reserved;
+} DirIndexTree;
+// Values of the buckets without an entry
+#define DIR_INDEX_EMPTY 0
+#define DIR_INDEX_DELETED 0xFFFFFFFF
+
+// Returns the header in the first block of a directory
+#define DIR_HEADER(fs, dir_block) \
+    ((DirHeader *)((fs)->blocks_ptr + (dir_block) * (fs)->header->block_size))
+// Number of entries before the first one listed in a directory with a header
+#define DIR_HEADER_ENTRIES(fs) (HAS_FEATURE(fs, FAT_FEATURE_DIR_USAGE) ? 2 : 1)
+// Slot of the DIR_END in its block, the first free one, as the entries have no gaps
+#define DIR_END_OFFSET(fs, header) ((DIR_HEADER_ENTRIES(fs) + (header)->entries) % ENTRIES_PER_BLOCK(fs))
+// Converts between entries and the values stored in the buckets
+#define DIR_INDEX_VALUE(fs, entry) ((uint32_t)((entry) - (DirEntry *)(fs)->blocks_ptr) + 1)
+#define DIR_INDEX_ENTRY(fs, value) ((DirEntry *)(fs)->blocks_ptr + (value) - 1)
+// Size of an index, with the tree of the entries sorted by name after the buckets
+// (FAT_FEATURE_DIR_SORTED), with a node for each of the at most half full buckets
+#define DIR_INDEX_SIZE(fs, buckets) \
+    ((buckets) * sizeof(uint32_t) \
+     + (HAS_FEATURE(fs, FAT_FEATURE_DIR_SORTED) ? ((buckets) / 2 + 1) * sizeof(DirIndexNode) : 0))
+// Compares two entry names
+#define NAME_COMPARE(a, b) strncmp(a, b, MAX_FILENAME_LENGTH)
+// Hashes an entry name
+uint32_t name_hash(const char *name);
+
+// Returns the header of a directory, or NULL if it has none
+DirHeader *dir_get_header(FatFs *fs, int dir_block);
+// Fills the first block of a new directory in the given parent directory
+void dir_init_block(FatFs *fs, int dir_block, int parent_block);
+// Returns the header of a directory knowing its entries and DIR_END, or NULL if it has none
+DirHeader *dir_get_tail(FatFs *fs, int dir_block);
+// Looks up an entry in the index of a directory
+FatResult dir_index_lookup(FatFs *fs, DirHeader *header, const char *name, DirEntry **entry);
+// Returns the first entry in order of name after "name" (or equal to it), NULL if none
+DirEntry *dir_index_next_sorted(FatFs *fs, DirHeader *header, const char *name, int include_name);
+// Builds a new index for a directory, freeing the old one (kept if there is no room for it)
+FatResult dir_index_build(FatFs *fs, int dir_block);
+// Frees the index of a directory
+void dir_index_free(FatFs *fs, int dir_block);
+// Adds a new entry to the index of a directory with "count" entries
+void dir_index_add(FatFs *fs, int dir_block, DirEntry *entry, int count);
+// Removes an entry from the index of a directory
+void dir_index_remove(FatFs *fs, int dir_block, DirEntry *entry);
+// Points the index of a directory to an entry copied to a new slot
+void dir_index_move(FatFs *fs, int dir_block, DirEntry *from, DirEntry *to);
+
+/**
+ * Directory usage totals
+ */
+// Second entry of a directory with FAT_FEATURE_DIR_USAGE
+typedef struct DirUsage {
+    // Bytes and blocks used by the directory and everything in it
+    int size;
+    int blocks;
+    // First block of the directory containing it (FAT_EOF for the root)
+    int parent_block;
+    char flags;
+    char reserved[MAX_FILENAME_LENGTH - 3 * sizeof(int) - 1];
+    char type;
+    unsigned int reserved_block;
+} DirUsage;
+
+// The totals of the root (and so of every directory) must be computed again
+#define DIR_USAGE_STALE 0x1
+
+// Returns the usage totals after the header of a directory
+#define DIR_USAGE(fs, dir_block) ((DirUsage *)DIR_HEADER(fs, dir_block) + 1)
+
+// Returns the usage totals of a directory, or NULL if it has none
+DirUsage *dir_get_usage(FatFs *fs, int dir_block);
+// Starts the totals of a new directory in the given parent directory
+void dir_usage_init(FatFs *fs, int dir_block, int parent_block);
+// Gets the bytes and blocks used by the entries and the index of a directory alone
+void dir_usage_own(FatFs *fs, int dir_block, int *size, int *blocks);
+// Adds to the totals of a directory and of the ones containing it
+void dir_usage_add(FatFs *fs, int dir_block, int size, int blocks);
+// Adds (or subtracts if "sign" is -1) the totals of an element to its directory
+void dir_usage_add_child(FatFs *fs, int dir_block, int child_block, int child_type, int sign);
+// Computes the totals of a directory from the ones of its elements
+void dir_usage_sum(FatFs *fs, int dir_block);
+// Marks every total as stale, to be computed again when needed
+void dir_usage_invalidate(FatFs *fs);
+// Returns the totals of a directory, computing them again if they are stale
+FatResult dir_usage_get(FatFs *fs, int dir_block, int *size, int *blocks);
+
+/**
+ * Directory entry cache
+ */
+// Number of entries in the cache (a power of 2)
+#define DENTRY_CACHE_SIZE 1024
+// Number of directories with a Bloom filter (a power of 2)
+#define DIR_BLOOM_CACHE_SIZE 64
+// Bits of a Bloom filter for each name, and bits set by each name
+#define DIR_BLOOM_BITS_PER_NAME 16
+#define DIR_BLOOM_HASHES 4
+
+// What the cache knows about a name in a directory
+typedef enum DirCacheResult {
+    DIR_CACHE_UNKNOWN = 0,
+    DIR_CACHE_FOUND,
+    DIR_CACHE_MISSING
+} DirCacheResult;
+
+// Allocates the empty cache of a file system
+void dir_cache_init(FatFs *fs);
+// Frees the cache of a file system
+void dir_cache_destroy(FatFs *fs);
+// Tells if a name is in a directory (and where) or surely not there, from the cache alone
+DirCacheResult dir_cache_lookup(FatFs *fs, int parent_block, const char *name, DirEntry **entry);
+// Remembers where an entry of a directory is
+void dir_cache_insert(FatFs *fs, int parent_block, DirEntry *entry);
+// Adds a new entry of a directory to the cache and to its Bloom filter
+void dir_cache_add(FatFs *fs, int parent_block, DirEntry *entry);
+// Remembers that a name is not in a directory
+void dir_cache_insert_missing(FatFs *fs, int parent_block, const char *name);
+// Forgets an entry of a directory
+void dir_cache_invalidate(FatFs *fs, int parent_block, const char *name);
+// Forgets everything about a directory
+void dir_cache_forget_dir(FatFs *fs, int dir_block);
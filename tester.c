@@ -3,6 +3,7 @@
  * @author Cicim
  */
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "libfat/internals.h"
 
@@ -355,8 +356,43 @@ cleanup:
     END
 }
 
+TEST(fat16, 9) {
+    FatFs *fs = NULL;
+    FileHandle *file = NULL;
+    char data[200], buffer[200];
+    for (int i = 0; i < 200; i++)
+        data[i] = 'a' + i % 26;
+
+    TEST_TITLE("Creating a 16-bit FAT with too many blocks");
+    TEST_RESULT(fat_init_with_features(TEMP_FILE, 32, 65536, FAT_FEATURE_FAT16), INVALID_BLOCKS_COUNT);
+
+    TEST_TITLE("Creating a file system with a 16-bit FAT");
+    TEST_RESULT(fat_init_with_features(TEMP_FILE, 32, 64, FAT_FEATURE_FAT16), OK);
+    if (fat_open(&fs, TEMP_FILE) != OK) TEST_ABORT("Could not open temp FS");
+    TEST_INT("FAT size", fs->blocks_ptr - (char *)fs->fat_ptr, 64 * 2);
+    TEST_INT("empty entry", fat_get_next_block(fs, 1), FAT_EOF);
+
+    TEST_TITLE("Writing and reading a file through the 16-bit FAT");
+    file_create(fs, "/file");
+    file_open(fs, "/file", &file, "w+");
+    TEST_INT_RESULT(file_write(file, data, 200), 200);
+    TEST_RESULT(file_seek(file, 0, FILE_SEEK_SET), OK);
+    TEST_INT_RESULT(file_read(file, buffer, 200), 200);
+    TEST_INT("same data", memcmp(buffer, data, 200), 0);
+    int num_blocks = 0, block_number;
+    get_file_blocknum(fs, "/file", DIR_ENTRY_FILE, &block_number);
+    for (; block_number != FAT_EOF; block_number = fat_get_next_block(fs, block_number))
+        num_blocks++;
+    TEST_INT("blocks in the chain", num_blocks, 7);
+
+cleanup:
+    file_close(file);
+    if (fs) fat_close(fs);
+    END
+}
+
 // @author Cicim
-TEST(path_get_absolute, 30) {
+TEST(path_get_absolute, 41) {
     #define TEST_PATH_SUM(text, from, path, expected)                        \
         TEST_TITLE(text ": " from " + " path " = " expected);                \
         strcpy(fs->current_directory, from);                                 \
@@ -390,10 +426,15 @@ TEST(path_get_absolute, 30) {
     TEST_PATH_SUM("Directory up", "/dir/dir", "../test", "/dir/test");
     TEST_PATH_SUM("Same directory", "/dir", ".", "/dir");
     TEST_PATH_SUM("Same directory", "/", "./dir", "/dir");
-    TEST_INVALID_PATH_SUM("Invalid token", "/dir", "...");
+    TEST_PATH_SUM("Components in the middle", "/", "/a/./b/../c", "/a/c");
+    TEST_PATH_SUM("Repeated slashes", "/dir", "a//b/./", "/dir/a/b");
+    TEST_PATH_SUM("Up to the root", "/a/b", "../../c/..", "/");
+    TEST_PATH_SUM("Names starting with dots", "/dir", "...", "/dir/...");
+    TEST_PATH_SUM("Names starting with dots", "/dir", "..dir", "/dir/..dir");
+    TEST_PATH_SUM("Names starting with dots", "/", "/a/..foo/../..bar", "/a/..bar");
     TEST_INVALID_PATH_SUM("Too many directory up", "/", "..");
     TEST_INVALID_PATH_SUM("Too many directory up", "/dir", "../../test");
-    TEST_INVALID_PATH_SUM(".. without the slash", "/dir", "..dir");
+    TEST_INVALID_PATH_SUM("Too many directory up in the middle", "/", "a/../../b");
 
 cleanup:
     fat_close(fs);
@@ -854,7 +895,7 @@ TEST(file_write, 12) {
     PRINT_FAT_LINKS(block_number);
     TEST_INT_RESULT(file_write(file, str, 32), 32);
     PRINT_FAT_LINKS(block_number);
-    TEST_INT("next block", fat_get_next_block(fs, 1), 4);
+    TEST_INT("next block", fat_get_next_block(fs, 1), 3);
     TEST_INT("size", file->fh->size, 32);
 
 
@@ -865,6 +906,1212 @@ cleanup:
     END
 }
 
+TEST(file_write_delayed, 13) {
+    FatFs *fs;
+    FileHandle *file = NULL;
+    char data[100], buffer[300];
+    for (int i = 0; i < 100; i++)
+        data[i] = 'A' + i % 26;
+
+    INIT_TEMP_FS(fs, 128, 64);
+    file_create(fs, "/file");
+    file_open(fs, "/file", &file, "ad");
+
+    TEST_TITLE("Delayed writes only reserve the blocks");
+    TEST_INT_RESULT(file_write(file, data, 100), 100);
+    TEST_INT_RESULT(file_write(file, data, 100), 100);
+    TEST_INT_RESULT(file_write(file, data, 100), 100);
+    TEST_INT("size", file->fh->size, 0);
+    TEST_INT("free blocks", fs->header->free_blocks, 62);
+    TEST_INT("reserved blocks", fs->reserved_blocks, 2);
+
+    TEST_TITLE("Closing the file places the blocks after the last one");
+    // Take the block right after the file
+    file_create(fs, "/other");
+    TEST_RESULT(file_close(file), OK);
+    file = NULL;
+    PRINT_FAT_LINKS(1);
+    TEST_INT("next block", fat_get_next_block(fs, 1), 3);
+    TEST_INT("last block", fat_get_next_block(fs, 3), 4);
+    TEST_INT("reserved blocks", fs->reserved_blocks, 0);
+
+    TEST_TITLE("Reading the delayed writes");
+    file_open(fs, "/file", &file, "r");
+    TEST_INT("size", file->fh->size, 300);
+    TEST_INT_RESULT(file_read(file, buffer, 300), 300);
+    if (memcmp(buffer, data, 100) || memcmp(buffer + 100, data, 100) || memcmp(buffer + 200, data, 100)) {
+        KO_MESSAGE("The data read is different from the data written");
+    } else OK_MESSAGE("The data read is the data written");
+
+cleanup:
+    file_close(file);
+    fat_close(fs);
+    END
+}
+
+TEST(file_flush_error, 11) {
+    FatFs *fs;
+    FileHandle *file = NULL;
+    char data[300], buffer[300];
+    int taken[64], num_taken = 0;
+    for (int i = 0; i < 300; i++)
+        data[i] = 'a' + i % 26;
+
+    INIT_TEMP_FS(fs, 128, 64);
+    file_create(fs, "/file");
+    file_open(fs, "/file", &file, "ad");
+    TEST_INT_RESULT(file_write(file, data, 300), 300);
+
+    TEST_TITLE("A failed flush keeps the delayed writes");
+    // Take every free block, reserved ones included
+    for (int block = 0; block < 64; block++)
+        if (!bitmap_get(fs, block)) {
+            bitmap_set(fs, block, 1);
+            taken[num_taken++] = block;
+        }
+    TEST_RESULT(file_flush(file), NO_FREE_BLOCKS);
+    TEST_INT("pending size", file->pending_size, 300);
+    TEST_INT("reserved blocks", fs->reserved_blocks, 2);
+    TEST_INT("size", file->fh->size, 0);
+
+    TEST_TITLE("Flushing again once there are free blocks");
+    for (int i = 0; i < num_taken; i++)
+        bitmap_set(fs, taken[i], 0);
+    TEST_RESULT(file_flush(file), OK);
+    TEST_INT("size", file->fh->size, 300);
+    file_close(file);
+    file_open(fs, "/file", &file, "r");
+    TEST_INT_RESULT(file_read(file, buffer, 300), 300);
+    if (memcmp(buffer, data, 300)) {
+        KO_MESSAGE("The data read is different from the data written");
+    } else OK_MESSAGE("The data read is the data written");
+    file_close(file);
+
+    TEST_TITLE("Closing the file system returns the flush error");
+    file_open(fs, "/file", &file, "ad");
+    file_write(file, data, 300);
+    for (int block = 0; block < 64; block++)
+        if (!bitmap_get(fs, block))
+            bitmap_set(fs, block, 1);
+    TEST_RESULT(fat_close(fs), NO_FREE_BLOCKS);
+    fs = NULL;
+    TEST_RESULT(file_close(file), OK);
+    file = NULL;
+
+cleanup:
+    file_close(file);
+    if (fs) fat_close(fs);
+    END
+}
+
+TEST(file_erase_delayed, 6) {
+    FatFs *fs;
+    FileHandle *file = NULL, *other = NULL;
+    char data[600], buffer[600];
+    memset(data, 'A', sizeof(data));
+
+    INIT_TEMP_FS(fs, 64, 128);
+    file_open(fs, "/f", &file, "wd+");
+    file_write(file, data, 600);
+
+    TEST_TITLE("Erasing a file drops its delayed writes");
+    TEST_RESULT(file_erase(fs, "/f"), OK);
+    TEST_INT("reserved blocks", fs->reserved_blocks, 0);
+    TEST_INT_RESULT(file_write(file, "A", 1), FILE_ERASED);
+    TEST_RESULT(file_fallocate(file, 0, 100), FILE_ERASED);
+
+    TEST_TITLE("The blocks of the erased file can be used by another one");
+    memset(data, 'B', sizeof(data));
+    file_open(fs, "/g", &other, "rw+");
+    file_write(other, data, 600);
+    TEST_RESULT(file_close(file), OK);
+    file = NULL;
+    file_seek(other, 0, FILE_SEEK_SET);
+    file_read(other, buffer, 600);
+    if (memcmp(buffer, data, 600)) {
+        KO_MESSAGE("The other file was overwritten");
+    } else OK_MESSAGE("The other file keeps its data");
+
+cleanup:
+    file_close(file);
+    file_close(other);
+    fat_close(fs);
+    END
+}
+
+TEST(file_fallocate, 15) {
+    FatFs *fs;
+    FileHandle *file = NULL;
+    char data[200];
+    memset(data, 'x', sizeof(data));
+
+    INIT_TEMP_FS(fs, 64, 64);
+    file_create(fs, "/file");
+    file_open(fs, "/file", &file, "w");
+
+    TEST_TITLE("Preallocating 200 bytes links a run of blocks");
+    TEST_RESULT(file_fallocate(file, 0, 200), OK);
+    PRINT_FAT_LINKS(1);
+    TEST_INT("size", file->fh->size, 0);
+    TEST_INT("next block", fat_get_next_block(fs, 1), 2);
+    TEST_INT("last block", fat_get_next_block(fs, 4), FAT_EOF);
+    TEST_INT("free blocks", fs->header->free_blocks, 59);
+
+    TEST_TITLE("Writing in the preallocated blocks");
+    file_create(fs, "/other");
+    int free_blocks = fs->header->free_blocks;
+    TEST_INT_RESULT(file_write(file, data, 200), 200);
+    TEST_INT("size", file->fh->size, 200);
+    TEST_INT("free blocks", fs->header->free_blocks, free_blocks);
+
+    TEST_TITLE("Writing in the middle truncates the file after the write");
+    TEST_RESULT(file_fallocate(file, 0, 400), OK);
+    TEST_RESULT(file_seek(file, 50, FILE_SEEK_SET), OK);
+    TEST_INT_RESULT(file_write(file, data, 10), 10);
+    TEST_INT("size", file->fh->size, 60);
+    TEST_INT("last block", fat_get_next_block(fs, 2), FAT_EOF);
+    TEST_INT("free blocks", fs->header->free_blocks, free_blocks + 2);
+
+    TEST_TITLE("Preallocating from a negative offset");
+    TEST_RESULT(file_fallocate(file, -1, 10), FALLOCATE_INVALID_ARGUMENT);
+
+cleanup:
+    file_close(file);
+    fat_close(fs);
+    END
+}
+
+TEST(file_extents, 13) {
+    FatFs *fs = NULL;
+    FileHandle *file = NULL;
+    char data[500], buffer[16];
+    for (int i = 0; i < 500; i++)
+        data[i] = 'a' + i % 26;
+
+    TEST_TITLE("Creating file systems with invalid features");
+    TEST_RESULT(fat_init_with_features(TEMP_FILE, 128, 64, 0x20), INVALID_FEATURES);
+    TEST_RESULT(fat_init_with_features(TEMP_FILE, 64, 64, FAT_FEATURE_EXTENTS), INVALID_BLOCK_SIZE);
+
+    TEST_TITLE("Creating a file system with extent maps");
+    TEST_RESULT(fat_init_with_features(TEMP_FILE, 128, 64, FAT_FEATURE_EXTENTS), OK);
+    if (fat_open(&fs, TEMP_FILE) != OK) TEST_ABORT("Could not open temp FS");
+    TEST_INT("features", fs->features, FAT_FEATURE_EXTENTS);
+
+    TEST_TITLE("Writing contiguous blocks makes a single extent");
+    file_create(fs, "/file");
+    file_open(fs, "/file", &file, "w");
+    TEST_INT_RESULT(file_write(file, data, 300), 300);
+    PRINT_FAT_LINKS(1);
+    TEST_INT("extents", FILE_EXTENT_MAP(fs, 1)->count, 1);
+    TEST_INT("blocks", FILE_EXTENT_MAP(fs, 1)->num_blocks, 4);
+
+    TEST_TITLE("Writing after another file's block adds an extent");
+    file_create(fs, "/other");
+    TEST_INT_RESULT(file_write(file, data + 300, 200), 200);
+    PRINT_FAT_LINKS(1);
+    TEST_INT("extents", FILE_EXTENT_MAP(fs, 1)->count, 2);
+    TEST_INT("fifth block", file_block_at(fs, 1, 4), fat_get_next_block(fs, 4));
+
+    TEST_TITLE("Seeking and reading through the extents");
+    TEST_RESULT(file_seek(file, 350, FILE_SEEK_SET), OK);
+    TEST_INT_RESULT(file_read(file, buffer, 10), 10);
+    buffer[10] = 0;
+    TEST_STRINGS(buffer, "mnopqrstuv");
+
+cleanup:
+    file_close(file);
+    if (fs) fat_close(fs);
+    END
+}
+
+TEST(file_block_index, 8) {
+    FatFs *fs;
+    FileHandle *file = NULL;
+    char data[100], buffer[8];
+    for (int i = 0; i < 100; i++)
+        data[i] = 'a' + i % 26;
+
+    INIT_TEMP_FS(fs, 32, 64);
+    file_create(fs, "/file");
+    file_open(fs, "/file", &file, "w");
+    file_write(file, data, 100);
+    file_close(file);
+
+    file_open(fs, "/file", &file, "r");
+
+    TEST_TITLE("Seeking to the start only indexes the first block");
+    TEST_RESULT(file_seek(file, 0, FILE_SEEK_SET), OK);
+    TEST_INT("indexed blocks", file->block_index_count, 1);
+
+    TEST_TITLE("Seeking to the end indexes every block");
+    TEST_RESULT(file_seek(file, 0, FILE_SEEK_END), OK);
+    TEST_INT("indexed blocks", file->block_index_count, 4);
+
+    TEST_TITLE("Seeking back uses the index");
+    TEST_RESULT(file_seek(file, 40, FILE_SEEK_SET), OK);
+    TEST_INT("current block", file->current_block_number, file->block_index[1]);
+    TEST_INT_RESULT(file_read(file, buffer, 4), 4);
+    buffer[4] = 0;
+    TEST_STRINGS(buffer, "opqr");
+
+cleanup:
+    file_close(file);
+    fat_close(fs);
+    END
+}
+
+TEST(file_block_index_shared, 7) {
+    FatFs *fs;
+    FileHandle *a = NULL, *b = NULL, *c = NULL;
+    char data[600], buffer[600];
+    memset(data, 'c', sizeof(data));
+
+    INIT_TEMP_FS(fs, 64, 128);
+    if (file_open(fs, "/a", &a, "w+") != OK || file_open(fs, "/a", &b, "w") != OK)
+        TEST_ABORT("Could not open the file");
+    file_write(a, data, 600);
+    file_seek(a, 450, FILE_SEEK_SET);
+
+    TEST_TITLE("Another handle cutting the file clears the index");
+    TEST_RESULT(change_file_dimension(b, 0), OK);
+    TEST_INT("indexed blocks", a->block_index_count, 1);
+
+    // The freed blocks go to another file, then the first one grows again
+    if (file_open(fs, "/c", &c, "w+") != OK) TEST_ABORT("Could not open the file");
+    file_write(c, data, 600);
+    file_seek(b, 0, FILE_SEEK_SET);
+    file_write(b, data, 500);
+
+    TEST_TITLE("Writing through the first handle stays in its file");
+    TEST_RESULT(file_seek(a, 450, FILE_SEEK_SET), OK);
+    TEST_INT_RESULT(file_write(a, "XXXXXXXXXX", 10), 10);
+    file_seek(c, 0, FILE_SEEK_SET);
+    TEST_INT_RESULT(file_read(c, buffer, 600), 600);
+    TEST_INT("equal bytes", memcmp(buffer, data, 600) == 0, 1);
+
+    TEST_TITLE("Erasing the file clears the index of its handles");
+    file_seek(b, 0, FILE_SEEK_END);
+    file_close(a);
+    a = NULL;
+    file_erase(fs, "/a");
+    TEST_INT("indexed blocks", b->block_index_count, 0);
+
+cleanup:
+    file_close(a);
+    file_close(b);
+    file_close(c);
+    fat_close(fs);
+    END
+}
+
+TEST(file_defrag, 10) {
+    FatFs *fs;
+    FileHandle *file1 = NULL, *file2 = NULL;
+    int moved_blocks, block_number;
+    char data[128], buffer[128];
+    for (int i = 0; i < 128; i++)
+        data[i] = 'a' + i % 26;
+
+    INIT_TEMP_FS(fs, 32, 64);
+
+    // Interleave the blocks of two files
+    file_create(fs, "/file1");
+    file_create(fs, "/file2");
+    file_open(fs, "/file1", &file1, "a");
+    file_open(fs, "/file2", &file2, "a");
+    for (int i = 0; i < 4; i++) {
+        file_write(file1, data + i * 32, 32);
+        file_write(file2, data + i * 32, 32);
+    }
+    file_close(file1);
+    file_close(file2);
+    file1 = file2 = NULL;
+
+    TEST_TITLE("Defragmenting a fragmented file moves all of its blocks");
+    TEST_RESULT(file_defrag(fs, "/file1", &moved_blocks), OK);
+    TEST_INT("moved blocks", moved_blocks, 5);
+
+    TEST_TITLE("The blocks of the file are contiguous");
+    get_file_blocknum(fs, "/file1", DIR_ENTRY_FILE, &block_number);
+    for (int i = 0; i < 4; i++)
+        TEST_INT("next block", fat_get_next_block(fs, block_number + i), block_number + i + 1);
+
+    TEST_TITLE("The data of the file is unchanged");
+    file_open(fs, "/file1", &file1, "r");
+    TEST_INT_RESULT(file_read(file1, buffer, 128), 128);
+    TEST_INT("same data", memcmp(buffer, data, 128), 0);
+
+    TEST_TITLE("Defragmenting a contiguous file moves nothing");
+    TEST_RESULT(file_defrag(fs, "/file1", &moved_blocks), OK);
+    TEST_INT("moved blocks", moved_blocks, 0);
+
+cleanup:
+    file_close(file1);
+    file_close(file2);
+    fat_close(fs);
+    END
+}
+
+TEST(file_defrag_dir, 8) {
+    FatFs *fs = NULL;
+    DirHandle *dir = NULL;
+    DirEntry entry;
+    DirHeader *header;
+    char path[32];
+    int moved_blocks, dir_block;
+
+    if (fat_init_with_features(TEMP_FILE, 64, 128, FAT_FEATURE_DIR_INDEX) != OK) TEST_ABORT("Could not initialize temp FS");
+    if (fat_open(&fs, TEMP_FILE) != OK) TEST_ABORT("Could not open temp FS");
+
+    // The blocks of the files go between the ones of the directory
+    dir_create(fs, "/d");
+    for (int i = 0; i < 20; i++) {
+        sprintf(path, "/d/file%02d", i);
+        file_create(fs, path);
+    }
+
+    TEST_TITLE("Defragmenting a directory while listing it");
+    if (dir_open(fs, "/d", &dir) != OK) TEST_ABORT("Could not open the directory");
+    dir->ordered = 0;
+    for (int i = 0; i < 5; i++)
+        dir_list(dir, &entry);
+    TEST_RESULT(file_defrag(fs, "/d", &moved_blocks), OK);
+    file_create(fs, "/other");
+    int listed = 0;
+    while (dir_list(dir, &entry) == OK)
+        listed++;
+    TEST_INT("elements listed after it", listed, 15);
+    TEST_RESULT(dir_list(dir, &entry), END_OF_DIR);
+
+    TEST_TITLE("The header knows the new tail");
+    get_file_blocknum(fs, "/d", DIR_ENTRY_DIRECTORY, &dir_block);
+    header = DIR_HEADER(fs, dir_block);
+    TEST_INT("known tail", (header->flags & DIR_HEADER_TAIL) != 0, 1);
+    TEST_INT("end block", header->end_block, dir_block + moved_blocks - 1);
+    TEST_INT("block before it", header->end_prev_block, dir_block + moved_blocks - 2);
+    TEST_RESULT(file_create(fs, "/d/last"), OK);
+    TEST_RESULT(file_erase(fs, "/d/file00"), OK);
+
+cleanup:
+    if (dir) dir_close(dir);
+    if (fs) fat_close(fs);
+    END
+}
+
+TEST(dir_index, 11) {
+    FatFs *fs = NULL;
+    DirHandle *dir = NULL;
+    DirEntry entry;
+    char path[32];
+    int free_blocks, dir_block, count = 0;
+
+    TEST_TITLE("Creating a file system with directory indexes");
+    TEST_RESULT(fat_init_with_features(TEMP_FILE, 32, 256, FAT_FEATURE_DIR_INDEX), INVALID_BLOCK_SIZE);
+    TEST_RESULT(fat_init_with_features(TEMP_FILE, 64, 256, FAT_FEATURE_DIR_INDEX), OK);
+    if (fat_open(&fs, TEMP_FILE) != OK) TEST_ABORT("Could not open temp FS");
+    TEST_INT("root header", DIR_HEADER(fs, ROOT_DIR_BLOCK)->type, DIR_ENTRY_HEADER);
+
+    TEST_TITLE("A directory past its first block gets an index");
+    free_blocks = fs->header->free_blocks;
+    dir_create(fs, "/dir");
+    for (int i = 0; i < 20; i++) {
+        sprintf(path, "/dir/file%d", i);
+        file_create(fs, path);
+    }
+    get_file_blocknum(fs, "/dir", DIR_ENTRY_DIRECTORY, &dir_block);
+    if (DIR_HEADER(fs, dir_block)->index_block == FAT_EOF)
+        KO_MESSAGE("The directory has no index");
+    OK_MESSAGE("The directory has an index");
+
+    TEST_TITLE("Listing the directory skips its header");
+    if (dir_open(fs, "/dir", &dir) != OK) TEST_ABORT("Could not open the directory");
+    while (dir_list(dir, &entry) == OK)
+        count++;
+    TEST_INT("listed entries", count, 20);
+
+    TEST_TITLE("Looking names up through the index");
+    TEST_RESULT(file_create(fs, "/dir/file7"), FILE_ALREADY_EXISTS);
+    TEST_RESULT(file_erase(fs, "/dir/file0"), OK);
+    TEST_RESULT(file_erase(fs, "/dir/file0"), FILE_NOT_FOUND);
+    TEST_RESULT(file_erase(fs, "/dir/file19"), OK);
+
+    TEST_TITLE("Erasing the directory frees its index");
+    TEST_RESULT(dir_erase(fs, "/dir"), OK);
+    TEST_INT("free blocks", fs->header->free_blocks, free_blocks);
+
+cleanup:
+    if (dir) dir_close(dir);
+    if (fs) fat_close(fs);
+    END
+}
+
+TEST(dir_index_retry, 11) {
+    FatFs *fs = NULL;
+    FileHandle *file = NULL;
+    DirHeader *header;
+    DirEntry *entry;
+    char path[32];
+    int dir_block, index_block, count = 0;
+
+    if (fat_init_with_features(TEMP_FILE, 64, 256, FAT_FEATURE_DIR_INDEX) != OK) TEST_ABORT("Could not initialize temp FS");
+    if (fat_open(&fs, TEMP_FILE) != OK) TEST_ABORT("Could not open temp FS");
+    dir_create(fs, "/dir");
+    get_file_blocknum(fs, "/dir", DIR_ENTRY_DIRECTORY, &dir_block);
+    header = DIR_HEADER(fs, dir_block);
+
+    // Leave only free blocks on their own
+    for (int block = 0; block < (int)fs->header->blocks_count; block += 2)
+        bitmap_set(fs, block, 1);
+
+    TEST_TITLE("Without a run to grow the index, the old one is kept");
+    while (count < 2) {
+        sprintf(path, "/dir/file%d", count++);
+        file_create(fs, path);
+    }
+    index_block = header->index_block;
+    while (count < 9) {
+        sprintf(path, "/dir/file%d", count++);
+        file_create(fs, path);
+    }
+    TEST_INT("index block", header->index_block, index_block);
+    TEST_INT("failed build", (header->flags & DIR_HEADER_NO_INDEX) != 0, 1);
+    TEST_INT("bits of the entries", header->retry_entries_bits, 4);
+    TEST_RESULT(dir_index_lookup(fs, header, "file8", &entry), OK);
+
+    TEST_TITLE("Freeing a few blocks doesn't make the next insert look for a run");
+    // Blocks 199 to 203 become a run long enough
+    bitmap_set(fs, 200, 0);
+    bitmap_set(fs, 202, 0);
+    sprintf(path, "/dir/file%d", count++);
+    file_create(fs, path);
+    TEST_INT("index block", header->index_block, index_block);
+
+    TEST_TITLE("Freeing many blocks makes the next insert build it");
+    for (int block = 128; block < (int)fs->header->blocks_count; block += 2)
+        bitmap_set(fs, block, 0);
+    sprintf(path, "/dir/file%d", count++);
+    TEST_RESULT(file_create(fs, path), OK);
+    TEST_INT("new index", header->index_block != FAT_EOF && header->index_block != index_block, 1);
+    TEST_INT("failed build", (header->flags & DIR_HEADER_NO_INDEX) != 0, 0);
+
+    TEST_TITLE("An index that can't grow is only dropped when full");
+    for (int block = 128; block < (int)fs->header->blocks_count; block += 2)
+        bitmap_set(fs, block, 1);
+    index_block = header->index_block;
+    while (count < 40) {
+        sprintf(path, "/dir/file%d", count++);
+        file_create(fs, path);
+    }
+    TEST_INT("index block", header->index_block, index_block);
+    while (count < 56) {
+        sprintf(path, "/dir/file%d", count++);
+        file_create(fs, path);
+    }
+    TEST_INT("index block", header->index_block, FAT_EOF);
+    TEST_RESULT(file_open(fs, "/dir/file55", &file, "r"), OK);
+
+cleanup:
+    file_close(file);
+    if (fs) fat_close(fs);
+    END
+}
+
+TEST(dir_list_batch, 8) {
+    FatFs *fs;
+    FileHandle *file = NULL;
+    DirHandle *dir = NULL;
+    DirEntryPlus batch[2];
+    INIT_TEMP_FS(fs, 64, 64);
+
+    dir_create(fs, "/dir");
+    dir_create(fs, "/dir/sub");
+    file_create(fs, "/dir/sub/file");
+    if (file_open(fs, "/dir/file", &file, "w+") != OK) TEST_ABORT("Could not open file");
+    file_write(file, "0123456789", 10);
+    file_close(file);
+    file = NULL;
+    file_create(fs, "/dir/empty");
+
+    TEST_TITLE("Listing the entries with their attributes");
+    if (dir_open(fs, "/dir", &dir) != OK) TEST_ABORT("Could not open the directory");
+    TEST_INT("listed entries", dir_list_batch(dir, batch, 2), 2);
+    TEST_STRINGS(batch[0].entry.name, "sub");
+    TEST_INT("directory blocks", batch[0].blocks, 2);
+    TEST_STRINGS(batch[1].entry.name, "file");
+    TEST_INT("file size", batch[1].size, 10);
+    if (batch[1].date_modified.year < 2000) {
+        KO_MESSAGE("The file has no date");
+    } else OK_MESSAGE("The file has its dates");
+
+    TEST_TITLE("Listing the rest of the directory");
+    TEST_INT("listed entries", dir_list_batch(dir, batch, 2), 1);
+    TEST_INT("listed entries", dir_list_batch(dir, batch, 2), 0);
+
+cleanup:
+    file_close(file);
+    if (dir) dir_close(dir);
+    fat_close(fs);
+    END
+}
+
+TEST(dir_cookie, 10) {
+    FatFs *fs;
+    DirHandle *dir = NULL;
+    DirEntry entry;
+    DirEntryPlus batch[3];
+    DirCookie cookie;
+    char names[64] = "";
+    INIT_TEMP_FS(fs, 64, 64);
+
+    dir_create(fs, "/dir");
+    file_create(fs, "/dir/e");
+    file_create(fs, "/dir/b");
+    file_create(fs, "/dir/f");
+    file_create(fs, "/dir/a");
+    file_create(fs, "/dir/d");
+
+    TEST_TITLE("Only listings in order of name have a position once started");
+    if (dir_open(fs, "/dir", &dir) != OK) TEST_ABORT("Could not open the directory");
+    TEST_RESULT(dir_list(dir, &entry), OK);
+    TEST_RESULT(dir_tell(dir, &cookie), INVALID_COOKIE);
+    dir_close(dir);
+    dir = NULL;
+
+    TEST_TITLE("Listing the first names in order");
+    if (dir_open(fs, "/dir", &dir) != OK) TEST_ABORT("Could not open the directory");
+    TEST_RESULT(dir_tell(dir, &cookie), OK);
+    TEST_RESULT(dir_seek(dir, &cookie), OK);
+    TEST_INT("listed entries", dir_list_batch(dir, batch, 3), 3);
+    TEST_STRINGS(batch[2].entry.name, "d");
+    TEST_RESULT(dir_tell(dir, &cookie), OK);
+    dir_close(dir);
+    dir = NULL;
+
+    TEST_TITLE("Resuming after changing the directory");
+    file_erase(fs, "/dir/a");
+    file_erase(fs, "/dir/e");
+    file_create(fs, "/dir/c");
+    file_create(fs, "/dir/g");
+    if (dir_open(fs, "/dir", &dir) != OK) TEST_ABORT("Could not open the directory");
+    TEST_RESULT(dir_seek(dir, &cookie), OK);
+    while (dir_list(dir, &entry) == OK)
+        strcat(names, entry.name);
+    TEST_STRINGS(names, "fg");
+
+    TEST_TITLE("Resuming from an invalid cookie");
+    memset(&cookie, 'x', sizeof(DirCookie));
+    TEST_RESULT(dir_seek(dir, &cookie), INVALID_COOKIE);
+
+cleanup:
+    if (dir) dir_close(dir);
+    fat_close(fs);
+    END
+}
+
+TEST(dir_list_erase, 3) {
+    FatFs *fs;
+    DirHandle *dir = NULL;
+    DirEntry entry;
+    char path[32];
+    INIT_TEMP_FS(fs, 64, 64);
+
+    dir_create(fs, "/d");
+    for (int i = 0; i < 10; i++) {
+        sprintf(path, "/d/file%d", i);
+        file_create(fs, path);
+    }
+
+    TEST_TITLE("Erasing every element while listing in order of name");
+    if (dir_open(fs, "/d", &dir) != OK) TEST_ABORT("Could not open the directory");
+    TEST_RESULT(dir_list_range(dir, NULL, NULL), OK);
+    int listed = 0;
+    while (dir_list(dir, &entry) == OK) {
+        sprintf(path, "/d/%s", entry.name);
+        if (file_erase(fs, path) == OK)
+            listed++;
+    }
+    TEST_INT("erased elements", listed, 10);
+    dir_close(dir);
+
+    if (dir_open(fs, "/d", &dir) != OK) TEST_ABORT("Could not open the directory");
+    TEST_RESULT(dir_list(dir, &entry), END_OF_DIR);
+
+cleanup:
+    if (dir) dir_close(dir);
+    fat_close(fs);
+    END
+}
+
+TEST(dir_list_pages, 7) {
+    FatFs *fs;
+    DirHandle *dir = NULL;
+    DirEntry entry;
+    char path[32], last[MAX_FILENAME_LENGTH];
+    INIT_TEMP_FS(fs, 128, 1024);
+
+    dir_create(fs, "/d");
+    for (int i = 0; i < 300; i++) {
+        sprintf(path, "/d/f%03d", i * 7 % 300);
+        file_create(fs, path);
+    }
+
+    TEST_TITLE("Listing a large plain directory in order of name");
+    if (dir_open(fs, "/d", &dir) != OK) TEST_ABORT("Could not open the directory");
+    TEST_RESULT(dir_list_range(dir, NULL, NULL), OK);
+    int listed = 0, sorted = 1;
+    last[0] = '\0';
+    while (dir_list(dir, &entry) == OK) {
+        sorted &= strcmp(last, entry.name) < 0;
+        strcpy(last, entry.name);
+        listed++;
+    }
+    TEST_INT("listed elements", listed, 300);
+    TEST_INT("elements in order", sorted, 1);
+    TEST_INT("entries found at a time", dir->page_capacity, DIR_PAGE_MAX);
+
+    TEST_TITLE("Changing the directory while listing it");
+    TEST_RESULT(dir_list_range(dir, NULL, NULL), OK);
+    for (int i = 0; i < 20; i++)
+        dir_list(dir, &entry);
+    file_create(fs, "/d/e");
+    file_create(fs, "/d/g");
+    file_erase(fs, "/d/f020");
+    listed = 0;
+    int found = 0;
+    while (dir_list(dir, &entry) == OK) {
+        found += strcmp(entry.name, "g") == 0;
+        found -= strcmp(entry.name, "e") == 0 || strcmp(entry.name, "f020") == 0;
+        listed++;
+    }
+    TEST_INT("listed elements", listed, 280);
+    TEST_INT("new elements after the last one", found, 1);
+
+cleanup:
+    if (dir) dir_close(dir);
+    fat_close(fs);
+    END
+}
+
+TEST(dir_header_tail, 12) {
+    FatFs *fs = NULL;
+    DirHeader *header;
+    char path[32];
+    int dir_block;
+
+    if (fat_init_with_features(TEMP_FILE, 64, 64, FAT_FEATURE_DIR_INDEX) != OK) TEST_ABORT("Could not initialize temp FS");
+    if (fat_open(&fs, TEMP_FILE) != OK) TEST_ABORT("Could not open temp FS");
+    dir_create(fs, "/dir");
+    get_file_blocknum(fs, "/dir", DIR_ENTRY_DIRECTORY, &dir_block);
+    header = DIR_HEADER(fs, dir_block);
+
+    TEST_TITLE("The header counts the entries");
+    for (int i = 0; i < 4; i++) {
+        sprintf(path, "/dir/file%d", i);
+        file_create(fs, path);
+    }
+    TEST_INT("entries", header->entries, 4);
+    TEST_INT("DIR_END slot", DIR_END_OFFSET(fs, header), 1);
+    TEST_INT("DIR_END block", header->end_block, fat_get_next_block(fs, fat_get_next_block(fs, dir_block)));
+
+    TEST_TITLE("Deleting moves the DIR_END back");
+    TEST_RESULT(file_erase(fs, "/dir/file1"), OK);
+    TEST_INT("entries", header->entries, 3);
+    TEST_INT("DIR_END slot", DIR_END_OFFSET(fs, header), 0);
+    TEST_INT("block before the DIR_END", header->end_prev_block, fat_get_next_block(fs, dir_block));
+
+    TEST_TITLE("Deleting when the DIR_END starts a block uses the block before it");
+    TEST_RESULT(file_erase(fs, "/dir/file0"), OK);
+    TEST_INT("entries", header->entries, 2);
+    TEST_INT("DIR_END block", header->end_block, fat_get_next_block(fs, dir_block));
+
+    TEST_TITLE("Headers without the count get it from the directory");
+    header->flags = 0;
+    header->entries = 0;
+    TEST_RESULT(file_create(fs, "/dir/file4"), OK);
+    TEST_INT("entries", header->entries, 3);
+
+cleanup:
+    if (fs) fat_close(fs);
+    END
+}
+
+// Returns 1 if the stored totals of a path match the ones found by visiting it
+int usage_matches(FatFs *fs, const char *path) {
+    int size, blocks, visited_size, visited_blocks;
+    if (file_size(fs, path, &size, &blocks) != OK)
+        return 0;
+    dir_usage_invalidate(fs);
+    if (file_size(fs, path, &visited_size, &visited_blocks) != OK)
+        return 0;
+    return size == visited_size && blocks == visited_blocks;
+}
+
+TEST(dir_usage, 13) {
+    FatFs *fs = NULL;
+    FileHandle *file = NULL;
+    char data[300] = {0};
+    char path[32];
+    int size, blocks, file_block;
+
+    TEST_TITLE("The usage totals need the header of the directories");
+    TEST_RESULT(fat_init_with_features(TEMP_FILE, 128, 256, FAT_FEATURE_DIR_USAGE), INVALID_FEATURES);
+    TEST_RESULT(fat_init_with_features(TEMP_FILE, 64, 256, FAT_FEATURE_DIR_INDEX | FAT_FEATURE_DIR_USAGE), INVALID_BLOCK_SIZE);
+    TEST_RESULT(fat_init_with_features(TEMP_FILE, 128, 256, FAT_FEATURE_DIR_INDEX | FAT_FEATURE_DIR_USAGE), OK);
+    if (fat_open(&fs, TEMP_FILE) != OK) TEST_ABORT("Could not open temp FS");
+
+    TEST_TITLE("A new directory counts its headers and its DIR_END");
+    dir_create(fs, "/a");
+    file_size(fs, "/", &size, &blocks);
+    TEST_INT("root size", size, 4 * sizeof(DirEntry) + 3 * sizeof(DirEntry));
+    TEST_INT("root blocks", blocks, 2);
+
+    TEST_TITLE("Writing a file updates the directories containing it");
+    dir_create(fs, "/a/b");
+    for (int i = 0; i < 6; i++) {
+        sprintf(path, "/a/b/file%d", i);
+        file_create(fs, path);
+    }
+    if (file_open(fs, "/a/b/file0", &file, "w") != OK) TEST_ABORT("Could not open the file");
+    file_write(file, data, sizeof(data));
+    file_close(file);
+    file = NULL;
+    TEST_INT("matching totals", usage_matches(fs, "/"), 1);
+
+    TEST_TITLE("Moving, copying and erasing keep the totals");
+    file_move(fs, "/a/b", "/b");
+    TEST_INT("matching totals", usage_matches(fs, "/a"), 1);
+    file_copy(fs, "/b", "/a/c");
+    file_erase(fs, "/b/file3");
+    TEST_INT("matching totals", usage_matches(fs, "/"), 1);
+    dir_erase(fs, "/a/c");
+    TEST_INT("matching totals", usage_matches(fs, "/"), 1);
+
+    TEST_TITLE("Files opened by block leave the totals to be computed again");
+    get_file_blocknum(fs, "/b/file0", DIR_ENTRY_FILE, &file_block);
+    if (file_open_by_block(fs, file_block, &file) != OK) TEST_ABORT("Could not open the file");
+    file->can_write = 1;
+    file_seek(file, 0, FILE_SEEK_END);
+    file_write(file, data, sizeof(data));
+    TEST_INT("stale totals", DIR_USAGE(fs, ROOT_DIR_BLOCK)->flags & DIR_USAGE_STALE, DIR_USAGE_STALE);
+    file_size(fs, "/b/file0", &size, &blocks);
+    TEST_INT("file size", size, 2 * sizeof(data));
+    TEST_INT("matching totals", usage_matches(fs, "/"), 1);
+
+    TEST_TITLE("The size of a file in a missing directory is an error");
+    TEST_RESULT(file_size(fs, "/missing/file0", &size, &blocks), FILE_NOT_FOUND);
+
+cleanup:
+    if (file) file_close(file);
+    if (fs) fat_close(fs);
+    END
+}
+
+// What the walk found, and when it should skip or stop
+typedef struct WalkTrace {
+    char paths[256];
+    const char *skip;
+    int stop_after;
+    int count;
+    int max_depth;
+} WalkTrace;
+
+// Appends the path of the element to the trace
+FatWalkAction walk_trace(FatFs *fs, const char *path, const DirEntry *entry, int depth, void *arg) {
+    WalkTrace *trace = arg;
+    strcat(strcat(trace->paths, path), " ");
+    if (depth > trace->max_depth)
+        trace->max_depth = depth;
+
+    if (++trace->count == trace->stop_after)
+        return FAT_WALK_STOP;
+    if (trace->skip && strcmp(path, trace->skip) == 0)
+        return FAT_WALK_SKIP;
+    return FAT_WALK_CONTINUE;
+}
+
+TEST(fat_walk, 10) {
+    FatFs *fs;
+    WalkTrace trace;
+    INIT_TEMP_FS(fs, 64, 64);
+
+    dir_create(fs, "/a");
+    file_create(fs, "/c");
+    file_create(fs, "/a/x");
+    dir_create(fs, "/a/b");
+    file_create(fs, "/a/b/y");
+
+    TEST_TITLE("Walking depth-first");
+    memset(&trace, 0, sizeof(WalkTrace));
+    TEST_RESULT(fat_walk(fs, "/", walk_trace, 0, &trace), OK);
+    TEST_STRINGS(trace.paths, "/a /a/x /a/b /a/b/y /c ");
+    TEST_INT("depth", trace.max_depth, 2);
+
+    TEST_TITLE("Walking breadth-first");
+    memset(&trace, 0, sizeof(WalkTrace));
+    TEST_RESULT(fat_walk(fs, "/", walk_trace, FAT_WALK_BREADTH_FIRST, &trace), OK);
+    TEST_STRINGS(trace.paths, "/a /c /a/x /a/b /a/b/y ");
+    memset(&trace, 0, sizeof(WalkTrace));
+    TEST_RESULT(fat_walk(fs, "/", walk_trace, FAT_WALK_BLOCK_ORDER, &trace), OK);
+    TEST_INT("elements", trace.count, 5);
+
+    TEST_TITLE("Skipping a directory and stopping");
+    memset(&trace, 0, sizeof(WalkTrace));
+    trace.skip = "/a/b";
+    fat_walk(fs, "a", walk_trace, 0, &trace);
+    TEST_STRINGS(trace.paths, "/a/x /a/b ");
+    memset(&trace, 0, sizeof(WalkTrace));
+    trace.stop_after = 2;
+    TEST_INT("walk", fat_walk(fs, "/", walk_trace, 0, &trace), FAT_WALK_STOP);
+
+    TEST_TITLE("Only directories can be walked");
+    TEST_RESULT(fat_walk(fs, "/c", walk_trace, 0, &trace), NOT_A_DIRECTORY);
+
+cleanup:
+    fat_close(fs);
+    END
+}
+
+// Returns the height of a tree of sorted entries
+static int tree_height(DirIndexNode *nodes, uint32_t node) {
+    if (node == 0)
+        return 0;
+    int left = tree_height(nodes, nodes[node].left), right = tree_height(nodes, nodes[node].right);
+    return 1 + (left > right ? left : right);
+}
+
+TEST(dir_sorted_tree, 6) {
+    FatFs *fs = NULL;
+    DirHandle *dir = NULL;
+    DirEntry entry;
+    char path[32], last[MAX_FILENAME_LENGTH];
+    int dir_block;
+
+    if (fat_init_with_features(TEMP_FILE, 128, 2048, FAT_FEATURE_DIR_INDEX | FAT_FEATURE_DIR_SORTED) != OK) TEST_ABORT("Could not initialize temp FS");
+    if (fat_open(&fs, TEMP_FILE) != OK) TEST_ABORT("Could not open temp FS");
+    dir_create(fs, "/dir");
+    get_file_blocknum(fs, "/dir", DIR_ENTRY_DIRECTORY, &dir_block);
+    DirHeader *header = DIR_HEADER(fs, dir_block);
+
+    TEST_TITLE("The sorted entries stay balanced while adding them in order");
+    for (int i = 0; i < 500; i++) {
+        sprintf(path, "/dir/file%03d", i);
+        file_create(fs, path);
+    }
+    DirIndexNode *nodes = (DirIndexNode *)((uint32_t *)(fs->blocks_ptr + header->index_block * fs->header->block_size) + header->index_buckets);
+    TEST_INT("entries", header->index_entries, 500);
+    // An AA tree is at most twice as high as a perfectly balanced one
+    TEST_INT("balanced", tree_height(nodes, ((DirIndexTree *)nodes)->root) <= 2 * 9, 1);
+
+    TEST_TITLE("And while removing them");
+    for (int i = 0; i < 500; i += 3) {
+        sprintf(path, "/dir/file%03d", i);
+        file_erase(fs, path);
+    }
+    TEST_INT("entries", header->index_entries, 333);
+    TEST_INT("balanced", tree_height(nodes, ((DirIndexTree *)nodes)->root) <= 2 * 9, 1);
+
+    TEST_TITLE("The entries left are listed in order");
+    if (dir_open(fs, "/dir", &dir) != OK) TEST_ABORT("Could not open the directory");
+    int listed = 0, sorted = 1;
+    last[0] = '\0';
+    while (dir_list(dir, &entry) == OK) {
+        sorted &= strcmp(last, entry.name) < 0 && atoi(entry.name + 4) % 3 != 0;
+        strcpy(last, entry.name);
+        listed++;
+    }
+    TEST_INT("listed elements", listed, 333);
+    TEST_INT("elements in order", sorted, 1);
+
+cleanup:
+    if (dir) dir_close(dir);
+    if (fs) fat_close(fs);
+    END
+}
+
+// @author Cicim
+TEST(dir_list_range, 8) {
+    FatFs *fs = NULL;
+    DirHandle *dir = NULL;
+    DirEntry entry;
+    char path[32], names[64];
+    const char *files[] = {"c3", "a1", "b2", "a2", "b1", "c1", "a3", "c2", "b3"};
+
+    TEST_TITLE("Sorted directories need an index");
+    TEST_RESULT(fat_init_with_features(TEMP_FILE, 64, 256, FAT_FEATURE_DIR_SORTED), INVALID_FEATURES);
+    TEST_RESULT(fat_init_with_features(TEMP_FILE, 64, 256, FAT_FEATURE_DIR_INDEX | FAT_FEATURE_DIR_SORTED), OK);
+    if (fat_open(&fs, TEMP_FILE) != OK) TEST_ABORT("Could not open temp FS");
+
+    dir_create(fs, "/dir");
+    for (int i = 0; i < 9; i++) {
+        sprintf(path, "/dir/%s", files[i]);
+        file_create(fs, path);
+    }
+    file_erase(fs, "/dir/b2");
+
+    TEST_TITLE("A sorted directory is listed in order");
+    if (dir_open(fs, "/dir", &dir) != OK) TEST_ABORT("Could not open the directory");
+    names[0] = '\0';
+    while (dir_list(dir, &entry) == OK)
+        strcat(strcat(names, entry.name), " ");
+    TEST_STRINGS(names, "a1 a2 a3 b1 b3 c1 c2 c3 ");
+
+    TEST_TITLE("Listing from a name");
+    TEST_RESULT(dir_list_range(dir, "b2", NULL), OK);
+    names[0] = '\0';
+    while (dir_list(dir, &entry) == OK)
+        strcat(strcat(names, entry.name), " ");
+    TEST_STRINGS(names, "b3 c1 c2 c3 ");
+
+    TEST_TITLE("Listing the names with a prefix");
+    TEST_RESULT(dir_list_range(dir, NULL, "a"), OK);
+    names[0] = '\0';
+    while (dir_list(dir, &entry) == OK)
+        strcat(strcat(names, entry.name), " ");
+    TEST_STRINGS(names, "a1 a2 a3 ");
+    dir_close(dir);
+    dir = NULL;
+    fat_close(fs);
+    fs = NULL;
+
+    TEST_TITLE("Listing a plain directory in order");
+    INIT_TEMP_FS(fs, 32, 64);
+    for (int i = 0; i < 9; i++) {
+        sprintf(path, "/%s", files[i]);
+        file_create(fs, path);
+    }
+    if (dir_open(fs, "/", &dir) != OK) TEST_ABORT("Could not open the directory");
+    dir_list_range(dir, "a2", "a");
+    names[0] = '\0';
+    while (dir_list(dir, &entry) == OK)
+        strcat(strcat(names, entry.name), " ");
+    TEST_STRINGS(names, "a2 a3 ");
+
+cleanup:
+    if (dir) dir_close(dir);
+    if (fs) fat_close(fs);
+    END
+}
+
+TEST(dir_cache, 7) {
+    FatFs *fs;
+    FileHandle *file = NULL;
+    DirEntry *entry, *cached;
+    DirHandle dir;
+    int dir_block;
+    INIT_TEMP_FS(fs, 32, 64);
+
+    dir_create(fs, "/dir");
+    file_create(fs, "/dir/file1");
+    file_create(fs, "/dir/file2");
+    get_file_blocknum(fs, "/dir", DIR_ENTRY_DIRECTORY, &dir_block);
+
+    TEST_TITLE("Found entries are cached");
+    TEST_RESULT(dir_get_entry(fs, dir_block, "file2", &entry, &dir), OK);
+    if (dir_cache_lookup(fs, dir_block, "file2", &cached) != DIR_CACHE_FOUND || cached != entry)
+        KO_MESSAGE("The entry is not in the cache");
+    OK_MESSAGE("The entry is in the cache");
+
+    TEST_TITLE("Deleting an entry caches the one moved in its place");
+    TEST_RESULT(file_erase(fs, "/dir/file1"), OK);
+    if (dir_cache_lookup(fs, dir_block, "file1", &cached) == DIR_CACHE_FOUND
+        || dir_cache_lookup(fs, dir_block, "file2", &cached) != DIR_CACHE_FOUND
+        || strcmp(cached->name, "file2") != 0) {
+        KO_MESSAGE("The cache has stale entries");
+    } else OK_MESSAGE("The cache has no stale entries");
+
+    TEST_TITLE("Opening through the cache after erasing the directory");
+    TEST_RESULT(file_open(fs, "/dir/file2", &file, "r"), OK);
+    file_close(file);
+    file = NULL;
+    TEST_RESULT(dir_erase(fs, "/dir"), OK);
+    TEST_RESULT(file_open(fs, "/dir/file2", &file, "r"), FILE_NOT_FOUND);
+
+cleanup:
+    file_close(file);
+    fat_close(fs);
+    END
+}
+
+TEST(dir_negative_cache, 10) {
+    FatFs *fs;
+    FileHandle *file = NULL;
+    DirEntry *entry;
+    DirHandle dir;
+    char path[32];
+    int dir_block, found = 0;
+    INIT_TEMP_FS(fs, 32, 64);
+
+    dir_create(fs, "/dir");
+    file_create(fs, "/dir/file1");
+    file_create(fs, "/dir/file2");
+    get_file_blocknum(fs, "/dir", DIR_ENTRY_DIRECTORY, &dir_block);
+
+    TEST_TITLE("Missing names are cached");
+    TEST_RESULT(dir_get_entry(fs, dir_block, "missing", &entry, &dir), FILE_NOT_FOUND);
+    if (dir_cache_lookup(fs, dir_block, "missing", &entry) != DIR_CACHE_MISSING) {
+        KO_MESSAGE("The missing name is not in the cache");
+    } else OK_MESSAGE("The missing name is in the cache");
+
+    TEST_TITLE("The Bloom filter of the directory rules out other names");
+    if (dir_cache_lookup(fs, dir_block, "other", &entry) != DIR_CACHE_MISSING) {
+        KO_MESSAGE("The name is not ruled out");
+    } else OK_MESSAGE("The name is ruled out");
+    if (dir_cache_lookup(fs, dir_block, "file1", &entry) == DIR_CACHE_MISSING) {
+        KO_MESSAGE("An existing name is ruled out");
+    } else OK_MESSAGE("The existing names are not ruled out");
+
+    TEST_TITLE("Creating a missing name replaces it in the cache");
+    TEST_RESULT(file_create(fs, "/dir/missing"), OK);
+    TEST_RESULT(file_open(fs, "/dir/missing", &file, "r"), OK);
+    file_close(file);
+    file = NULL;
+
+    TEST_TITLE("Erased names are missing");
+    TEST_RESULT(file_erase(fs, "/dir/missing"), OK);
+    if (dir_cache_lookup(fs, dir_block, "missing", &entry) != DIR_CACHE_MISSING) {
+        KO_MESSAGE("The erased name is not missing");
+    } else OK_MESSAGE("The erased name is missing");
+    TEST_RESULT(file_open(fs, "/dir/missing", &file, "r"), FILE_NOT_FOUND);
+
+    TEST_TITLE("Names added past the size of the filter are found");
+    for (int i = 0; i < 20; i++) {
+        sprintf(path, "/dir/new%d", i);
+        file_create(fs, path);
+    }
+    for (int i = 0; i < 20; i++) {
+        sprintf(path, "/dir/new%d", i);
+        if (file_open(fs, path, &file, "r") == OK)
+            found++;
+        file_close(file);
+        file = NULL;
+    }
+    TEST_INT("found files", found, 20);
+
+cleanup:
+    file_close(file);
+    fat_close(fs);
+    END
+}
+
+TEST(dir_delete_moves_last, 5) {
+    FatFs *fs;
+    DirHandle *dir = NULL;
+    DirEntry entry;
+    char path[32];
+    int dir_block, free_blocks, count = 0;
+    INIT_TEMP_FS(fs, 64, 64);
+
+    dir_create(fs, "/dir");
+    for (int i = 0; i < 4; i++) {
+        sprintf(path, "/dir/file%d", i);
+        file_create(fs, path);
+    }
+    get_file_blocknum(fs, "/dir", DIR_ENTRY_DIRECTORY, &dir_block);
+    free_blocks = fs->header->free_blocks;
+
+    TEST_TITLE("Deleting the first entry moves the last one in its place");
+    TEST_RESULT(file_erase(fs, "/dir/file0"), OK);
+    TEST_STRINGS(((DirEntry *)fs->blocks_ptr + dir_block * ENTRIES_PER_BLOCK(fs))->name, "file3");
+
+    TEST_TITLE("The block left without entries is freed");
+    TEST_INT("free blocks", fs->header->free_blocks, free_blocks + 2);
+
+    TEST_TITLE("Listing the remaining entries");
+    if (dir_open(fs, "/dir", &dir) != OK) TEST_ABORT("Could not open the directory");
+    while (dir_list(dir, &entry) == OK)
+        count++;
+    TEST_INT("listed entries", count, 3);
+    TEST_RESULT(file_erase(fs, "/dir/file3"), OK);
+
+cleanup:
+    if (dir) dir_close(dir);
+    fat_close(fs);
+    END
+}
+
+TEST(dir_at, 17) {
+    FatFs *fs;
+    DirHandle *dir = NULL;
+    FileHandle *file = NULL;
+    DirEntry entry;
+    INIT_TEMP_FS(fs, 64, 64);
+
+    dir_create(fs, "/base");
+    dir_create(fs, "/other");
+    if (dir_open(fs, "/base", &dir) != OK) TEST_ABORT("Could not open the directory");
+
+    // The current directory is not used by relative paths
+    dir_change(fs, "/other");
+
+    TEST_TITLE("Create relative to the directory");
+    TEST_RESULT(file_create_at(dir, "file"), OK);
+    TEST_RESULT(dir_create_at(dir, "./sub"), OK);
+    TEST_RESULT(file_create_at(dir, "sub/../sub/inner"), OK);
+    TEST_EXISTS("/base/file", DIR_ENTRY_FILE, NULL);
+    TEST_EXISTS("/base/sub/inner", DIR_ENTRY_FILE, NULL);
+    TEST_RESULT(file_create_at(dir, "file"), FILE_ALREADY_EXISTS);
+
+    TEST_TITLE("Open relative to the directory");
+    TEST_RESULT(file_open_at(dir, "new", &file, "w+"), OK);
+    TEST_INT_RESULT(file_write(file, "data", 4), 4);
+    file_close(file);
+    file = NULL;
+    TEST_RESULT(file_open_at(dir, "missing", &file, "r"), FILE_NOT_FOUND);
+
+    TEST_TITLE("Look up entries relative to the directory");
+    TEST_RESULT(dir_list_at(dir, "sub/inner", &entry), OK);
+    TEST_STRINGS(entry.name, "inner");
+    TEST_RESULT(dir_list_at(dir, "/other", &entry), OK);
+    TEST_RESULT(dir_list_at(dir, "inner", &entry), FILE_NOT_FOUND);
+
+    TEST_TITLE("Paths can't go above the directory");
+    TEST_RESULT(file_create_at(dir, "../file"), INVALID_PATH);
+    TEST_RESULT(dir_list_at(dir, ".", &entry), INVALID_PATH);
+
+    TEST_TITLE("Erase relative to the directory");
+    TEST_RESULT(file_erase_at(dir, "sub/inner"), OK);
+    TEST_RESULT(dir_list_at(dir, "sub/inner", &entry), FILE_NOT_FOUND);
+
+cleanup:
+    dir_close(dir);
+    fat_close(fs);
+    END
+}
+
+TEST(file_copy_undo, 6) {
+    FatFs *fs;
+    FileHandle *file = NULL;
+    INIT_TEMP_FS(fs, 64, 64);
+
+    // Preallocated blocks are not counted in the size of /dir,
+    // so the copy fails only once the big file is reached
+    dir_create(fs, "/dir");
+    file_create(fs, "/dir/file");
+    dir_create(fs, "/dir/subdir");
+    file_create(fs, "/dir/subdir/file");
+    if (file_open(fs, "/dir/big", &file, "w+") != OK) TEST_ABORT("Could not open the file");
+    file_fallocate(file, 0, 40 * 64);
+    file_close(file);
+    int free_blocks = fs->header->free_blocks;
+
+    TEST_TITLE("A copy that can't be completed leaves nothing behind");
+    TEST_RESULT(file_copy(fs, "/dir", "/copy"), NO_FREE_BLOCKS);
+    TEST_INT("free blocks", fs->header->free_blocks, free_blocks);
+    TEST_RESULT(dir_erase(fs, "/copy"), FILE_NOT_FOUND);
+    TEST_EXISTS("/dir/subdir/file", DIR_ENTRY_FILE, NULL);
+
+    TEST_TITLE("A copy over a name already used leaves nothing behind");
+    dir_create(fs, "/other");
+    dir_create(fs, "/other/subdir");
+    free_blocks = fs->header->free_blocks;
+    TEST_RESULT(file_copy(fs, "/dir/subdir", "/other"), FILE_ALREADY_EXISTS);
+    TEST_INT("free blocks", fs->header->free_blocks, free_blocks);
+
+cleanup:
+    fat_close(fs);
+    END
+}
+
 // @author Cicim
 TEST(file_move, 20) {
     FatFs *fs;
@@ -1095,6 +2342,141 @@ cleanup:
 }
 
 
+TEST(bitmap_alloc_run, 13) {
+    FatFs *fs;
+    int first_block;
+    INIT_TEMP_FS(fs, 32, 64);
+
+    // Leave the free runs 1-2, 4-5 and 7-63
+    bitmap_set(fs, 3, 1);
+    bitmap_set(fs, 6, 1);
+
+    TEST_TITLE("Allocating 4 blocks skips the shorter runs");
+    TEST_INT("run length", bitmap_alloc_run(fs, -1, 4, &first_block), 4);
+    TEST_INT("first block", first_block, 7);
+    PRINT_FAT_LINKS(first_block);
+    TEST_INT("next block", fat_get_next_block(fs, 7), 8);
+    TEST_INT("last block", fat_get_next_block(fs, 10), FAT_EOF);
+
+    TEST_TITLE("Allocating more blocks than a run returns the longest");
+    TEST_INT("run length", bitmap_alloc_run(fs, -1, 100, &first_block), 53);
+    TEST_INT("first block", first_block, 11);
+    TEST_INT("free blocks", fs->header->free_blocks, 4);
+
+    TEST_TITLE("Allocating 2 blocks takes the first run");
+    TEST_INT("run length", bitmap_alloc_run(fs, -1, 2, &first_block), 2);
+    TEST_INT("first block", first_block, 1);
+    if (!bitmap_get(fs, 1) || !bitmap_get(fs, 2)) {
+        KO_MESSAGE("The run was not marked in the bitmap");
+    } else OK_MESSAGE("The run was marked in the bitmap");
+
+    TEST_TITLE("Allocating 4 blocks with a run of 2 left");
+    TEST_INT("run length", bitmap_alloc_run(fs, -1, 4, &first_block), 2);
+    TEST_INT("first block", first_block, 4);
+
+    TEST_TITLE("Allocating with no free blocks");
+    TEST_INT("run length", bitmap_alloc_run(fs, -1, 1, &first_block), 0);
+
+cleanup:
+    fat_close(fs);
+    END
+}
+
+
+TEST(bitmap_set_range, 5) {
+    FatFs *fs;
+    INIT_TEMP_FS(fs, 32, 128);
+
+    TEST_TITLE("Occupying a range across two bitmap words");
+    bitmap_set_range(fs, 60, 11, 1);
+    TEST_INT("free blocks", fs->header->free_blocks, 116);
+    if (bitmap_get(fs, 59) || !bitmap_get(fs, 60) || !bitmap_get(fs, 70) || bitmap_get(fs, 71)) {
+        KO_MESSAGE("The range was not marked in the bitmap");
+    } else OK_MESSAGE("The range was marked in the bitmap");
+
+    TEST_TITLE("Freeing and occupying partially free ranges");
+    bitmap_set_range(fs, 62, 4, 0);
+    TEST_INT("free blocks", fs->header->free_blocks, 120);
+    bitmap_set_range(fs, 58, 15, 1);
+    TEST_INT("free blocks", fs->header->free_blocks, 112);
+
+    TEST_TITLE("Unlinking a chain made of two runs");
+    bitmap_set_range(fs, 100, 1, 1);
+    for (int i = 58; i < 72; i++)
+        fat_set_next_block(fs, i, i + 1);
+    fat_set_next_block(fs, 72, 100);
+    fat_unlink(fs, 58);
+    TEST_INT("free blocks", fs->header->free_blocks, 127);
+
+cleanup:
+    fat_close(fs);
+    END
+}
+
+TEST(bitmap_alloc_goal, 6) {
+    FatFs *fs;
+    int first_block;
+    INIT_TEMP_FS(fs, 32, 64);
+
+    // Leave the free runs 1-2, 4-5 and 7-63
+    bitmap_set(fs, 3, 1);
+    bitmap_set(fs, 6, 1);
+
+    TEST_TITLE("Allocating at a free goal block continues from it");
+    TEST_INT("run length", bitmap_alloc_run(fs, 4, 4, &first_block), 2);
+    TEST_INT("first block", first_block, 4);
+
+    TEST_TITLE("Allocating at an occupied goal block takes the next run");
+    TEST_INT("run length", bitmap_alloc_run(fs, 3, 2, &first_block), 2);
+    TEST_INT("first block", first_block, 7);
+
+    TEST_TITLE("Allocating without a valid goal block");
+    TEST_INT("run length", bitmap_alloc_run(fs, 64, 1, &first_block), 1);
+    TEST_INT("first block", first_block, 1);
+
+cleanup:
+    fat_close(fs);
+    END
+}
+
+TEST(fat_set_allocator, 10) {
+    FatFs *fs;
+    int first_block;
+    INIT_TEMP_FS(fs, 32, 64);
+
+    // Leave the free runs 1-2, 4-5, 7-9 and 11-63
+    bitmap_set(fs, 3, 1);
+    bitmap_set(fs, 6, 1);
+    bitmap_set(fs, 10, 1);
+
+    TEST_TITLE("Selecting an unknown allocator");
+    TEST_INT("result", fat_set_allocator(fs, 42), INVALID_ALLOCATOR);
+
+    TEST_TITLE("Allocating 3 blocks with best fit");
+    TEST_INT("result", fat_set_allocator(fs, FAT_ALLOC_BEST_FIT), OK);
+    TEST_INT("run length", bitmap_alloc_run(fs, -1, 3, &first_block), 3);
+    TEST_INT("first block", first_block, 7);
+
+    TEST_TITLE("Allocating 2 blocks with first fit");
+    TEST_INT("result", fat_set_allocator(fs, FAT_ALLOC_FIRST_FIT), OK);
+    TEST_INT("run length", bitmap_alloc_run(fs, -1, 2, &first_block), 2);
+    TEST_INT("first block", first_block, 1);
+
+    TEST_TITLE("Freed blocks are merged with the free runs around them");
+    bitmap_set(fs, 1, 0);
+    bitmap_set(fs, 2, 0);
+    bitmap_set(fs, 3, 0);
+    TEST_INT("run length", bitmap_alloc_run(fs, -1, 5, &first_block), 5);
+    TEST_INT("first block", first_block, 1);
+
+    TEST_TITLE("Going back to the bitmap allocator");
+    TEST_INT("result", fat_set_allocator(fs, FAT_ALLOC_BITMAP), OK);
+
+cleanup:
+    fat_close(fs);
+    END
+}
+
 /**
  * Test selector
  */
@@ -1102,6 +2484,11 @@ cleanup:
 const struct TestData tests[] = {
     TEST_ENTRY(fat_init),
     TEST_ENTRY(fat_open),
+    TEST_ENTRY(fat16),
+    TEST_ENTRY(bitmap_alloc_run),
+    TEST_ENTRY(bitmap_alloc_goal),
+    TEST_ENTRY(bitmap_set_range),
+    TEST_ENTRY(fat_set_allocator),
     TEST_ENTRY(path_get_absolute),
     TEST_ENTRY(path_get_components),
     TEST_ENTRY(dir_create),
@@ -1112,8 +2499,33 @@ const struct TestData tests[] = {
     TEST_ENTRY(dir_erase),
     TEST_ENTRY(file_open),
     TEST_ENTRY(file_write),
+    TEST_ENTRY(file_write_delayed),
+    TEST_ENTRY(file_flush_error),
+    TEST_ENTRY(file_erase_delayed),
+    TEST_ENTRY(file_fallocate),
+    TEST_ENTRY(file_extents),
+    TEST_ENTRY(dir_index),
+    TEST_ENTRY(dir_index_retry),
+    TEST_ENTRY(dir_list_range),
+    TEST_ENTRY(dir_sorted_tree),
+    TEST_ENTRY(dir_list_batch),
+    TEST_ENTRY(dir_cookie),
+    TEST_ENTRY(dir_list_erase),
+    TEST_ENTRY(dir_list_pages),
+    TEST_ENTRY(dir_header_tail),
+    TEST_ENTRY(dir_usage),
+    TEST_ENTRY(fat_walk),
+    TEST_ENTRY(dir_cache),
+    TEST_ENTRY(dir_negative_cache),
+    TEST_ENTRY(dir_delete_moves_last),
     TEST_ENTRY(file_move),
+    TEST_ENTRY(dir_at),
+    TEST_ENTRY(file_copy_undo),
     TEST_ENTRY(file_seek),
+    TEST_ENTRY(file_block_index),
+    TEST_ENTRY(file_block_index_shared),
+    TEST_ENTRY(file_defrag),
+    TEST_ENTRY(file_defrag_dir),
     TEST_ENTRY(file_read),
 };
 